@@ -0,0 +1,195 @@
+/*
+ * Guest ram backing.
+ * author: rkroshan
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+#include <linux/memfd.h>
+#include "guest_ram.h"
+
+#define SIZE_2M (2UL << 20)
+#define SIZE_1G (1UL << 30)
+
+/*backing is kind, kind:2M or kind:1G: returns the huge page size, 0 for anything else*/
+static size_t huge_size(const char *backing, const char *kind) {
+    size_t len = strlen(kind);
+
+    if (strncmp(backing, kind, len) != 0)
+        return 0;
+    if (backing[len] == '\0' || strcmp(backing + len, ":2M") == 0)
+        return SIZE_2M;
+    if (strcmp(backing + len, ":1G") == 0)
+        return SIZE_1G;
+    return 0;
+}
+
+static int huge_flags(size_t page_size) {
+    return page_size == SIZE_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+}
+
+static void *ram_anon(struct guest_ram *ram, size_t size) {
+    ram->size = size;
+    ram->page_size = getpagesize();
+    return mmap(NULL, ram->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+/*anonymous memory, THP asked for with madvise, aligned to 2M so whole huge pages fit*/
+static void *ram_thp(struct guest_ram *ram, size_t size) {
+    size_t len = (size + SIZE_2M - 1) & ~(SIZE_2M - 1);
+    char *map = mmap(NULL, len + SIZE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (map == MAP_FAILED)
+        return MAP_FAILED;
+
+    /*trim the head and tail so the mapping starts on a 2M boundary*/
+    char *aligned = (char *)(((unsigned long)map + SIZE_2M - 1) & ~(SIZE_2M - 1));
+    if (aligned > map)
+        munmap(map, aligned - map);
+    munmap(aligned + len, map + SIZE_2M - aligned);
+
+    if (madvise(aligned, len, MADV_HUGEPAGE) < 0)
+        perror("madvise MADV_HUGEPAGE"); /*not fatal, the memory is still usable*/
+    ram->size = len;
+    ram->page_size = SIZE_2M;
+    return aligned;
+}
+
+static void *ram_hugetlb(struct guest_ram *ram, size_t size, size_t page_size) {
+    ram->page_size = page_size;
+    ram->size = (size + page_size - 1) & ~(page_size - 1);
+    return mmap(NULL, ram->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | huge_flags(page_size), -1, 0);
+}
+
+/*memfd backed ram, with hugetlb pages when page_size is not 0*/
+static void *ram_memfd(struct guest_ram *ram, size_t size, size_t page_size) {
+    unsigned int flags = MFD_CLOEXEC;
+    void *addr;
+
+    if (page_size)
+        flags |= MFD_HUGETLB | (page_size == SIZE_1G ? MFD_HUGE_1GB : MFD_HUGE_2MB);
+    ram->page_size = page_size ? page_size : (size_t)getpagesize();
+    ram->size = (size + ram->page_size - 1) & ~(ram->page_size - 1);
+
+    ram->fd = memfd_create("guest_ram", flags);
+    if (ram->fd < 0)
+        return MAP_FAILED;
+    if (ftruncate(ram->fd, ram->size) < 0) {
+        close(ram->fd);
+        ram->fd = -1;
+        return MAP_FAILED;
+    }
+
+    addr = mmap(NULL, ram->size, PROT_READ | PROT_WRITE, MAP_SHARED, ram->fd, 0);
+    if (addr == MAP_FAILED) {
+        close(ram->fd);
+        ram->fd = -1;
+    }
+    return addr;
+}
+
+/*map size bytes of guest ram with the given backing:
+ *anon, thp, hugetlb[:2M|:1G], memfd or memfd-hugetlb[:2M|:1G]
+ *hugetlb backings that can not get huge pages fall back to thp*/
+int guest_ram_alloc(struct guest_ram *ram, size_t size, const char *backing) {
+    size_t page_size;
+    void *addr;
+
+    memset(ram, 0, sizeof(struct guest_ram));
+    ram->fd = -1;
+    if (backing == NULL)
+        backing = "anon";
+    snprintf(ram->backing, sizeof(ram->backing), "%s", backing);
+
+    if (strcmp(backing, "anon") == 0) {
+        addr = ram_anon(ram, size);
+    } else if (strcmp(backing, "thp") == 0) {
+        addr = ram_thp(ram, size);
+    } else if ((page_size = huge_size(backing, "hugetlb")) != 0) {
+        addr = ram_hugetlb(ram, size, page_size);
+    } else if ((page_size = huge_size(backing, "memfd-hugetlb")) != 0) {
+        addr = ram_memfd(ram, size, page_size);
+    } else if (strcmp(backing, "memfd") == 0) {
+        addr = ram_memfd(ram, size, 0);
+    } else {
+        fprintf(stderr, "unknown ram backing: %s\n", backing);
+        return -1;
+    }
+
+    if (addr == MAP_FAILED && strstr(backing, "hugetlb")) {
+        perror("can not get hugetlb pages for guest ram, falling back to thp");
+        snprintf(ram->backing, sizeof(ram->backing), "thp");
+        addr = ram_thp(ram, size);
+    }
+
+    if (addr == MAP_FAILED) {
+        perror("can not mmap ram");
+        return -1;
+    }
+    ram->addr = addr;
+    return 0;
+}
+
+/*size bytes of fd at offset mapped MAP_PRIVATE as guest ram, guest writes never reach the file.
+ *the ram owns fd from now on*/
+int guest_ram_map_file(struct guest_ram *ram, int fd, off_t offset, size_t size) {
+    memset(ram, 0, sizeof(struct guest_ram));
+    snprintf(ram->backing, sizeof(ram->backing), "file");
+    ram->fd = fd;
+    ram->size = size;
+    ram->page_size = getpagesize();
+    ram->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (ram->addr == MAP_FAILED) {
+        perror("can not mmap ram from file");
+        ram->addr = NULL;
+        close(fd);
+        ram->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*copy on write view of a memfd backed template: the pages are shared until the guest writes them.
+ *the template keeps its fd, it has to outlive the clone*/
+int guest_ram_clone(struct guest_ram *ram, const struct guest_ram *template) {
+    if (template->fd < 0) {
+        fprintf(stderr, "only memfd backed ram can be cloned\n");
+        return -1;
+    }
+    memset(ram, 0, sizeof(struct guest_ram));
+    snprintf(ram->backing, sizeof(ram->backing), "clone");
+    ram->fd = -1;
+    ram->size = template->size;
+    ram->page_size = template->page_size;
+    ram->addr = mmap(NULL, ram->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, template->fd, 0);
+    if (ram->addr == MAP_FAILED) {
+        perror("can not mmap ram clone");
+        ram->addr = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*drop every page the guest wrote: a clone or a file mapping reads its file again, anonymous ram reads zero*/
+int guest_ram_discard(struct guest_ram *ram) {
+    if (madvise(ram->addr, ram->size, MADV_DONTNEED) < 0) {
+        perror("madvise MADV_DONTNEED");
+        return -1;
+    }
+    return 0;
+}
+
+void guest_ram_free(struct guest_ram *ram) {
+    if (ram->addr)
+        munmap(ram->addr, ram->size);
+    if (ram->fd >= 0)
+        close(ram->fd);
+    ram->addr = NULL;
+    ram->fd = -1;
+}
@@ -0,0 +1,27 @@
+/*
+ * Guest ram backing: plain anonymous 4K pages, transparent huge pages,
+ * hugetlb (anonymous or memfd) at 2M/1G, or a plain memfd.
+ * author: rkroshan
+ */
+
+#ifndef GUEST_RAM_H
+#define GUEST_RAM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct guest_ram {
+    void *addr; /*host virtual address of guest ram*/
+    size_t size; /*mapped size, the requested size rounded up to page_size*/
+    size_t page_size; /*page size of the backing*/
+    int fd; /*memfd behind the mapping, -1 for anonymous memory*/
+    char backing[32]; /*backing actually in use, after any fallback*/
+};
+
+int guest_ram_alloc(struct guest_ram *ram, size_t size, const char *backing);
+int guest_ram_map_file(struct guest_ram *ram, int fd, off_t offset, size_t size);
+int guest_ram_clone(struct guest_ram *ram, const struct guest_ram *template);
+int guest_ram_discard(struct guest_ram *ram);
+void guest_ram_free(struct guest_ram *ram);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Per vcpu exit accounting and KVM_RUN latency histograms.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/kvm.h>
+#include "vcpu_stats.h"
+
+static const char *exit_names[VCPU_STATS_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "KVM_EXIT_UNKNOWN",
+    [KVM_EXIT_EXCEPTION] = "KVM_EXIT_EXCEPTION",
+    [KVM_EXIT_IO] = "KVM_EXIT_IO",
+    [KVM_EXIT_HYPERCALL] = "KVM_EXIT_HYPERCALL",
+    [KVM_EXIT_DEBUG] = "KVM_EXIT_DEBUG",
+    [KVM_EXIT_HLT] = "KVM_EXIT_HLT",
+    [KVM_EXIT_MMIO] = "KVM_EXIT_MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "KVM_EXIT_IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN] = "KVM_EXIT_SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY] = "KVM_EXIT_FAIL_ENTRY",
+    [KVM_EXIT_INTR] = "KVM_EXIT_INTR",
+    [KVM_EXIT_SET_TPR] = "KVM_EXIT_SET_TPR",
+    [KVM_EXIT_TPR_ACCESS] = "KVM_EXIT_TPR_ACCESS",
+    [KVM_EXIT_NMI] = "KVM_EXIT_NMI",
+    [KVM_EXIT_INTERNAL_ERROR] = "KVM_EXIT_INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT] = "KVM_EXIT_SYSTEM_EVENT",
+    [KVM_EXIT_IOAPIC_EOI] = "KVM_EXIT_IOAPIC_EOI",
+    [KVM_EXIT_HYPERV] = "KVM_EXIT_HYPERV",
+    [KVM_EXIT_X86_RDMSR] = "KVM_EXIT_X86_RDMSR",
+    [KVM_EXIT_X86_WRMSR] = "KVM_EXIT_X86_WRMSR",
+    [KVM_EXIT_DIRTY_RING_FULL] = "KVM_EXIT_DIRTY_RING_FULL",
+    [KVM_EXIT_X86_BUS_LOCK] = "KVM_EXIT_X86_BUS_LOCK",
+    [KVM_EXIT_NOTIFY] = "KVM_EXIT_NOTIFY",
+    [VCPU_STATS_EXIT_REASONS - 1] = "KVM_EXIT_OTHER",
+};
+
+static const struct vcpu_stats_report *dump_report; /*report the SIGUSR1 thread dumps*/
+
+const char *vcpu_stats_exit_name(int reason) {
+    static char unnamed[VCPU_STATS_EXIT_REASONS][16];
+
+    if (reason < 0 || reason >= VCPU_STATS_EXIT_REASONS)
+        reason = VCPU_STATS_EXIT_REASONS - 1;
+    if (exit_names[reason] == NULL) {
+        snprintf(unnamed[reason], sizeof(unnamed[reason]), "exit_%d", reason);
+        return unnamed[reason];
+    }
+    return exit_names[reason];
+}
+
+/*tsc ticks per microsecond, measured once against CLOCK_MONOTONIC*/
+double vcpu_stats_tsc_per_us(void) {
+    static double rate;
+    struct timespec start, end, wait = { .tv_sec = 0, .tv_nsec = 20000000L };
+
+    if (rate == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        __u64 tsc = __rdtsc();
+        nanosleep(&wait, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        tsc = __rdtsc() - tsc;
+        rate = tsc / ((end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+    }
+    return rate;
+}
+
+/*upper bound in cycles of the bucket holding the given percentile*/
+static __u64 hist_percentile(const struct vcpu_hist *hist, double pct) {
+    __u64 want = (__u64)(hist->count * pct / 100.0);
+    __u64 seen = 0;
+
+    for (int i = 0; i < VCPU_STATS_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > want)
+            return i == VCPU_STATS_BUCKETS - 1 ? hist->max : (2ULL << i) - 1;
+    }
+    return hist->max;
+}
+
+void vcpu_hist_text(FILE *out, const char *what, const struct vcpu_hist *hist) {
+    double rate = vcpu_stats_tsc_per_us();
+
+    if (hist->count == 0) {
+        fprintf(out, "  %s: no samples\n", what);
+        return;
+    }
+    fprintf(out, "  %s: %llu samples, avg %llu cycles (%.2f us), p50 < %llu, p99 < %llu, max %llu cycles\n",
+            what, (unsigned long long)hist->count,
+            (unsigned long long)(hist->sum / hist->count), hist->sum / hist->count / rate,
+            (unsigned long long)hist_percentile(hist, 50), (unsigned long long)hist_percentile(hist, 99),
+            (unsigned long long)hist->max);
+    for (int i = 0; i < VCPU_STATS_BUCKETS; i++) {
+        if (hist->buckets[i])
+            fprintf(out, "    [%12llu, %12llu) %llu\n", 1ULL << i, 2ULL << i, (unsigned long long)hist->buckets[i]);
+    }
+}
+
+void vcpu_stats_dump_text(FILE *out, const struct vcpu_stats_report *report) {
+    fprintf(out, "%s vcpu stats, tsc %.0f MHz\n", report->name, vcpu_stats_tsc_per_us());
+    for (int id = 0; id < report->nr; id++) {
+        const struct vcpu_stats *stats = report->stats[id];
+        __u64 total = 0;
+
+        for (int r = 0; r < VCPU_STATS_EXIT_REASONS; r++)
+            total += stats->exits[r];
+        fprintf(out, "vcpu %d: %llu exits, %llu kicks, %llu KVM_RUN errors, %llu register ioctls\n", id,
+                (unsigned long long)total, (unsigned long long)stats->kicks, (unsigned long long)stats->run_errors,
+                (unsigned long long)stats->reg_ioctls);
+        for (int r = 0; r < VCPU_STATS_EXIT_REASONS; r++) {
+            if (stats->exits[r])
+                fprintf(out, "  %-24s %llu\n", vcpu_stats_exit_name(r), (unsigned long long)stats->exits[r]);
+        }
+        vcpu_hist_text(out, "guest (in KVM_RUN)", &stats->guest);
+        vcpu_hist_text(out, "host (exit handling)", &stats->host);
+    }
+}
+
+static void hist_json(FILE *out, const char *what, const struct vcpu_hist *hist) {
+    fprintf(out, "\"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu, \"p50\": %llu, \"p99\": %llu, \"buckets\": [",
+            what, (unsigned long long)hist->count, (unsigned long long)hist->sum, (unsigned long long)hist->max,
+            (unsigned long long)hist_percentile(hist, 50), (unsigned long long)hist_percentile(hist, 99));
+    for (int i = 0; i < VCPU_STATS_BUCKETS; i++)
+        fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)hist->buckets[i]);
+    fprintf(out, "]}");
+}
+
+void vcpu_stats_dump_json(FILE *out, const struct vcpu_stats_report *report) {
+    fprintf(out, "{\"program\": \"%s\", \"tsc_mhz\": %.0f, \"vcpus\": [", report->name, vcpu_stats_tsc_per_us());
+    for (int id = 0; id < report->nr; id++) {
+        const struct vcpu_stats *stats = report->stats[id];
+        int first = 1;
+
+        fprintf(out, "%s\n  {\"id\": %d, \"kicks\": %llu, \"run_errors\": %llu, \"reg_ioctls\": %llu, \"exits\": {",
+                id ? "," : "", id, (unsigned long long)stats->kicks, (unsigned long long)stats->run_errors, (unsigned long long)stats->reg_ioctls);
+        for (int r = 0; r < VCPU_STATS_EXIT_REASONS; r++) {
+            if (stats->exits[r]) {
+                fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", vcpu_stats_exit_name(r),
+                        (unsigned long long)stats->exits[r]);
+                first = 0;
+            }
+        }
+        fprintf(out, "}, ");
+        hist_json(out, "guest", &stats->guest);
+        fprintf(out, ", ");
+        hist_json(out, "host", &stats->host);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+}
+
+/*text on stderr, json into report->json_path if set, then report->on_dump*/
+void vcpu_stats_dump(const struct vcpu_stats_report *report) {
+    vcpu_stats_dump_text(stderr, report);
+    if (report->json_path) {
+        FILE *out = fopen(report->json_path, "w");
+        if (out == NULL) {
+            perror("can not open stats json");
+            return;
+        }
+        vcpu_stats_dump_json(out, report);
+        fclose(out);
+    }
+    if (report->on_dump)
+        report->on_dump();
+}
+
+/*block SIGUSR1 before any thread is created so only the dumper thread takes it*/
+void vcpu_stats_block_signals(void) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    vcpu_stats_tsc_per_us(); /*calibrate now rather than in the middle of a dump*/
+}
+
+static void *vcpu_stats_dumper(void *data) {
+    sigset_t set;
+    int sig;
+    (void)data;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigwait(&set, &sig) == 0)
+        vcpu_stats_dump(dump_report);
+    return NULL;
+}
+
+/*dump report every time the process gets SIGUSR1*/
+int vcpu_stats_start_dumper(const struct vcpu_stats_report *report) {
+    pthread_t thread;
+
+    dump_report = report;
+    if (pthread_create(&thread, NULL, vcpu_stats_dumper, NULL) != 0) {
+        perror("can not create stats dumper thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Per vcpu exit accounting and KVM_RUN latency histograms.
+ * Each vcpu thread is the only writer of its own struct vcpu_stats,
+ * readers (SIGUSR1 dump, end of run) only ever read.
+ * author: rkroshan
+ */
+
+#ifndef VCPU_STATS_H
+#define VCPU_STATS_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <linux/types.h>
+#include <x86intrin.h>
+
+#define VCPU_STATS_EXIT_REASONS 64 /*KVM_EXIT_* values are below this, the last slot counts anything bigger*/
+#define VCPU_STATS_BUCKETS 48 /*bucket i holds durations in [2^i, 2^(i+1)) cycles*/
+
+/*log2 bucketed histogram of tsc cycles*/
+struct vcpu_hist {
+    __u64 buckets[VCPU_STATS_BUCKETS];
+    __u64 count; /*samples*/
+    __u64 sum; /*sum of all samples in cycles*/
+    __u64 max; /*longest sample in cycles*/
+};
+
+struct vcpu_stats {
+    _Alignas(64) __u64 exits[VCPU_STATS_EXIT_REASONS]; /*exits per KVM_EXIT_* reason*/
+    __u64 run_errors; /*KVM_RUN failed with anything but EINTR*/
+    __u64 kicks; /*KVM_RUN returned EINTR: a signal kicked the vcpu out for a pause or the end of the run*/
+    __u64 reg_ioctls; /*register get/set ioctls, KVM_CAP_SYNC_REGS leaves only the first load*/
+    __u64 last_exit_tsc; /*tsc when KVM_RUN last returned, 0 before the first run*/
+    struct vcpu_hist guest; /*cycles spent inside KVM_RUN*/
+    struct vcpu_hist host; /*cycles spent handling the exit until the next KVM_RUN*/
+};
+
+/*what a dump covers: one stats block per vcpu, optional json file*/
+struct vcpu_stats_report {
+    const char *name; /*program name for the report header*/
+    struct vcpu_stats **stats; /*stats of each vcpu, indexed by vcpu id*/
+    int nr; /*number of vcpus*/
+    const char *json_path; /*also write the report as json here, NULL for text only*/
+    void (*on_dump)(void); /*called after every dump, NULL for none*/
+};
+
+static inline void vcpu_hist_add(struct vcpu_hist *hist, __u64 cycles) {
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+
+    hist->buckets[bucket < VCPU_STATS_BUCKETS ? bucket : VCPU_STATS_BUCKETS - 1]++;
+    hist->count++;
+    hist->sum += cycles;
+    if (cycles > hist->max)
+        hist->max = cycles;
+}
+
+/*call right before KVM_RUN, returns the tsc to hand to vcpu_stats_run_end*/
+static inline __u64 vcpu_stats_run_begin(struct vcpu_stats *stats) {
+    __u64 now = __rdtsc();
+
+    if (stats->last_exit_tsc)
+        vcpu_hist_add(&stats->host, now - stats->last_exit_tsc);
+    return now;
+}
+
+/*call right after KVM_RUN returns with its return value and the exit reason, errno still from KVM_RUN*/
+static inline void vcpu_stats_run_end(struct vcpu_stats *stats, __u64 begin, int ret, __u32 exit_reason) {
+    __u64 now = __rdtsc();
+
+    vcpu_hist_add(&stats->guest, now - begin);
+    if (ret < 0 && errno == EINTR)
+        stats->kicks++;
+    else if (ret < 0)
+        stats->run_errors++;
+    else
+        stats->exits[exit_reason < VCPU_STATS_EXIT_REASONS ? exit_reason : VCPU_STATS_EXIT_REASONS - 1]++;
+    stats->last_exit_tsc = now;
+}
+
+const char *vcpu_stats_exit_name(int reason);
+void vcpu_hist_text(FILE *out, const char *what, const struct vcpu_hist *hist);
+double vcpu_stats_tsc_per_us(void);
+void vcpu_stats_dump_text(FILE *out, const struct vcpu_stats_report *report);
+void vcpu_stats_dump_json(FILE *out, const struct vcpu_stats_report *report);
+void vcpu_stats_dump(const struct vcpu_stats_report *report);
+void vcpu_stats_block_signals(void);
+int vcpu_stats_start_dumper(const struct vcpu_stats_report *report);
+
+#endif
@@ -12,6 +12,10 @@
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include "vcpu_stats.h"
+#include "guest_ram.h"
 
 #define KVM_DEVICE "/dev/kvm"
 #define RAM_SIZE 512000000
@@ -23,6 +27,7 @@ struct kvm {
    int vm_fd;   /*vm file descriptor*/
    __u64 ram_size;  /*vm ram size*/
    __u64 ram_start; /*vm ram start*/
+   struct guest_ram ram; /*mapping behind ram_start*/
    int kvm_version; /*kvm version*/
    struct kvm_userspace_memory_region mem; /*user memory region*/
    struct vcpu *vcpus; /*vpcu struct pointer*/
@@ -38,6 +43,7 @@ struct vcpu {
     struct kvm_regs regs; /*kvm regs struct*/
     struct kvm_sregs sregs; /*kvm special regs struct*/
     void *(*vcpu_thread_func)(void *); /*vpcu thread function*/
+    struct vcpu_stats stats; /*exit counters and KVM_RUN histograms*/
 };
 
 /*function to setup reset values for vcpu regs and special regs*/
@@ -84,7 +90,9 @@ void *kvm_cpu_thread(void *data) { /*per vpcu function*/
 
 	while (1) { /*starts the VM and loop to catch vmexit reasons and then resume the vm*/
 		printf("KVM start run\n");
+		__u64 run_tsc = vcpu_stats_run_begin(&kvm->vcpus->stats);
 		ret = ioctl(kvm->vcpus->vcpu_fd, KVM_RUN, 0); /*starts the vm*/
+		vcpu_stats_run_end(&kvm->vcpus->stats, run_tsc, ret, kvm->vcpus->kvm_run->exit_reason);
 	
 		if (ret < 0) {
 			fprintf(stderr, "KVM_RUN failed\n");
@@ -171,7 +179,7 @@ void kvm_clean(struct kvm *kvm) {
 }
 
 /*function to create vm*/
-int kvm_create_vm(struct kvm *kvm, int ram_size) {
+int kvm_create_vm(struct kvm *kvm, int ram_size, const char *backing) {
     int ret = 0;
     kvm->vm_fd = ioctl(kvm->dev_fd, KVM_CREATE_VM, 0); /*create VM*/
 
@@ -180,16 +188,11 @@ int kvm_create_vm(struct kvm *kvm, int ram_size) {
         return -1;
     }
 
-    kvm->ram_size = ram_size;
-    /* Allocate 512MB (aligned to page) of guest memory to hold the code. it is not backed by any file/fd stating from offset 0*/
-    kvm->ram_start =  (__u64)mmap(NULL, kvm->ram_size, 
-                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
-                -1, 0);
-
-    if ((void *)kvm->ram_start == MAP_FAILED) {
-        perror("can not mmap ram");
+    /* Allocate 512MB (aligned to the backing page size) of guest memory to hold the code, 4K anonymous pages unless backing says otherwise*/
+    if (guest_ram_alloc(&kvm->ram, ram_size, backing) < 0)
         return -1;
-    }
+    kvm->ram_start = (__u64)kvm->ram.addr;
+    kvm->ram_size = kvm->ram.size;
     
     kvm->mem.slot = 0; /*provides an integer index identifying each region of memory we hand to KVM; calling KVM_SET_USER_MEMORY_REGION again with the same slot will replace this mapping*/
     kvm->mem.guest_phys_addr = 0; /*specifies the base "physical" address as seen from the guest*/
@@ -209,12 +212,13 @@ int kvm_create_vm(struct kvm *kvm, int ram_size) {
 /*function to close vm fd and unmap ram data*/
 void kvm_clean_vm(struct kvm *kvm) {
     close(kvm->vm_fd);
-    munmap((void *)kvm->ram_start, kvm->ram_size);
+    guest_ram_free(&kvm->ram);
 }
 
 /*function to create vpcu*/
 struct vcpu *kvm_init_vcpu(struct kvm *kvm, int vcpu_id, void *(*fn)(void *)) {
-    struct vcpu *vcpu = malloc(sizeof(struct vcpu)); /*allocate memory for vcpu*/
+    struct vcpu *vcpu = aligned_alloc(64, sizeof(struct vcpu)); /*allocate memory for vcpu, aligned for the stats*/
+    memset(vcpu, 0, sizeof(struct vcpu));
     vcpu->vcpu_id = vcpu_id;
     vcpu->vcpu_fd = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, vcpu->vcpu_id); /*create vpcu*/
 
@@ -265,14 +269,32 @@ void kvm_run_vm(struct kvm *kvm) {
 
 int main(int argc, char **argv) {
     int ret = 0;
+    int opt;
+    const char *stats_json = NULL;
+    const char *backing = NULL;
+
+    while ((opt = getopt(argc, argv, "j:b:h")) != -1) {
+        switch (opt) {
+        case 'j': /*also dump the vcpu stats as json*/
+            stats_json = optarg;
+            break;
+        case 'b': /*guest ram backing: anon, thp, hugetlb[:2M|:1G], memfd, memfd-hugetlb[:2M|:1G]*/
+            backing = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j stats.json] [-b backing]\n", argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    vcpu_stats_block_signals(); /*before any thread exists so SIGUSR1 only reaches the dumper*/
     struct kvm *kvm = kvm_init();
-    (void)argv; (void)argc;
     if (kvm == NULL) {
         fprintf(stderr, "kvm init fauilt\n");
         return -1;
     }
 
-    if (kvm_create_vm(kvm, RAM_SIZE) < 0) {
+    if (kvm_create_vm(kvm, RAM_SIZE, backing) < 0) {
         fprintf(stderr, "create vm fault\n");
         return -1;
     }
@@ -283,7 +305,18 @@ int main(int argc, char **argv) {
     kvm->vcpu_number = 1;
     kvm->vcpus = kvm_init_vcpu(kvm, 0, kvm_cpu_thread);
 
+    /*kill -USR1 dumps the exit stats while running, they are dumped again at exit*/
+    struct vcpu_stats *stats = &kvm->vcpus->stats;
+    struct vcpu_stats_report report = {
+        .name = "kvm_code_bin",
+        .stats = &stats,
+        .nr = kvm->vcpu_number,
+        .json_path = stats_json,
+    };
+    vcpu_stats_start_dumper(&report);
+
     kvm_run_vm(kvm);
+    vcpu_stats_dump(&report);
 
     kvm_clean_vm(kvm);
     kvm_clean_vcpu(kvm->vcpus);
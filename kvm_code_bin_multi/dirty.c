@@ -0,0 +1,156 @@
+/*
+ * Dirty page tracking of guest ram.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "kvm_code_bin_multi.h"
+#include "dirty.h"
+
+/*"bitmap" or "ring" from the command line, -1 if unknown*/
+int dirty_mode(const char *name) {
+    if (strcmp(name, "bitmap") == 0)
+        return DIRTY_BITMAP;
+    if (strcmp(name, "ring") == 0)
+        return DIRTY_RING;
+    fprintf(stderr, "unknown dirty tracking mode: %s\n", name);
+    return -1;
+}
+
+/*allocate the bitmaps and in ring mode enable the dirty ring, before any vcpu is created*/
+int dirty_log_init(struct kvm *kvm) {
+    struct dirty_log *log = &kvm->dirty;
+    unsigned long words;
+
+    log->nr_pages = kvm->ram_size / DIRTY_PAGE_SIZE;
+    words = (log->nr_pages + 63) / 64;
+    log->bitmap = calloc(words, sizeof(atomic_ulong));
+    log->slot_bitmap = calloc(words, sizeof(unsigned long));
+    if (log->bitmap == NULL || log->slot_bitmap == NULL) {
+        perror("can not allocate dirty bitmap");
+        return -1;
+    }
+    pthread_mutex_init(&log->ring_lock, NULL);
+
+    if (opts.dirty_log != DIRTY_RING)
+        return 0;
+
+    int max = ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING); /*largest ring in bytes*/
+    if (max <= 0) {
+        fprintf(stderr, "KVM_CAP_DIRTY_LOG_RING not supported, use -D bitmap\n");
+        return -1;
+    }
+    __u32 bytes = DIRTY_RING_ENTRIES * sizeof(struct kvm_dirty_gfn);
+    while (bytes > (__u32)max)
+        bytes /= 2;
+
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_DIRTY_LOG_RING, .args[0] = bytes };
+    if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("can not enable dirty ring");
+        return -1;
+    }
+    log->ring_entries = bytes / sizeof(struct kvm_dirty_gfn);
+    return 0;
+}
+
+void dirty_log_free(struct kvm *kvm) {
+    free(kvm->dirty.bitmap);
+    free(kvm->dirty.slot_bitmap);
+    kvm->dirty.bitmap = NULL;
+    kvm->dirty.slot_bitmap = NULL;
+}
+
+/*the ring sits at KVM_DIRTY_LOG_PAGE_OFFSET of the vcpu fd*/
+int dirty_ring_map(struct kvm *kvm, struct vcpu *vcpu) {
+    size_t len = kvm->dirty.ring_entries * sizeof(struct kvm_dirty_gfn);
+
+    vcpu->dirty_ring.fetch = 0;
+    vcpu->dirty_ring.gfns = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd,
+                                 KVM_DIRTY_LOG_PAGE_OFFSET * getpagesize());
+    if (vcpu->dirty_ring.gfns == MAP_FAILED) {
+        vcpu->dirty_ring.gfns = NULL;
+        perror("can not mmap dirty ring");
+        return -1;
+    }
+    return 0;
+}
+
+void dirty_ring_unmap(struct kvm *kvm, struct vcpu *vcpu) {
+    if (vcpu->dirty_ring.gfns)
+        munmap(vcpu->dirty_ring.gfns, kvm->dirty.ring_entries * sizeof(struct kvm_dirty_gfn));
+    vcpu->dirty_ring.gfns = NULL;
+}
+
+/*move the entries the kernel pushed into the bitmap and hand the slots back,
+ *called on KVM_EXIT_DIRTY_RING_FULL by the vcpu itself and by dirty_log_sync()*/
+void dirty_ring_harvest(struct kvm *kvm, struct vcpu *vcpu) {
+    struct dirty_log *log = &kvm->dirty;
+    struct dirty_ring *ring = &vcpu->dirty_ring;
+    unsigned long n = 0;
+
+    if (ring->gfns == NULL)
+        return;
+    pthread_mutex_lock(&log->ring_lock);
+    for (;;) {
+        struct kvm_dirty_gfn *gfn = &ring->gfns[ring->fetch & (log->ring_entries - 1)];
+        if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY))
+            break;
+        __u32 slot = gfn->slot & 0xffff; /*upper half is the address space id*/
+        if (slot < NR_SLOTS)
+            dirty_set(log, kvm->slots[slot].guest_phys_addr / DIRTY_PAGE_SIZE + gfn->offset);
+        __atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+        ring->fetch++;
+        n++;
+    }
+    if (n && ioctl(kvm->vm_fd, KVM_RESET_DIRTY_RINGS, 0) < 0)
+        perror("can not reset dirty rings");
+    pthread_mutex_unlock(&log->ring_lock);
+}
+
+/*pull what the kernel logged since the last sync into the bitmap, returns the pages now marked dirty.
+ *the vcpus should be paused, a running one can dirty pages right after*/
+long dirty_log_sync(struct kvm *kvm) {
+    struct dirty_log *log = &kvm->dirty;
+    long dirty = 0;
+
+    if (log->ring_entries) {
+        for (int i = 0; i < kvm->vcpu_number; i++)
+            dirty_ring_harvest(kvm, &kvm->vcpus[i]);
+    } else {
+        for (int slot = 0; slot < NR_SLOTS; slot++) {
+            struct kvm_userspace_memory_region *region = &kvm->slots[slot];
+            if (region->memory_size == 0 || !(region->flags & KVM_MEM_LOG_DIRTY_PAGES))
+                continue;
+
+            /*fetches and clears the slot bitmap and write protects the pages again*/
+            struct kvm_dirty_log get = { .slot = slot, .dirty_bitmap = log->slot_bitmap };
+            if (ioctl(kvm->vm_fd, KVM_GET_DIRTY_LOG, &get) < 0) {
+                perror("can not get dirty log");
+                return -1;
+            }
+            unsigned long base = region->guest_phys_addr / DIRTY_PAGE_SIZE;
+            unsigned long pages = region->memory_size / DIRTY_PAGE_SIZE;
+            for (unsigned long w = 0; w < (pages + 63) / 64; w++) {
+                unsigned long bits = log->slot_bitmap[w];
+                while (bits) {
+                    dirty_set(log, base + w * 64 + __builtin_ctzl(bits));
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    for (unsigned long w = 0; w < (log->nr_pages + 63) / 64; w++)
+        dirty += __builtin_popcountl(atomic_load_explicit(&log->bitmap[w], memory_order_relaxed));
+    return dirty;
+}
+
+void dirty_log_clear(struct kvm *kvm) {
+    for (unsigned long w = 0; w < (kvm->dirty.nr_pages + 63) / 64; w++)
+        atomic_store_explicit(&kvm->dirty.bitmap[w], 0, memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+/*
+ * Dirty page tracking of guest ram, either the per memslot bitmap
+ * (KVM_MEM_LOG_DIRTY_PAGES + KVM_GET_DIRTY_LOG) or the per vcpu dirty ring
+ * (KVM_CAP_DIRTY_LOG_RING). Both end up in one bitmap with a bit per 4K
+ * page of guest physical memory, used by incremental checkpoints and
+ * reset to baseline.
+ * author: rkroshan
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/kvm.h>
+
+#define DIRTY_OFF    0
+#define DIRTY_BITMAP 1
+#define DIRTY_RING   2
+
+#define DIRTY_PAGE_SIZE 4096
+#define DIRTY_RING_ENTRIES 4096 /*entries per vcpu ring, capped at what the kernel allows*/
+
+struct dirty_log {
+    unsigned long nr_pages; /*guest ram pages covered by bitmap*/
+    atomic_ulong *bitmap; /*dirty since the last dirty_log_clear(), vcpu threads set bits on ring full exits*/
+    unsigned long *slot_bitmap; /*scratch for KVM_GET_DIRTY_LOG*/
+    __u32 ring_entries; /*entries of every vcpu ring, 0 in bitmap mode*/
+    pthread_mutex_t ring_lock; /*one harvester per ring at a time*/
+};
+
+/*per vcpu dirty ring, shared with the kernel through the vcpu fd*/
+struct dirty_ring {
+    struct kvm_dirty_gfn *gfns; /*NULL unless DIRTY_RING*/
+    __u32 fetch; /*next entry to harvest*/
+};
+
+struct kvm;
+struct vcpu;
+
+int dirty_mode(const char *name);
+int dirty_log_init(struct kvm *kvm);
+void dirty_log_free(struct kvm *kvm);
+int dirty_ring_map(struct kvm *kvm, struct vcpu *vcpu);
+void dirty_ring_unmap(struct kvm *kvm, struct vcpu *vcpu);
+void dirty_ring_harvest(struct kvm *kvm, struct vcpu *vcpu);
+long dirty_log_sync(struct kvm *kvm);
+void dirty_log_clear(struct kvm *kvm);
+
+static inline int dirty_test(struct dirty_log *log, unsigned long page) {
+    return (atomic_load_explicit(&log->bitmap[page / 64], memory_order_relaxed) >> (page % 64)) & 1;
+}
+
+static inline void dirty_set(struct dirty_log *log, unsigned long page) {
+    if (page < log->nr_pages)
+        atomic_fetch_or_explicit(&log->bitmap[page / 64], 1UL << (page % 64), memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * ELF32/ELF64 guest images loaded segment by segment.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kvm_code_bin_multi.h"
+#include "elf_image.h"
+
+/*a program header of either class*/
+struct elf_segment {
+    __u32 type, flags;
+    __u64 offset, paddr, filesz, memsz;
+};
+
+/*1 when path starts with the elf magic, 0 when it does not (a flat binary), -1 if it can not be read*/
+int elf_probe(const char *path) {
+    unsigned char ident[SELFMAG];
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "can not open binary file\n");
+        return -1;
+    }
+    int ret = read(fd, ident, SELFMAG) == SELFMAG && memcmp(ident, ELFMAG, SELFMAG) == 0;
+    close(fd);
+    return ret;
+}
+
+static int elf_read(int fd, void *buf, size_t len, off_t offset) {
+    char *p = (char *)buf;
+
+    while (len) {
+        ssize_t ret = pread(fd, p, len, offset);
+        if (ret <= 0) {
+            fprintf(stderr, "short read of elf image\n");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*program header i of either class*/
+static int elf_segment(int fd, int class64, __u64 phoff, __u16 phentsize, int i, struct elf_segment *seg) {
+    if (class64) {
+        Elf64_Phdr ph;
+        if (phentsize < sizeof(ph) || elf_read(fd, &ph, sizeof(ph), phoff + (__u64)i * phentsize) < 0)
+            return -1;
+        *seg = (struct elf_segment){ ph.p_type, ph.p_flags, ph.p_offset, ph.p_paddr, ph.p_filesz, ph.p_memsz };
+    } else {
+        Elf32_Phdr ph;
+        if (phentsize < sizeof(ph) || elf_read(fd, &ph, sizeof(ph), phoff + (__u64)i * phentsize) < 0)
+            return -1;
+        *seg = (struct elf_segment){ ph.p_type, ph.p_flags, ph.p_offset, ph.p_paddr, ph.p_filesz, ph.p_memsz };
+    }
+    return 0;
+}
+
+/*the whole pages of a read only segment are mapped from the file over guest ram, the partial
+ *pages at either end are read in since they may share their page with another segment*/
+static int elf_load_segment(struct kvm *kvm, struct elf_image *elf, int fd, const struct elf_segment *seg) {
+    char *ram = (char *)kvm->ram_start;
+    __u64 page = getpagesize();
+    __u64 start = seg->paddr, end = seg->paddr + seg->filesz;
+    __u64 map_start = (start + page - 1) & ~(page - 1);
+    __u64 map_end = end & ~(page - 1);
+
+    /*only over plain anonymous ram, a memfd or huge page backing can not be replaced page by page
+     *and the userfaultfd range of lazy ram has to stay registered*/
+    if ((seg->flags & PF_W) || kvm->ram.fd >= 0 || kvm->ram.page_size != page || kvm->lazy.uffd >= 0 ||
+        (seg->paddr - seg->offset) % page != 0 || map_end <= map_start) {
+        map_start = map_end = end;
+    } else {
+        void *addr = mmap(ram + map_start, map_end - map_start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                          seg->offset + (map_start - start));
+        if (addr == MAP_FAILED) {
+            perror("can not map elf segment");
+            return -1;
+        }
+        elf->mapped += map_end - map_start;
+    }
+    if (elf_read(fd, ram + start, map_start - start, seg->offset) < 0 ||
+        elf_read(fd, ram + map_end, end - map_end, seg->offset + (map_end - start)) < 0)
+        return -1;
+    elf->copied += (map_start - start) + (end - map_end);
+    elf->zeroed += seg->memsz - seg->filesz; /*fresh guest ram already reads zero there*/
+    elf->segments++;
+    if (!opts.quiet)
+        printf("elf segment at 0x%llx: %llu bytes from the file, %llu in memory%s\n", (unsigned long long)seg->paddr,
+               (unsigned long long)seg->filesz, (unsigned long long)seg->memsz, seg->flags & PF_W ? "" : ", read only");
+    return 0;
+}
+
+/*load every PT_LOAD segment of an x86 ELF32 or ELF64 executable at its physical address*/
+int elf_load(struct kvm *kvm, struct elf_image *elf, const char *path) {
+    Elf64_Ehdr eh64;
+    Elf32_Ehdr *eh32 = (Elf32_Ehdr *)&eh64;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(elf, 0, sizeof(struct elf_image));
+    if (fd < 0) {
+        fprintf(stderr, "can not open binary file\n");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Elf32_Ehdr) ||
+        elf_read(fd, &eh64, st.st_size < (off_t)sizeof(eh64) ? sizeof(Elf32_Ehdr) : sizeof(eh64), 0) < 0) {
+        fprintf(stderr, "%s: not an elf image\n", path);
+        close(fd);
+        return -1;
+    }
+
+    int class64 = eh64.e_ident[EI_CLASS] == ELFCLASS64;
+    __u16 machine = class64 ? eh64.e_machine : eh32->e_machine;
+    __u16 type = class64 ? eh64.e_type : eh32->e_type;
+    if ((eh64.e_ident[EI_CLASS] != ELFCLASS32 && !class64) || eh64.e_ident[EI_DATA] != ELFDATA2LSB ||
+        type != ET_EXEC || machine != (class64 ? EM_X86_64 : EM_386)) {
+        fprintf(stderr, "%s: not an x86 elf executable\n", path);
+        close(fd);
+        return -1;
+    }
+    __u64 phoff = class64 ? eh64.e_phoff : eh32->e_phoff;
+    __u16 phnum = class64 ? eh64.e_phnum : eh32->e_phnum;
+    __u16 phentsize = class64 ? eh64.e_phentsize : eh32->e_phentsize;
+
+    for (int i = 0; i < phnum; i++) {
+        struct elf_segment seg;
+
+        if (elf_segment(fd, class64, phoff, phentsize, i, &seg) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (seg.type != PT_LOAD || seg.memsz == 0)
+            continue;
+        if (seg.filesz > seg.memsz || seg.offset + seg.filesz > (__u64)st.st_size ||
+            seg.paddr + seg.memsz > kvm->ram_size || seg.paddr + seg.memsz < seg.paddr) {
+            fprintf(stderr, "%s: segment at 0x%llx does not fit in %llu bytes of ram\n", path,
+                    (unsigned long long)seg.paddr, kvm->ram_size);
+            close(fd);
+            return -1;
+        }
+        if (seg.paddr < IMAGE_START && seg.paddr + seg.memsz > LONG_GDT) { /*kvm_setup_long_mode() writes there*/
+            fprintf(stderr, "%s: segment 0x%llx-0x%llx overlaps the gdt and page tables at 0x%x-0x%x\n", path,
+                    (unsigned long long)seg.paddr, (unsigned long long)(seg.paddr + seg.memsz), LONG_GDT, IMAGE_START);
+            close(fd);
+            return -1;
+        }
+        if (elf_load_segment(kvm, elf, fd, &seg) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd); /*the mappings hold their own reference*/
+    if (elf->segments == 0) {
+        fprintf(stderr, "%s: no loadable segment\n", path);
+        return -1;
+    }
+    elf->entry = class64 ? eh64.e_entry : eh32->e_entry;
+    return 0;
+}
+
+void elf_print(FILE *out, const struct elf_image *elf) {
+    fprintf(out, "elf: %d segments, entry 0x%llx, %zu bytes mapped, %zu copied, %zu bss\n", elf->segments,
+            (unsigned long long)elf->entry, elf->mapped, elf->copied, elf->zeroed);
+}
@@ -0,0 +1,31 @@
+/*
+ * ELF32/ELF64 guest images. Every PT_LOAD segment goes to its physical
+ * address in guest ram: read only segments are mmap'd MAP_PRIVATE from the
+ * file over guest ram (zero copy, pages fault in from the page cache when
+ * first touched), writable ones are read in, .bss is left to the zero pages
+ * of fresh ram. The entry point becomes the vcpu rip.
+ * author: rkroshan
+ */
+
+#ifndef ELF_IMAGE_H
+#define ELF_IMAGE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+struct kvm;
+
+struct elf_image {
+    __u64 entry; /*guest physical entry point, 0 when the image is a flat binary*/
+    int segments; /*PT_LOAD segments loaded*/
+    size_t mapped; /*bytes mapped from the file without a copy*/
+    size_t copied; /*bytes read into guest ram*/
+    size_t zeroed; /*.bss bytes, never written by the host*/
+};
+
+int elf_probe(const char *path);
+int elf_load(struct kvm *kvm, struct elf_image *elf, const char *path);
+void elf_print(FILE *out, const struct elf_image *elf);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Exit flight recorder, see flight.h.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "flight.h"
+
+static struct flight *rings[FLIGHT_MAX_RINGS]; /*every open ring, for the signal handlers*/
+
+/*create <dir>/vcpu<id>.flight and map it, the events land in the page cache from now on*/
+int flight_open(struct flight *fl, const char *dir, int vcpu_id, double tsc_per_us) {
+    char path[4096];
+    size_t size = sizeof(struct flight_header) + (size_t)FLIGHT_EVENTS * sizeof(struct flight_event);
+
+    memset(fl, 0, sizeof(struct flight));
+    if (vcpu_id >= FLIGHT_MAX_RINGS) {
+        fprintf(stderr, "flight recorder: at most %d vcpus\n", FLIGHT_MAX_RINGS);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/vcpu%d.flight", dir, vcpu_id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("can not create flight recorder file");
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("can not size flight recorder file");
+        close(fd);
+        return -1;
+    }
+    /*populated now, the vcpu thread must not take page faults on the exit path*/
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd); /*the mapping holds its own reference*/
+    if (addr == MAP_FAILED) {
+        perror("can not map flight recorder file");
+        return -1;
+    }
+
+    fl->hdr = (struct flight_header *)addr;
+    fl->events = (struct flight_event *)(fl->hdr + 1);
+    fl->mask = FLIGHT_EVENTS - 1;
+    fl->map_size = size;
+    memcpy(fl->hdr->magic, FLIGHT_MAGIC, sizeof(fl->hdr->magic));
+    fl->hdr->vcpu_id = vcpu_id;
+    fl->hdr->nr_events = FLIGHT_EVENTS;
+    fl->hdr->tsc_per_us = tsc_per_us;
+    fl->hdr->head = 0;
+    rings[vcpu_id] = fl;
+    return 0;
+}
+
+/*the file keeps the last events, kvm_flight reads it after the run*/
+void flight_close(struct flight *fl) {
+    if (fl->hdr == NULL)
+        return;
+    for (int i = 0; i < FLIGHT_MAX_RINGS; i++) {
+        if (rings[i] == fl)
+            rings[i] = NULL;
+    }
+    msync(fl->hdr, fl->map_size, MS_SYNC);
+    munmap(fl->hdr, fl->map_size);
+    fl->hdr = NULL;
+}
+
+/*write every ring back to its file, only msync so the signal handlers can call it*/
+void flight_sync_all(void) {
+    for (int i = 0; i < FLIGHT_MAX_RINGS; i++) {
+        if (rings[i] != NULL)
+            msync(rings[i]->hdr, rings[i]->map_size, MS_SYNC);
+    }
+}
+
+static void flight_crash(int sig) {
+    flight_sync_all();
+    signal(sig, SIG_DFL); /*die the way the signal meant to, core dump included*/
+    raise(sig);
+}
+
+/*sync the rings before a fatal signal takes the process down*/
+void flight_crash_handlers(void) {
+    static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTERM, SIGINT };
+    struct sigaction sa = { .sa_handler = flight_crash, .sa_flags = SA_RESETHAND };
+
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+        sigaction(sigs[i], &sa, NULL);
+}
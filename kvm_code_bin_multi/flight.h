@@ -0,0 +1,98 @@
+/*
+ * Exit flight recorder: every vcpu keeps the last FLIGHT_EVENTS exits as compact
+ * binary events in a file of its own (<dir>/vcpuN.flight), mmap'd MAP_SHARED so the
+ * ring lives in the page cache and survives the process, crash included. Only the
+ * vcpu thread writes its ring, the oldest events are overwritten once it is full.
+ * SIGUSR1 (with the vcpu stats dump) and fatal signals msync the rings to disk,
+ * kvm_flight turns the files into timelines, exit breakdowns and latency outliers.
+ * author: rkroshan
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <linux/types.h>
+#include <linux/kvm.h>
+
+#define FLIGHT_MAGIC "KVMFLT1" /*8 bytes with the nul*/
+#define FLIGHT_EVENTS (1 << 16) /*events per vcpu, a power of 2: 2MB files*/
+#define FLIGHT_EINTR 0xffff /*reason of a KVM_RUN that returned EINTR (kicked), not an exit*/
+#define FLIGHT_MAX_RINGS 64 /*rings the signal handlers reach*/
+
+#define FLIGHT_WRITE 1 /*flags: out or mmio store*/
+
+/*one KVM_RUN round trip, 32 bytes*/
+struct flight_event {
+    __u64 entry_tsc; /*tsc right before KVM_RUN*/
+    __u64 addr; /*port or guest physical address, 0 for other exits*/
+    __u32 run_cycles; /*entry to exit, saturates at ~0U*/
+    __u32 handle_cycles; /*exit to the next entry (the exit handler), 0 until then*/
+    __u16 reason; /*KVM_EXIT_* or FLIGHT_EINTR*/
+    __u8 size; /*access size of io and mmio exits*/
+    __u8 flags; /*FLIGHT_WRITE*/
+    __u32 data; /*first bytes of the value written, 0 for reads*/
+};
+
+/*start of the file, the events follow it*/
+struct flight_header {
+    char magic[8]; /*FLIGHT_MAGIC*/
+    __u32 vcpu_id;
+    __u32 nr_events; /*ring size, a power of 2*/
+    double tsc_per_us; /*to turn the cycles into time offline*/
+    __u64 head; /*events ever written, the next one goes to head % nr_events*/
+    __u8 pad[32];
+};
+
+/*a vcpu ring as mapped by its vcpu thread*/
+struct flight {
+    struct flight_header *hdr; /*NULL while off*/
+    struct flight_event *events;
+    __u32 mask; /*nr_events - 1*/
+    size_t map_size;
+};
+
+static inline __u32 flight_sat32(__u64 cycles) {
+    return cycles > 0xffffffffULL ? 0xffffffffU : (__u32)cycles;
+}
+
+/*call right after KVM_RUN returns, entry_tsc and exit_tsc taken around it. the handler time
+ *of the previous event is known now: from its exit to this entry*/
+static inline void flight_record(struct flight *fl, __u64 entry_tsc, __u64 exit_tsc, int ret, const struct kvm_run *run) {
+    __u64 head = fl->hdr->head;
+    struct flight_event *ev;
+
+    if (head) {
+        ev = &fl->events[(head - 1) & fl->mask];
+        ev->handle_cycles = flight_sat32(entry_tsc - ev->entry_tsc - ev->run_cycles);
+    }
+    ev = &fl->events[head & fl->mask];
+    ev->entry_tsc = entry_tsc;
+    ev->run_cycles = flight_sat32(exit_tsc - entry_tsc);
+    ev->handle_cycles = 0;
+    ev->addr = 0;
+    ev->size = 0;
+    ev->flags = 0;
+    ev->data = 0;
+    ev->reason = ret < 0 ? FLIGHT_EINTR : run->exit_reason;
+    if (ret >= 0 && run->exit_reason == KVM_EXIT_IO) {
+        ev->addr = run->io.port;
+        ev->size = run->io.size;
+        ev->flags = run->io.direction == KVM_EXIT_IO_OUT ? FLIGHT_WRITE : 0;
+        if (ev->flags) /*the value of an in is only there once the handler ran*/
+            __builtin_memcpy(&ev->data, (const char *)run + run->io.data_offset, run->io.size < 4 ? run->io.size : 4);
+    } else if (ret >= 0 && run->exit_reason == KVM_EXIT_MMIO) {
+        ev->addr = run->mmio.phys_addr;
+        ev->size = run->mmio.len;
+        ev->flags = run->mmio.is_write ? FLIGHT_WRITE : 0;
+        if (ev->flags)
+            __builtin_memcpy(&ev->data, run->mmio.data, run->mmio.len < 4 ? run->mmio.len : 4);
+    }
+    __atomic_store_n(&fl->hdr->head, head + 1, __ATOMIC_RELEASE); /*a live reader sees complete events*/
+}
+
+int flight_open(struct flight *fl, const char *dir, int vcpu_id, double tsc_per_us);
+void flight_close(struct flight *fl);
+void flight_sync_all(void);
+void flight_crash_handlers(void);
+
+#endif
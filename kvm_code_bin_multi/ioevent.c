@@ -0,0 +1,231 @@
+/*
+ * Device event loop on ioeventfd/irqfd.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include "kvm_code_bin_multi.h"
+#include "ioevent.h"
+
+#define IOEVENT_STOP IOEVENT_MAX /*epoll data of the stop eventfd*/
+
+int ioevent_init(struct ioevent *dev, struct kvm *kvm) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = IOEVENT_STOP };
+
+    memset(dev, 0, sizeof(struct ioevent));
+    dev->kvm = kvm;
+    if (!kvm->irqchip) {
+        fprintf(stderr, "ioeventfd devices need the in kernel irqchip\n");
+        return -1;
+    }
+    if (ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_IOEVENTFD) <= 0 ||
+        ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_IRQFD) <= 0) {
+        fprintf(stderr, "ioeventfd/irqfd not supported by this kernel\n");
+        return -1;
+    }
+    dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    dev->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (dev->epoll_fd < 0 || dev->stop_fd < 0) {
+        perror("can not create device epoll");
+        return -1;
+    }
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, dev->stop_fd, &ev) < 0) {
+        perror("can not add stop eventfd to epoll");
+        return -1;
+    }
+    return 0;
+}
+
+/*guest writes of size bytes to port complete in the kernel and signal an eventfd,
+ *the device thread calls fn with the number of writes. returns the port id*/
+int ioevent_add_port(struct ioevent *dev, __u16 port, __u8 size, ioevent_fn fn, void *ctx) {
+    struct ioevent_port *p = &dev->ports[dev->nr_ports];
+
+    if (dev->nr_ports == IOEVENT_MAX) {
+        fprintf(stderr, "too many ioeventfds\n");
+        return -1;
+    }
+    p->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (p->fd < 0) {
+        perror("can not create ioeventfd");
+        return -1;
+    }
+
+    struct kvm_ioeventfd io = { .addr = port, .len = size, .fd = p->fd, .flags = KVM_IOEVENTFD_FLAG_PIO };
+    if (ioctl(dev->kvm->vm_fd, KVM_IOEVENTFD, &io) < 0) {
+        perror("can not register ioeventfd");
+        close(p->fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = dev->nr_ports };
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        perror("can not add ioeventfd to epoll");
+        return -1;
+    }
+    p->port = port;
+    p->size = size;
+    p->fn = fn;
+    p->ctx = ctx;
+    return dev->nr_ports++;
+}
+
+/*route a new gsi to vector on the local apic apic_id. KVM_SET_GSI_ROUTING replaces the whole
+ *table, so the default pic and ioapic pins go in again ahead of the msi routes. returns the gsi*/
+int ioevent_add_msi(struct ioevent *dev, __u32 apic_id, __u8 vector) {
+    int nr = 16 + 24 + dev->nr_msi + 1;
+    struct kvm_irq_routing *table;
+    int n = 0, ret;
+
+    if (dev->nr_msi == IOEVENT_MAX) {
+        fprintf(stderr, "too many msi routes\n");
+        return -1;
+    }
+    struct kvm_irq_routing_entry *msi = &dev->msi[dev->nr_msi];
+    memset(msi, 0, sizeof(struct kvm_irq_routing_entry));
+    msi->gsi = IOEVENT_GSI_BASE + dev->nr_msi;
+    msi->type = KVM_IRQ_ROUTING_MSI;
+    msi->u.msi.address_lo = 0xfee00000 | (apic_id << 12); /*physical destination mode*/
+    msi->u.msi.data = vector; /*fixed delivery, edge*/
+
+    table = calloc(1, sizeof(struct kvm_irq_routing) + nr * sizeof(struct kvm_irq_routing_entry));
+    if (table == NULL) {
+        perror("can not allocate gsi routing");
+        return -1;
+    }
+    for (__u32 gsi = 0; gsi < 16; gsi++) {
+        table->entries[n].gsi = gsi;
+        table->entries[n].type = KVM_IRQ_ROUTING_IRQCHIP;
+        table->entries[n].u.irqchip.irqchip = gsi < 8 ? KVM_IRQCHIP_PIC_MASTER : KVM_IRQCHIP_PIC_SLAVE;
+        table->entries[n++].u.irqchip.pin = gsi % 8;
+    }
+    for (__u32 gsi = 0; gsi < 24; gsi++) {
+        table->entries[n].gsi = gsi;
+        table->entries[n].type = KVM_IRQ_ROUTING_IRQCHIP;
+        table->entries[n].u.irqchip.irqchip = KVM_IRQCHIP_IOAPIC;
+        table->entries[n++].u.irqchip.pin = gsi;
+    }
+    memcpy(&table->entries[n], dev->msi, (dev->nr_msi + 1) * sizeof(struct kvm_irq_routing_entry));
+    table->nr = nr;
+    ret = ioctl(dev->kvm->vm_fd, KVM_SET_GSI_ROUTING, table);
+    free(table);
+    if (ret < 0) {
+        perror("can not set gsi routing");
+        return -1;
+    }
+    return IOEVENT_GSI_BASE + dev->nr_msi++;
+}
+
+/*bind an eventfd to gsi, writing it injects the interrupt without a vcpu exit. returns the irq id*/
+int ioevent_add_irq(struct ioevent *dev, __u32 gsi) {
+    struct ioevent_irq *irq = &dev->irqs[dev->nr_irqs];
+
+    if (dev->nr_irqs == IOEVENT_MAX) {
+        fprintf(stderr, "too many irqfds\n");
+        return -1;
+    }
+    irq->fd = eventfd(0, EFD_CLOEXEC);
+    if (irq->fd < 0) {
+        perror("can not create irqfd");
+        return -1;
+    }
+    struct kvm_irqfd bind = { .fd = irq->fd, .gsi = gsi };
+    if (ioctl(dev->kvm->vm_fd, KVM_IRQFD, &bind) < 0) {
+        perror("can not register irqfd");
+        close(irq->fd);
+        return -1;
+    }
+    irq->gsi = gsi;
+    return dev->nr_irqs++;
+}
+
+/*send a completion, called from the device handlers*/
+void ioevent_raise(struct ioevent *dev, int irq) {
+    __u64 one = 1;
+
+    if (write(dev->irqs[irq].fd, &one, sizeof(one)) != sizeof(one))
+        perror("can not signal irqfd");
+    dev->irqs[irq].raised++;
+}
+
+static void *ioevent_thread(void *data) {
+    struct ioevent *dev = (struct ioevent *)data;
+    struct epoll_event events[16];
+
+    for (;;) {
+        int n = epoll_wait(dev->epoll_fd, events, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("device epoll_wait");
+            break;
+        }
+        dev->wakeups++;
+        for (int i = 0; i < n; i++) {
+            __u64 count;
+
+            if (events[i].data.u32 == IOEVENT_STOP)
+                return NULL;
+            struct ioevent_port *p = &dev->ports[events[i].data.u32];
+            if (read(p->fd, &count, sizeof(count)) != sizeof(count))
+                continue; /*EAGAIN, nothing new since the last read*/
+            p->writes += count;
+            if (p->fn)
+                p->fn(dev, events[i].data.u32, count, p->ctx);
+        }
+    }
+    return NULL;
+}
+
+int ioevent_start(struct ioevent *dev) {
+    if (pthread_create(&dev->thread, NULL, ioevent_thread, dev) != 0) {
+        perror("can not create device thread");
+        return -1;
+    }
+    dev->running = 1;
+    return 0;
+}
+
+/*stop the device thread, then drop the ioeventfds and irqfds. the counters stay valid*/
+void ioevent_stop(struct ioevent *dev) {
+    __u64 one = 1;
+
+    if (dev->running) {
+        if (write(dev->stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("can not stop device thread");
+        pthread_join(dev->thread, NULL);
+        dev->running = 0;
+    }
+    for (int i = 0; i < dev->nr_ports; i++) {
+        struct kvm_ioeventfd io = { .addr = dev->ports[i].port, .len = dev->ports[i].size, .fd = dev->ports[i].fd,
+                                    .flags = KVM_IOEVENTFD_FLAG_PIO | KVM_IOEVENTFD_FLAG_DEASSIGN };
+        ioctl(dev->kvm->vm_fd, KVM_IOEVENTFD, &io);
+        close(dev->ports[i].fd);
+    }
+    for (int i = 0; i < dev->nr_irqs; i++) {
+        struct kvm_irqfd bind = { .fd = dev->irqs[i].fd, .gsi = dev->irqs[i].gsi, .flags = KVM_IRQFD_FLAG_DEASSIGN };
+        ioctl(dev->kvm->vm_fd, KVM_IRQFD, &bind);
+        close(dev->irqs[i].fd);
+    }
+    close(dev->epoll_fd);
+    close(dev->stop_fd);
+}
+
+void ioevent_print(FILE *out, const struct ioevent *dev) {
+    __u64 writes = 0, raised = 0;
+
+    for (int i = 0; i < dev->nr_ports; i++)
+        writes += dev->ports[i].writes;
+    for (int i = 0; i < dev->nr_irqs; i++)
+        raised += dev->irqs[i].raised;
+    fprintf(out, "device thread: %llu port writes in %llu wakeups (%.1f per wakeup), %llu completions\n",
+            (unsigned long long)writes, (unsigned long long)dev->wakeups,
+            dev->wakeups ? (double)writes / dev->wakeups : 0.0, (unsigned long long)raised);
+}
@@ -0,0 +1,65 @@
+/*
+ * Device event loop: guest port writes wired to eventfds with KVM_IOEVENTFD
+ * complete in the kernel without an exit to userspace, a single device
+ * thread waits on all of them with epoll and runs the device handlers.
+ * Completions go back to the guest through KVM_IRQFD, which needs the in
+ * kernel irqchip. Only the fact that a port was written (and how often)
+ * reaches the device, the value written does not.
+ * author: rkroshan
+ */
+
+#ifndef IOEVENT_H
+#define IOEVENT_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/kvm.h>
+
+#define IOEVENT_MAX 128 /*ioeventfds plus irqfds of one vm*/
+#define IOEVENT_GSI_BASE 24 /*first gsi of msi routes, 0..23 stay the default pic/ioapic pins*/
+
+struct ioevent;
+
+/*device handler, count is the number of guest writes since the last call*/
+typedef void (*ioevent_fn)(struct ioevent *dev, int id, __u64 count, void *ctx);
+
+struct ioevent_port {
+    int fd; /*eventfd signalled by the kernel on every guest write*/
+    __u16 port;
+    __u8 size; /*access size the ioeventfd matches*/
+    ioevent_fn fn;
+    void *ctx;
+    __u64 writes; /*guest writes seen by the device thread*/
+};
+
+struct ioevent_irq {
+    int fd; /*eventfd bound to gsi with KVM_IRQFD*/
+    __u32 gsi;
+    __u64 raised; /*completions sent*/
+};
+
+struct ioevent {
+    struct kvm *kvm;
+    int epoll_fd;
+    int stop_fd; /*eventfd that ends the device thread*/
+    pthread_t thread;
+    int running;
+    struct ioevent_port ports[IOEVENT_MAX];
+    int nr_ports;
+    struct ioevent_irq irqs[IOEVENT_MAX];
+    int nr_irqs;
+    struct kvm_irq_routing_entry msi[IOEVENT_MAX]; /*msi routes added on top of the default ones*/
+    int nr_msi;
+    __u64 wakeups; /*epoll_wait returns with work, compare with the writes to see the batching*/
+};
+
+int ioevent_init(struct ioevent *dev, struct kvm *kvm);
+int ioevent_add_port(struct ioevent *dev, __u16 port, __u8 size, ioevent_fn fn, void *ctx);
+int ioevent_add_msi(struct ioevent *dev, __u32 apic_id, __u8 vector);
+int ioevent_add_irq(struct ioevent *dev, __u32 gsi);
+void ioevent_raise(struct ioevent *dev, int irq);
+int ioevent_start(struct ioevent *dev);
+void ioevent_stop(struct ioevent *dev);
+void ioevent_print(FILE *out, const struct ioevent *dev);
+
+#endif
@@ -0,0 +1,902 @@
+/*
+ * Exit latency microbenchmarks for the kvm_code_bin_multi vm.
+ * Every payload exercises one exit type in a tight loop, each one is run for a
+ * fixed duration on 1..N vcpus and the results are printed as a tab separated table.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include "kvm_code_bin_multi.h"
+#include "placement.h"
+#include "vm_pool.h"
+#include "vring.h"
+
+#define BENCH_MAX_VCPUS 64
+#define BENCH_SAMPLES (1 << 20) /*round trip samples kept per vcpu for the percentiles*/
+#define BENCH_COUNTERS 0x8000 /*offset from IMAGE_START of the compute payload counters, 64 bytes per vcpu*/
+#define BENCH_TOUCH_START 0x100000 /*the touch payload writes from 1MB to the end of ram*/
+#define BENCH_TOUCH_RAM_MB 128 /*default ram of the touch payload*/
+
+struct bench_payload {
+    const char *name; /*payload name in the table*/
+    const char *file; /*flat binary built from bench_<name>.S*/
+    __u32 exit_reason; /*exit the payload loops on, 0 for the compute baseline*/
+    int mode; /*BENCH_REAL, BENCH_FLAT32 or BENCH_LONG64, the cpu mode the payload starts in*/
+    int device; /*BENCH_DEV_*, ports serviced by the ioeventfd device thread, needs the in kernel irqchip*/
+};
+
+#define BENCH_REAL   0
+#define BENCH_FLAT32 1 /*32 bit protected mode with flat 4GB segments*/
+#define BENCH_LONG64 2 /*64 bit long mode, ram identity mapped with -L sized pages (kvm_setup_long_mode())*/
+
+#define BENCH_DEV_NONE     0
+#define BENCH_DEV_COUNT    1 /*port 0x10 on an ioeventfd, the device thread only counts the writes*/
+#define BENCH_DEV_DOORBELL 2 /*a doorbell port per vcpu, every ring is completed with an msi through an irqfd*/
+#define BENCH_DOORBELL_PORT 0x100 /*doorbell of vcpu 0, vcpu n rings BENCH_DOORBELL_PORT + n*/
+#define BENCH_DOORBELL_VECTOR 0x40
+#define BENCH_HYPERCALL_PORT 0x18 /*bench_hypercall.S: argument in rbx, the host answers rbx + 1 in rax*/
+
+static const struct bench_payload payloads[] = {
+    { "pio_out", "bench_pio_out.bin", KVM_EXIT_IO, BENCH_REAL, BENCH_DEV_NONE },
+    { "pio_in", "bench_pio_in.bin", KVM_EXIT_IO, BENCH_REAL, BENCH_DEV_NONE },
+    { "mmio", "bench_mmio.bin", KVM_EXIT_MMIO, BENCH_REAL, BENCH_DEV_NONE },
+    { "hlt", "bench_hlt.bin", KVM_EXIT_HLT, BENCH_REAL, BENCH_DEV_NONE },
+    { "compute", "bench_compute.bin", 0, BENCH_REAL, BENCH_DEV_NONE },
+    { "touch", "bench_touch.bin", KVM_EXIT_IO, BENCH_FLAT32, BENCH_DEV_NONE },
+    { "pio_out_ioeventfd", "bench_pio_out.bin", 0, BENCH_REAL, BENCH_DEV_COUNT },
+    { "doorbell", "bench_doorbell.bin", 0, BENCH_FLAT32, BENCH_DEV_DOORBELL },
+    { "compute64", "bench_compute64.bin", 0, BENCH_LONG64, BENCH_DEV_NONE },
+    { "touch64", "bench_touch64.bin", KVM_EXIT_IO, BENCH_LONG64, BENCH_DEV_NONE },
+    { "hypercall", "bench_hypercall.bin", KVM_EXIT_IO, BENCH_REAL, BENCH_DEV_NONE },
+};
+
+/*dirty tracking sweep (-D), not part of the payload table*/
+static const struct bench_payload dirty_payload = { "dirty", "bench_dirty.bin", KVM_EXIT_IO, BENCH_FLAT32, BENCH_DEV_NONE };
+static const unsigned int dirty_delays[] = { 0, 100, 1000, 10000 }; /*guest spin count between two pages*/
+#define BENCH_DIRTY_PAGES_PER_EXIT 16
+#define BENCH_DIRTY_FILE "bench_dirty.img"
+
+/*vm host sweep (-M), not part of the payload table*/
+static const struct bench_payload mixed_payload = { "mixed", "bench_mixed.bin", KVM_EXIT_IO, BENCH_REAL, BENCH_DEV_NONE };
+
+/*ring device sweep (-Q) against the port per value path of pio_out*/
+static const struct bench_payload vring_payload = { "vring", "bench_vring.bin", KVM_EXIT_IO, BENCH_FLAT32, BENCH_DEV_NONE };
+static const unsigned int vring_batches[] = { 1, 4, 16, 64, 256 }; /*buffers per kick*/
+#define BENCH_PIO_BYTES 2 /*bench_pio_out.S moves %ax per exit*/
+
+static __u64 bench_ram_size; /*guest ram of the current run*/
+static __u64 bench_long_page = 2ULL << 20; /*page size of the long mode payloads, -L*/
+static unsigned int bench_dirty_delay; /*spin count handed to the dirty payload*/
+static unsigned int bench_vring_batch, bench_vring_bytes; /*handed to the vring payload*/
+static struct vring bench_vring; /*ring of the vring payload, consumed by vcpu 0 on every kick*/
+static __u32 bench_vring_seq; /*sequence number the next buffer has to hold*/
+
+/*per vcpu results, only written by its vcpu thread*/
+struct bench_vcpu {
+    __u64 *samples; /*KVM_RUN round trip cycles*/
+    unsigned long nr_samples; /*valid entries in samples*/
+    unsigned long exits; /*exits with the payload exit reason*/
+    const struct bench_payload *payload;
+};
+
+static struct bench_vcpu bench_vcpus[BENCH_MAX_VCPUS];
+static atomic_int bench_stop; /*set when the duration is over*/
+
+/*32 bit protected mode with flat segments, only the hidden segment state matters so no gdt is needed*/
+static void bench_reset_flat32(struct vcpu *vcpu) {
+    struct kvm_segment code = {
+        .base = 0, .limit = 0xffffffff, .selector = 0x8,
+        .type = 0xb, .present = 1, .dpl = 0, .db = 1, .s = 1, .l = 0, .g = 1,
+    };
+    struct kvm_segment data = code;
+
+    data.type = 0x3;
+    data.selector = 0x10;
+    vcpu->sregs.cs = code;
+    vcpu->sregs.ds = vcpu->sregs.es = vcpu->sregs.fs = vcpu->sregs.gs = vcpu->sregs.ss = data;
+    vcpu->sregs.cr0 |= 1; /*PE*/
+    if (vcpu_set_sregs(vcpu) < 0)
+        exit(1);
+
+    vcpu->regs.rip = IMAGE_START;
+    vcpu->regs.rsp = IMAGE_START;
+    vcpu->regs.rdi = BENCH_TOUCH_START;
+    vcpu->regs.rsi = bench_ram_size;
+    if (vcpu_set_regs(vcpu) < 0)
+        exit(1);
+}
+
+/*64 bit long mode with identity mapped ram, same registers as the flat32 payloads*/
+static void bench_reset_long64(struct vcpu *vcpu) {
+    kvm_reset_vcpu_long(vcpu);
+    vcpu->regs.rdi = BENCH_TOUCH_START;
+    vcpu->regs.rsi = bench_ram_size;
+    if (vcpu_set_regs(vcpu) < 0)
+        exit(1);
+}
+
+/*vring consumer: read the buffer in place, every dword has to be the sequence number of the buffer*/
+static void bench_vring_check(void *ctx, const void *data, __u32 len) {
+    __u32 *seq = (__u32 *)ctx;
+    const __u32 *word = (const __u32 *)data;
+
+    for (__u32 i = 0; i < len / 4; i++) {
+        if (word[i] != *seq)
+            errx(1, "vring: buffer %u holds %u at dword %u", *seq, word[i], i);
+    }
+    (*seq)++;
+}
+
+static void *bench_vcpu_thread(void *data) {
+    struct vcpu *vcpu = (struct vcpu *)data;
+    struct bench_vcpu *bench = &bench_vcpus[vcpu->vcpu_id];
+    struct kvm_run *run = vcpu->kvm_run;
+
+    if (bench->payload->mode == BENCH_LONG64)
+        bench_reset_long64(vcpu);
+    else
+        kvm_reset_vcpu(vcpu);
+    if (bench->payload->mode == BENCH_FLAT32)
+        bench_reset_flat32(vcpu);
+    if (bench->payload == &dirty_payload) {
+        vcpu->regs.rcx = bench_dirty_delay;
+        if (vcpu_set_regs(vcpu) < 0)
+            exit(1);
+    }
+    if (bench->payload == &vring_payload) {
+        vcpu->regs.rbx = bench_vring_batch;
+        vcpu->regs.rbp = bench_vring_bytes;
+        if (vcpu_set_regs(vcpu) < 0)
+            exit(1);
+    }
+    if (bench->payload->device == BENCH_DEV_DOORBELL) { /*own doorbell and own stack, interrupts push on it*/
+        vcpu->regs.rdx = BENCH_DOORBELL_PORT + vcpu->vcpu_id;
+        vcpu->regs.rsp = BENCH_TOUCH_START + (vcpu->vcpu_id + 1) * 4096;
+        if (vcpu_set_regs(vcpu) < 0)
+            exit(1);
+    }
+    if (bench->payload->exit_reason == 0 && !bench->payload->device) { /*compute payload: give each vcpu its own counter*/
+        vcpu->regs.rbx = BENCH_COUNTERS + vcpu->vcpu_id * 64;
+        if (bench->payload->mode != BENCH_REAL) /*no segment base at the image, a linear address*/
+            vcpu->regs.rbx += IMAGE_START;
+        if (vcpu_set_regs(vcpu) < 0)
+            exit(1);
+    }
+
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed)) {
+        __u64 begin = __rdtsc();
+        int ret = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+        __u64 cycles = __rdtsc() - begin;
+
+        if (ret < 0 && errno == EINTR) { /*kicked out for a pause or the end of the run*/
+            run->immediate_exit = 0;
+            kvm_pause_point(vcpu);
+            continue;
+        }
+        if (ret < 0)
+            err(1, "KVM_RUN");
+        if (atomic_load_explicit(&vcpu->kvm->first_exit_ns, memory_order_relaxed) == 0)
+            kvm_note_first_exit(vcpu->kvm);
+        if (run->exit_reason == KVM_EXIT_DIRTY_RING_FULL) {
+            dirty_ring_harvest(vcpu->kvm, vcpu);
+            continue;
+        }
+        if (run->exit_reason != bench->payload->exit_reason)
+            errx(1, "%s: unexpected exit_reason = 0x%x", bench->payload->name, run->exit_reason);
+
+        if (run->exit_reason == KVM_EXIT_IO && run->io.port == VRING_PORT && bench->payload == &vring_payload)
+            vring_kick(&bench_vring, bench_vring_check, &bench_vring_seq);
+        if (run->exit_reason == KVM_EXIT_IO && run->io.port == BENCH_HYPERCALL_PORT) { /*a register read and write per exit*/
+            if (vcpu_get_regs(vcpu) < 0)
+                exit(1);
+            vcpu->regs.rax = vcpu->regs.rbx + 1;
+            if (vcpu_set_regs(vcpu) < 0)
+                exit(1);
+        }
+        if (run->exit_reason == KVM_EXIT_IO && run->io.direction == KVM_EXIT_IO_IN)
+            memset((char *)run + run->io.data_offset, 0x5a, run->io.size * run->io.count); /*the value the guest reads*/
+        bench->exits++;
+        if (bench->nr_samples < BENCH_SAMPLES)
+            bench->samples[bench->nr_samples++] = cycles;
+        kvm_pause_point(vcpu); /*only the dirty and pause sweeps pause*/
+    }
+    kvm_vcpu_done(vcpu);
+    return NULL;
+}
+
+/*device thread: a doorbell rang, complete it on the irqfd that routes to the same vcpu*/
+static void bench_doorbell(struct ioevent *dev, int id, __u64 count, void *ctx) {
+    (void)count;
+    (void)ctx;
+    ioevent_raise(dev, id);
+}
+
+/*wire the payload ports to the device thread, ports and irqfds are added in vcpu order so their ids match*/
+static void bench_setup_device(struct kvm *kvm, const struct bench_payload *payload, int nr_vcpus) {
+    if (ioevent_init(&kvm->dev, kvm) < 0)
+        errx(1, "device setup fault");
+    if (payload->device == BENCH_DEV_COUNT) {
+        if (ioevent_add_port(&kvm->dev, 0x10, 2, NULL, NULL) < 0) /*bench_pio_out.S writes %ax*/
+            errx(1, "device setup fault");
+    } else {
+        for (int i = 0; i < nr_vcpus; i++) {
+            int gsi = ioevent_add_msi(&kvm->dev, i, BENCH_DOORBELL_VECTOR);
+            if (gsi < 0 || ioevent_add_port(&kvm->dev, BENCH_DOORBELL_PORT + i, 1, bench_doorbell, NULL) < 0 ||
+                ioevent_add_irq(&kvm->dev, gsi) < 0)
+                errx(1, "device setup fault");
+        }
+    }
+    if (ioevent_start(&kvm->dev) < 0)
+        errx(1, "device setup fault");
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*result of one payload on one vcpu count*/
+struct bench_result {
+    double secs;
+    unsigned long exits;
+    unsigned long ops; /*exits, loop iterations for compute, pages written for touch*/
+    __u64 p50, p99; /*round trip cycles*/
+    double first_exit_us; /*from KVM_CREATE_VM to the first exit of any vcpu*/
+    double image_us; /*time spent copying or mapping the image*/
+    char backing[32]; /*ram backing in use after any fallback*/
+    unsigned long reg_ioctls; /*register get/set ioctls of all vcpus, reset included*/
+    double pause_p50_us, pause_p99_us, pause_max_us; /*kvm_pause() to every vcpu parked, pause sweep only*/
+};
+
+static int bench_pauses; /*-K: pause and resume the vms this many times during each run*/
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*spread bench_pauses pause/resume cycles over the run instead of sleeping through it*/
+static void bench_pause_loop(struct kvm *kvm, int duration_ms, struct bench_result *res) {
+    long interval_ns = duration_ms * 1000000L / bench_pauses;
+    struct timespec interval = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L };
+    double *lat = malloc(bench_pauses * sizeof(double));
+
+    if (lat == NULL)
+        err(1, "can not allocate latencies");
+    for (int i = 0; i < bench_pauses; i++) {
+        struct timespec t0, t1;
+
+        nanosleep(&interval, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        kvm_pause(kvm);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        kvm_resume(kvm);
+        lat[i] = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    }
+    qsort(lat, bench_pauses, sizeof(double), cmp_double);
+    res->pause_p50_us = lat[bench_pauses / 2];
+    res->pause_p99_us = lat[bench_pauses * 99 / 100];
+    res->pause_max_us = lat[bench_pauses - 1];
+    free(lat);
+}
+
+static void bench_run(const struct bench_payload *payload, int nr_vcpus, int duration_ms, struct bench_result *res) {
+    struct timespec start, end, wait = { .tv_sec = duration_ms / 1000, .tv_nsec = (duration_ms % 1000) * 1000000L };
+    struct kvm *kvm = kvm_init();
+    __u64 ram_size = RAM_SIZE;
+
+    if (opts.ram_mb)
+        ram_size = (__u64)opts.ram_mb << 20;
+    else if (payload->mode != BENCH_REAL)
+        ram_size = (__u64)BENCH_TOUCH_RAM_MB << 20;
+
+    opts.irqchip = payload->device != BENCH_DEV_NONE;
+    if (kvm == NULL || kvm_create_vm(kvm, ram_size) < 0)
+        errx(1, "create vm fault");
+    bench_ram_size = kvm->ram_size;
+    if (kvm_load_image(kvm, payload->file) < 0)
+        errx(1, "load image fault");
+    if (payload->mode == BENCH_LONG64 && kvm_setup_long_mode(kvm, bench_long_page) < 0)
+        errx(1, "long mode setup fault");
+
+    kvm->vcpu_number = nr_vcpus;
+    for (int i = 0; i < nr_vcpus; i++) {
+        bench_vcpus[i].payload = payload;
+        bench_vcpus[i].exits = 0;
+        bench_vcpus[i].nr_samples = 0;
+    }
+    kvm->vcpus = kvm_create_vpcus(kvm, nr_vcpus, bench_vcpu_thread);
+    if (kvm->vcpus == NULL)
+        errx(1, "create vcpus fault");
+    if (payload->device)
+        bench_setup_device(kvm, payload, nr_vcpus);
+
+    atomic_store(&bench_stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nr_vcpus; i++) {
+        if (kvm_start_vcpu(&kvm->vcpus[i]) < 0)
+            exit(1);
+    }
+
+    struct bench_result pause = { 0 };
+    if (bench_pauses)
+        bench_pause_loop(kvm, duration_ms, &pause);
+    else
+        nanosleep(&wait, NULL);
+
+    atomic_store(&bench_stop, 1);
+    kvm_kick_vcpus(kvm);
+    for (int i = 0; i < nr_vcpus; i++)
+        pthread_join(kvm->vcpus[i].vcpu_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (payload->device)
+        ioevent_stop(&kvm->dev);
+
+    memset(res, 0, sizeof(struct bench_result));
+    res->pause_p50_us = pause.pause_p50_us;
+    res->pause_p99_us = pause.pause_p99_us;
+    res->pause_max_us = pause.pause_max_us;
+    res->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    unsigned long nr_samples = 0;
+    for (int i = 0; i < nr_vcpus; i++) {
+        res->exits += bench_vcpus[i].exits;
+        res->reg_ioctls += kvm->vcpus[i].stats.reg_ioctls;
+        nr_samples += bench_vcpus[i].nr_samples;
+        if (payload->exit_reason == 0 && !payload->device)
+            res->ops += *(__u32 *)(kvm->ram_start + IMAGE_START + BENCH_COUNTERS + i * 64);
+    }
+    if (payload->device) { /*port writes counted by the device thread, one per doorbell ring*/
+        for (int i = 0; i < kvm->dev.nr_ports; i++)
+            res->ops += kvm->dev.ports[i].writes;
+    } else if (payload->mode != BENCH_REAL && payload->exit_reason == KVM_EXIT_IO)
+        res->ops = res->exits * ((bench_ram_size - BENCH_TOUCH_START) / 4096);
+    else if (payload->exit_reason != 0)
+        res->ops = res->exits;
+    res->first_exit_us = atomic_load(&kvm->first_exit_ns) / 1e3;
+    res->image_us = kvm->image_load_ns / 1e3;
+    snprintf(res->backing, sizeof(res->backing), "%s", kvm->ram.backing);
+
+    if (nr_samples) { /*all vcpus together for the percentiles*/
+        __u64 *all = malloc(nr_samples * sizeof(__u64));
+        unsigned long n = 0;
+        if (all == NULL)
+            err(1, "can not allocate samples");
+        for (int i = 0; i < nr_vcpus; i++) {
+            memcpy(all + n, bench_vcpus[i].samples, bench_vcpus[i].nr_samples * sizeof(__u64));
+            n += bench_vcpus[i].nr_samples;
+        }
+        qsort(all, n, sizeof(__u64), cmp_u64);
+        res->p50 = all[n / 2];
+        res->p99 = all[(n * 99) / 100];
+        free(all);
+    }
+
+    kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+    kvm_clean_vm(kvm); /*stops the fault handler, its stats are final*/
+    if (opts.lazy_window) {
+        fprintf(stderr, "%s on %d vcpus: ", payload->name, nr_vcpus);
+        lazy_mem_print(stderr, &kvm->lazy);
+    }
+    kvm_clean(kvm);
+}
+
+/*one row of the dirty sweep: the dirty payload on one vcpu, every interval_ms the vcpu is paused
+ *and either an incremental checkpoint is written or the vm is reset to its starting point*/
+static void bench_dirty_run(int reset, unsigned int delay, int interval_ms, int duration_ms) {
+    struct timespec start, now, interval = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L };
+    struct snapshot_baseline base;
+    struct kvm *kvm = kvm_init();
+    unsigned long nr = 0, total_pages = 0;
+    double total_ms = 0, secs;
+
+    if (kvm == NULL || kvm_create_vm(kvm, opts.ram_mb ? (__u64)opts.ram_mb << 20 : (__u64)BENCH_TOUCH_RAM_MB << 20) < 0)
+        errx(1, "create vm fault");
+    bench_ram_size = kvm->ram_size;
+    bench_dirty_delay = delay;
+    if (kvm_load_image(kvm, dirty_payload.file) < 0)
+        errx(1, "load image fault");
+
+    kvm->vcpu_number = 1;
+    bench_vcpus[0].payload = &dirty_payload;
+    bench_vcpus[0].exits = 0;
+    bench_vcpus[0].nr_samples = 0;
+    kvm->vcpus = kvm_create_vpcus(kvm, 1, bench_vcpu_thread);
+    if (kvm->vcpus == NULL)
+        errx(1, "create vcpus fault");
+
+    atomic_store(&bench_stop, 0);
+    if (kvm_start_vcpu(&kvm->vcpus[0]) < 0)
+        exit(1);
+
+    /*full snapshot first, checkpoints go on from it and resets go back to it*/
+    kvm_pause(kvm);
+    if (snapshot_save(kvm, BENCH_DIRTY_FILE) < 0 || (reset && snapshot_baseline_open(&base, BENCH_DIRTY_FILE) < 0))
+        errx(1, "snapshot fault");
+    kvm_resume(kvm);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        struct timespec t0, t1;
+
+        nanosleep(&interval, NULL);
+        kvm_pause(kvm);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long pages = reset ? snapshot_reset(kvm, &base) : snapshot_checkpoint(kvm, BENCH_DIRTY_FILE);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        kvm_resume(kvm);
+        if (pages < 0)
+            errx(1, "%s fault", reset ? "reset" : "checkpoint");
+
+        nr++;
+        total_pages += pages;
+        total_ms += (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L < duration_ms);
+
+    atomic_store(&bench_stop, 1);
+    kvm_kick_vcpu(&kvm->vcpus[0]);
+    pthread_join(kvm->vcpus[0].vcpu_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    /*guest_pages_per_ms counts every page write, dirty pages only count once per interval*/
+    printf("%s\t%s\t%u\t%.3f\t%lu\t%.1f\t%.1f\t%.0f\t%.3f\t%.0f\n", reset ? "reset" : "checkpoint",
+           kvm->dirty.ring_entries ? "ring" : "bitmap", delay, secs, nr,
+           bench_vcpus[0].exits * BENCH_DIRTY_PAGES_PER_EXIT / (secs * 1e3), (double)total_pages / nr,
+           (double)total_pages / nr * (DIRTY_PAGE_SIZE / 1024), total_ms / nr, total_ms > 0 ? total_pages / total_ms : 0.0);
+    fflush(stdout);
+
+    if (reset)
+        snapshot_baseline_close(&base);
+    unlink(BENCH_DIRTY_FILE);
+    kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+    kvm_clean_vm(kvm);
+    kvm_clean(kvm);
+}
+
+/*one row of the ring device sweep: the vring payload on one vcpu, batch buffers of bytes each per kick*/
+static void bench_vring_run(unsigned int batch, unsigned int bytes, int duration_ms) {
+    struct timespec start, end, wait = { .tv_sec = duration_ms / 1000, .tv_nsec = (duration_ms % 1000) * 1000000L };
+    struct kvm *kvm = kvm_init();
+
+    if (kvm == NULL || kvm_create_vm(kvm, opts.ram_mb ? (__u64)opts.ram_mb << 20 : (__u64)BENCH_TOUCH_RAM_MB << 20) < 0)
+        errx(1, "create vm fault");
+    bench_ram_size = kvm->ram_size;
+    if (BENCH_TOUCH_START + (__u64)VRING_SIZE * bytes > kvm->ram_size)
+        errx(1, "%d buffers of %u bytes do not fit in guest ram", VRING_SIZE, bytes);
+    if (kvm_load_image(kvm, vring_payload.file) < 0 || vring_init(&bench_vring, (void *)kvm->ram_start, kvm->ram_size, VRING_GPA) < 0)
+        errx(1, "load image fault");
+    bench_vring_batch = batch;
+    bench_vring_bytes = bytes;
+    bench_vring_seq = 0;
+
+    kvm->vcpu_number = 1;
+    bench_vcpus[0].payload = &vring_payload;
+    bench_vcpus[0].exits = 0;
+    bench_vcpus[0].nr_samples = 0;
+    kvm->vcpus = kvm_create_vpcus(kvm, 1, bench_vcpu_thread);
+    if (kvm->vcpus == NULL)
+        errx(1, "create vcpus fault");
+
+    atomic_store(&bench_stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (kvm_start_vcpu(&kvm->vcpus[0]) < 0)
+        exit(1);
+    nanosleep(&wait, NULL);
+    atomic_store(&bench_stop, 1);
+    kvm_kick_vcpu(&kvm->vcpus[0]);
+    pthread_join(kvm->vcpus[0].vcpu_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("vring\t%u\t%u\t%.3f\t%lu\t%.0f\t%llu\t%.1f\n", batch, bytes, secs, bench_vcpus[0].exits,
+           bench_vcpus[0].exits / secs, (unsigned long long)bench_vring.buffers, bench_vring.bytes / secs / 1e6);
+    fflush(stdout);
+    if (bench_vring.bad)
+        fprintf(stderr, "vring: %llu descriptors outside guest ram\n", (unsigned long long)bench_vring.bad);
+
+    kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+    kvm_clean_vm(kvm);
+    kvm_clean(kvm);
+}
+
+/*one row of the vm host sweep: nr_vms single vcpu vms of the mixed payload in this process*/
+static void bench_host_run(int nr_vms, int nr_tokens, int duration_ms) {
+    unsigned long exits, halts, preempted, ops;
+    struct vm_host host;
+    double secs;
+
+    if (vm_host_init(&host, nr_vms, nr_vms, nr_tokens) < 0)
+        errx(1, "vm host fault");
+    for (int i = 0; i < nr_vms; i++) {
+        if (vm_host_add(&host, mixed_payload.file, RAM_SIZE, 1) < 0)
+            errx(1, "vm host: can not create vm %d", i);
+    }
+    if (vm_host_run(&host, duration_ms, &secs) < 0)
+        errx(1, "vm host run fault");
+    vm_host_totals(&host, &exits, &halts, &preempted, &ops);
+    printf("%d\t%d\t%.1f\t%.3f\t%.0f\t%.0f\t%lu\t%lu\n", nr_vms, host.nr_tokens, host.setup_ns / 1e3 / nr_vms, secs,
+           exits / secs, ops * 2 / secs, halts, preempted);
+    fflush(stdout);
+    vm_host_destroy(&host);
+}
+
+/*job sweep vcpu: run the checksum guest until it halts, it never exits before*/
+static void *bench_job_thread(void *data) {
+    struct vcpu *vcpu = (struct vcpu *)data;
+
+    kvm_reset_vcpu_long(vcpu); /*takes its partition from vcpu->kvm->job*/
+    for (;;) {
+        if (ioctl(vcpu->vcpu_fd, KVM_RUN, 0) < 0)
+            err(1, "KVM_RUN");
+        if (vcpu->kvm_run->exit_reason == KVM_EXIT_HLT)
+            return NULL;
+        errx(1, "job: unexpected exit_reason = 0x%x", vcpu->kvm_run->exit_reason);
+    }
+}
+
+/*one row of the job sweep: nr_vcpus sum mb MB of guest ram, base_secs is the 1 vcpu time for the speedup*/
+static void bench_job_run(int nr_vcpus, int mb, double *base_secs) {
+    struct timespec start, end;
+    struct smp_job job;
+    struct kvm *kvm = kvm_init();
+
+    if (kvm == NULL || kvm_create_vm(kvm, SMP_JOB_BUF + ((__u64)(mb + 1) << 20)) < 0)
+        errx(1, "create vm fault");
+    if (kvm_load_image(kvm, SMP_JOB_FILE) < 0 || kvm_setup_long_mode(kvm, bench_long_page) < 0)
+        errx(1, "load image fault");
+    if (smp_job_init(&job, kvm, (__u64)mb << 20, nr_vcpus) < 0)
+        errx(1, "job setup fault");
+    kvm->job = &job;
+    kvm->vcpu_number = nr_vcpus;
+    kvm->vcpus = kvm_create_vpcus(kvm, nr_vcpus, bench_job_thread);
+    if (kvm->vcpus == NULL)
+        errx(1, "create vcpus fault");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nr_vcpus; i++) {
+        if (kvm_start_vcpu(&kvm->vcpus[i]) < 0)
+            exit(1);
+    }
+    for (int i = 0; i < nr_vcpus; i++)
+        pthread_join(kvm->vcpus[i].vcpu_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int ok = smp_job_collect(&job, kvm) == 0;
+    if (nr_vcpus == 1)
+        *base_secs = secs;
+    printf("%d\t%d\t%.3f\t%.1f\t%.2f\t%.3f\t%s\n", nr_vcpus, mb, secs, job.buf_len / 1e6 / secs, *base_secs / secs,
+           *base_secs / secs / nr_vcpus, ok ? "ok" : "WRONG");
+    fflush(stdout);
+    kvm_clean_vcpus(kvm->vcpus, nr_vcpus);
+    kvm_clean_vm(kvm);
+    kvm_clean(kvm);
+}
+
+/*run vcpu 0 of a fresh vm until its first exit, in the calling thread*/
+static void bench_to_first_exit(struct kvm *kvm) {
+    struct vcpu *vcpu = &kvm->vcpus[0];
+
+    if (ioctl(vcpu->vcpu_fd, KVM_RUN, 0) < 0)
+        err(1, "KVM_RUN");
+    kvm_note_first_exit(kvm);
+    if (vcpu->kvm_run->exit_reason != KVM_EXIT_IO)
+        errx(1, "vm creation: unexpected exit_reason = 0x%x", vcpu->kvm_run->exit_reason);
+}
+
+#define BENCH_VM_COLD       0 /*everything from KVM_CREATE_VM on for every vm*/
+#define BENCH_VM_POOL       1 /*vm_pool_get() and vm_pool_put(), vms are recycled*/
+#define BENCH_VM_POOL_FRESH 2 /*vm_pool_get() and vm_pool_release(), the refill thread builds new ones*/
+
+/*one row of the vm creation sweep: count vms from request to their first exit, one after the other*/
+static void bench_vm_run(int mode, int count, int pool_size) {
+    static const char *names[] = { "cold", "pool", "pool_fresh" };
+    struct timespec start, end;
+    struct vm_pool pool;
+    __u64 *lat = malloc(count * sizeof(__u64));
+
+    if (lat == NULL)
+        err(1, "can not allocate latencies");
+    bench_vcpus[0].payload = &payloads[0];
+    if (mode != BENCH_VM_COLD) {
+        if (vm_pool_init(&pool, payloads[0].file, RAM_SIZE, 1, bench_vcpu_thread, pool_size) < 0)
+            errx(1, "vm pool fault");
+        /*measure a full pool, not the first fill*/
+        while (__atomic_load_n(&pool.nr_ready, __ATOMIC_RELAXED) < pool_size)
+            usleep(1000);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        struct timespec t0, t1;
+        struct kvm *kvm;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (mode == BENCH_VM_COLD) {
+            kvm = kvm_init();
+            if (kvm == NULL || kvm_create_vm(kvm, RAM_SIZE) < 0 || kvm_load_image(kvm, payloads[0].file) < 0)
+                errx(1, "create vm fault");
+            kvm->vcpu_number = 1;
+            kvm->vcpus = kvm_create_vpcus(kvm, 1, bench_vcpu_thread);
+            if (kvm->vcpus == NULL)
+                errx(1, "create vcpus fault");
+            kvm_reset_vcpu(&kvm->vcpus[0]);
+        } else {
+            kvm = vm_pool_get(&pool);
+            if (kvm == NULL)
+                errx(1, "vm pool get fault");
+        }
+        bench_to_first_exit(kvm);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        lat[i] = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + (t1.tv_nsec - t0.tv_nsec);
+
+        if (mode == BENCH_VM_POOL) {
+            vm_pool_put(&pool, kvm);
+        } else if (mode == BENCH_VM_POOL_FRESH) {
+            vm_pool_release(&pool, kvm);
+        } else {
+            kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+            kvm_clean_vm(kvm);
+            kvm_clean(kvm);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    qsort(lat, count, sizeof(__u64), cmp_u64);
+    printf("%s\t%d\t%.3f\t%.0f\t%.1f\t%.1f\t%lu\t%lu\n", names[mode], count, secs, count / secs,
+           lat[count / 2] / 1e3, lat[(count * 99) / 100] / 1e3,
+           mode != BENCH_VM_COLD ? pool.hits : 0, mode != BENCH_VM_COLD ? pool.misses : 0);
+    fflush(stdout);
+    if (mode != BENCH_VM_COLD)
+        vm_pool_destroy(&pool);
+    free(lat);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n max_vcpus] [-d duration_ms] [-p payload] [-P cpus] [-m policy] [-b backing] [-r MB] [-i mode] [-l pages] [-L 2M|1G] [-Y]\n"
+            "       %s -D bitmap|ring [-C ms] [-d duration_ms] [-r MB]\n"
+            "       %s -V count [-s pool_size]\n"
+            "       %s -Q bytes [-d duration_ms]\n"
+            "       %s -M max_vms [-T tokens] [-d duration_ms]\n"
+            "       %s -J MB [-n max_vcpus] [-L 2M|1G]\n"
+            "       %s -K pauses [-p payload] [-n max_vcpus] [-d duration_ms]\n"
+            "  -n max_vcpus   run every payload on 1..max_vcpus vcpus (default %d)\n"
+            "  -d ms          duration of every run (default 1000)\n"
+            "  -p payload     only run this payload (pio_out, pio_in, mmio, hlt, compute, touch,\n"
+            "                 pio_out_ioeventfd, doorbell, compute64, touch64, hypercall)\n"
+            "  -P cpus        run every row unpinned and pinned (\"auto\" or a cpu list) to compare them\n"
+            "  -m policy      guest ram numa policy, as kvm_code_bin_multi -m\n"
+            "  -b backing     guest ram backing, as kvm_code_bin_multi -b\n"
+            "  -r MB          guest ram size (default 1, %d for touch and the 32/64 bit payloads)\n"
+            "  -i mode        image loading, as kvm_code_bin_multi -i\n"
+            "  -l pages       demand page guest ram, as kvm_code_bin_multi -l, fault stats go to stderr\n"
+            "  -L size        page size of the long mode identity map of compute64 and touch64 (default 2M)\n"
+            "  -Y             register access through ioctls instead of KVM_CAP_SYNC_REGS, compare syscalls_per_exit\n"
+            "  -D mode        dirty tracking sweep instead of the payloads: checkpoint and reset cost\n"
+            "                 against guest write rate, with the dirty bitmap or the dirty ring\n"
+            "  -C ms          checkpoint/reset interval of the dirty sweep (default 10)\n"
+            "  -V count       vm creation sweep instead of the payloads: count vms from request to first exit,\n"
+            "                 cold and from a pool of pre-built vms cloned from a template\n"
+            "  -s pool_size   vms kept ready by the pool (default 8)\n"
+            "  -Q bytes       ring device sweep instead of the payloads: MB/s through a virtio style ring with\n"
+            "                 buffers of bytes and 1..256 buffers per kick, against one out per value\n"
+            "  -M max_vms     vm host sweep instead of the payloads: 1, 2, 4 .. max_vms small vms in this process,\n"
+            "                 aggregate exits and guest instructions per second\n"
+            "  -T tokens      vcpus of the vm host allowed in KVM_RUN at once (default: online cpus)\n"
+            "  -J MB          smp job sweep instead of the payloads: 1..max_vcpus vcpus checksum MB of guest ram\n"
+            "                 in parallel (job64.bin), each halts after writing its result line\n"
+            "  -K pauses      pause sweep instead: pause (kick every vcpu out of KVM_RUN and wait for all of them)\n"
+            "                 and resume the vm pauses times per run, latency percentiles per payload and vcpu count\n",
+            prog, prog, prog, prog, prog, prog, prog, NUM_VPCUS, BENCH_TOUCH_RAM_MB);
+}
+
+int main(int argc, char **argv) {
+    int max_vcpus = NUM_VPCUS;
+    int duration_ms = 1000;
+    const char *only = NULL;
+    const char *pin = NULL;
+    int interval_ms = 10;
+    int vm_count = 0;
+    int pool_size = 8;
+    int vring_bytes = 0;
+    int max_vms = 0;
+    int nr_tokens = 0;
+    int job_mb = 0;
+    int image_mode = 0; /*-i given*/
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:p:P:m:b:r:i:D:C:V:s:l:Q:M:T:L:J:K:Yh")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_vcpus = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'p':
+            only = optarg;
+            break;
+        case 'P':
+            pin = optarg;
+            break;
+        case 'm':
+            opts.mem_policy = optarg;
+            break;
+        case 'b':
+            opts.ram_backing = optarg;
+            break;
+        case 'r':
+            opts.ram_mb = atoi(optarg);
+            break;
+        case 'i':
+            if ((opts.image_map = kvm_image_mode(optarg)) < 0)
+                return -1;
+            image_mode = 1;
+            break;
+        case 'D':
+            if ((opts.dirty_log = dirty_mode(optarg)) < 0)
+                return -1;
+            break;
+        case 'C':
+            interval_ms = atoi(optarg);
+            break;
+        case 'V':
+            vm_count = atoi(optarg);
+            break;
+        case 'l':
+            opts.lazy_window = atoi(optarg);
+            break;
+        case 's':
+            pool_size = atoi(optarg);
+            break;
+        case 'Q':
+            vring_bytes = atoi(optarg);
+            break;
+        case 'M':
+            max_vms = atoi(optarg);
+            break;
+        case 'T':
+            nr_tokens = atoi(optarg);
+            break;
+        case 'K':
+            bench_pauses = atoi(optarg);
+            break;
+        case 'Y':
+            opts.no_sync_regs = 1;
+            break;
+        case 'J':
+            job_mb = atoi(optarg);
+            break;
+        case 'L':
+            if ((bench_long_page = kvm_long_mode(optarg)) == 0)
+                return -1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (max_vcpus < 1 || max_vcpus > BENCH_MAX_VCPUS)
+        errx(1, "max_vcpus must be in 1..%d", BENCH_MAX_VCPUS);
+    if (opts.mem_policy && placement_check_policy(opts.mem_policy) < 0)
+        return -1;
+    if (opts.lazy_window && image_mode)
+        errx(1, "-l does not go with -i, the fault handler reads the image in");
+
+    opts.quiet = 1;
+
+    for (int i = 0; i < max_vcpus; i++) {
+        bench_vcpus[i].samples = malloc(BENCH_SAMPLES * sizeof(__u64));
+        if (bench_vcpus[i].samples == NULL)
+            err(1, "can not allocate samples");
+    }
+
+    if (vm_count > 0) {
+        if (pool_size < 1)
+            errx(1, "pool_size must be at least 1");
+        printf("mode\tvms\tsecs\tvms_per_sec\tp50_us\tp99_us\thits\tmisses\n");
+        for (int mode = BENCH_VM_COLD; mode <= BENCH_VM_POOL_FRESH; mode++)
+            bench_vm_run(mode, vm_count, pool_size);
+        return 0;
+    }
+
+    if (job_mb > 0) {
+        double base_secs = 0;
+
+        printf("vcpus\tMB\tsecs\tMB_per_sec\tspeedup\tscaling_eff\tchecksum\n");
+        for (int n = 1; n <= max_vcpus; n++)
+            bench_job_run(n, job_mb, &base_secs);
+        return 0;
+    }
+
+    if (max_vms > 0) {
+        /*guest_insns_per_sec: two instructions per loop iteration of bench_mixed.S, exits and halts not counted*/
+        printf("vms\ttokens\tsetup_us_per_vm\tsecs\texits_per_sec\tguest_insns_per_sec\thalts\tpreempted\n");
+        for (int n = 1; n <= max_vms; n = n < max_vms && n * 2 > max_vms ? max_vms : n * 2)
+            bench_host_run(n, nr_tokens, duration_ms);
+        return 0;
+    }
+
+    if (vring_bytes > 0) {
+        struct bench_result res;
+
+        if (vring_bytes % 4)
+            errx(1, "vring buffer bytes must be a multiple of 4");
+        printf("path\tbatch\tbuf_bytes\tsecs\texits\texits_per_sec\tbuffers\tMB_per_sec\n");
+        bench_run(&payloads[0], 1, duration_ms, &res);
+        printf("pio\t1\t%d\t%.3f\t%lu\t%.0f\t%lu\t%.1f\n", BENCH_PIO_BYTES, res.secs, res.exits, res.exits / res.secs,
+               res.exits, res.exits * BENCH_PIO_BYTES / res.secs / 1e6);
+        fflush(stdout);
+        for (size_t b = 0; b < sizeof(vring_batches) / sizeof(vring_batches[0]); b++)
+            bench_vring_run(vring_batches[b], vring_bytes, duration_ms);
+        return 0;
+    }
+
+    if (opts.dirty_log) {
+        printf("op\tdirty\tdelay\tsecs\tintervals\tguest_pages_per_ms\tdirty_pages\tkb\tms\tpages_per_ms\n");
+        for (size_t d = 0; d < sizeof(dirty_delays) / sizeof(dirty_delays[0]); d++) {
+            bench_dirty_run(0, dirty_delays[d], interval_ms, duration_ms);
+            bench_dirty_run(1, dirty_delays[d], interval_ms, duration_ms);
+        }
+        return 0;
+    }
+
+    if (bench_pauses > 0) {
+        printf("payload\tvcpus\tpauses\texits_per_sec\tpause_p50_us\tpause_p99_us\tpause_max_us\n");
+        for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+            if (only && strcmp(only, payloads[p].name) != 0)
+                continue;
+            for (int n = 1; n <= max_vcpus; n++) {
+                struct bench_result res;
+                bench_run(&payloads[p], n, duration_ms, &res);
+                printf("%s\t%d\t%d\t%.0f\t%.1f\t%.1f\t%.1f\n", payloads[p].name, n, bench_pauses, res.exits / res.secs,
+                       res.pause_p50_us, res.pause_p99_us, res.pause_max_us);
+                fflush(stdout);
+            }
+        }
+        return 0;
+    }
+
+    /*without -P every row runs unpinned, with it every row runs unpinned and then pinned*/
+    const char *pin_modes[] = { NULL, pin };
+    int nr_pin_modes = pin ? 2 : 1;
+
+    printf("payload\tpin\tvcpus\tsecs\texits\texits_per_sec\tops_per_sec\tp50_cycles\tp99_cycles\tscaling_eff\tfirst_exit_us\timage_us\tram\tsyscalls_per_exit\n");
+    for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++) {
+        if (only && strcmp(only, payloads[p].name) != 0)
+            continue;
+        for (int m = 0; m < nr_pin_modes; m++) {
+            double base_rate = 0;
+
+            opts.cpus = pin_modes[m];
+            for (int n = 1; n <= max_vcpus; n++) {
+                struct bench_result res;
+                bench_run(&payloads[p], n, duration_ms, &res);
+
+                double rate = res.ops / res.secs;
+                if (n == 1)
+                    base_rate = rate;
+                /*throughput on n vcpus compared with n times the single vcpu throughput*/
+                /*KVM_RUN plus the register ioctls around it*/
+                double syscalls = res.exits ? (double)(res.exits + res.reg_ioctls) / res.exits : 0.0;
+                printf("%s\t%s\t%d\t%.3f\t%lu\t%.0f\t%.0f\t%llu\t%llu\t%.3f\t%.0f\t%.1f\t%s\t%.3f\n", payloads[p].name,
+                       opts.cpus ? opts.cpus : "none", n, res.secs, res.exits, res.exits / res.secs, rate,
+                       (unsigned long long)res.p50, (unsigned long long)res.p99,
+                       base_rate > 0 ? rate / (n * base_rate) : 0.0, res.first_exit_us, res.image_us, res.backing, syscalls);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
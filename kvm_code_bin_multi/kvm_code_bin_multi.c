@@ -6,93 +6,119 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
-#include <pthread.h>
-#include <linux/kvm.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <err.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "kvm_code_bin_multi.h"
+#include "placement.h"
+
+/*account one value written by the guest to OUT_PORT, ring is the caller's own out ring*/
+static void kvm_out_value(struct kvm *kvm, struct out_ring *ring, __u16 port, __u8 size, __u32 data, int vcpu_id) {
+    atomic_fetch_add_explicit(&kvm->out_values, 1, memory_order_relaxed);
+    if (ring != NULL) { /*hand it to the writer thread, no stdio on the exit path*/
+        out_ring_push(ring, port, size, data, vcpu_id < 0 ? OUT_VCPU_NONE : vcpu_id);
+        return;
+    }
+    if (opts.quiet)
+        return;
+    if (vcpu_id < 0) /*coalesced entries do not record which vcpu wrote them*/
+        printf("out port: %d, data: %u (coalesced)\n", port, data);
+    else
+        printf("out port: %d, data: %u cpuid: %d\n", port, data, vcpu_id);
+}
 
-#define KVM_DEVICE "/dev/kvm"
-#define RAM_SIZE 0x100000
-#define CODE_START 0x1000
-#define BINARY_FILE "test.bin"
-#define NUM_VPCUS   4
-
-struct kvm {
-   int dev_fd;	/*device file descriptor*/
-   int vm_fd;   /*vm file descriptor*/
-   __u64 ram_size;  /*vm ram size*/
-   __u64 ram_start; /*vm ram start*/
-   int kvm_version; /*kvm version*/
-   struct kvm_userspace_memory_region mem; /*user memory region*/
-   struct vcpu *vcpus; /*vpcu struct pointer*/
-   int vcpu_number; /*number of vpcus*/
-};
-
-struct vcpu {
-    int vcpu_id; /*vpcu index*/
-    int vcpu_fd; /*vpcu file descriptor*/
-    pthread_t vcpu_thread; /*vpcu thread*/
-    struct kvm_run *kvm_run; /*kvm run struct per vpcu*/
-    int kvm_run_mmap_size; /*kvm run struct mmap size*/
-    struct kvm_regs regs; /*kvm regs struct*/
-    struct kvm_sregs sregs; /*kvm special regs struct*/
-    void *(*vcpu_thread_func)(void *); /*vpcu thread function*/
-};
-
-/*function to setup reset values for vcpu regs and special regs*/
-void kvm_reset_vcpu (struct vcpu *vcpu) {
-	if (ioctl(vcpu->vcpu_fd, KVM_GET_SREGS, &(vcpu->sregs)) < 0) {
-        /*get the kvm special regs for the vpcu*/
-		perror("can not get sregs\n");
-		exit(1);
-	}
-    /*setting up global descriptor table information for each segment*/
-    /*since it is a simple program pointing every one to same offset*/
-	vcpu->sregs.cs.selector = CODE_START;
-	vcpu->sregs.cs.base = CODE_START * 16;
-	vcpu->sregs.ss.selector = CODE_START;
-	vcpu->sregs.ss.base = CODE_START * 16;
-	vcpu->sregs.ds.selector = CODE_START;
-	vcpu->sregs.ds.base = CODE_START *16;
-	vcpu->sregs.es.selector = CODE_START;
-	vcpu->sregs.es.base = CODE_START * 16;
-	vcpu->sregs.fs.selector = CODE_START;
-	vcpu->sregs.fs.base = CODE_START * 16;
-	vcpu->sregs.gs.selector = CODE_START;
-
-	if (ioctl(vcpu->vcpu_fd, KVM_SET_SREGS, &vcpu->sregs) < 0) { /*set*/
-		perror("can not set sregs");
-		exit(1);
-	}
+/*device thread handler of OUT_PORT with -e: the guest wrote count values that never left the kernel*/
+static void kvm_out_event(struct ioevent *dev, int id, __u64 count, void *ctx) {
+    (void)id;
+    (void)ctx;
+    atomic_fetch_add_explicit(&dev->kvm->out_values, count, memory_order_relaxed);
+}
 
-	vcpu->regs.rflags = 0x0000000000000002ULL; /*necessary to run the VM in x86*/
-	vcpu->regs.rip = 0; /*instruction pointer starts from zero*/
-	vcpu->regs.rsp = 0xffffffff; /*stack pointer at 4GB*/
-	vcpu->regs.rbp= 0; /*base pointer at 0*/
+/*drain every pending entry of the coalesced pio ring, called on each exit and by the timer thread*/
+static void kvm_drain_coalesced(struct kvm *kvm, struct out_ring *out) {
+    struct kvm_coalesced_mmio_ring *ring = kvm->coalesced_ring;
+
+    if (ring == NULL)
+        return;
+
+    pthread_mutex_lock(&kvm->coalesced_lock);
+    /*kernel produces at last, we consume at first*/
+    __u32 first = ring->first;
+    __u32 last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+    while (first != last) {
+        struct kvm_coalesced_mmio *entry = &ring->coalesced_mmio[first];
+        __u32 data = 0;
+        memcpy(&data, entry->data, entry->len < sizeof(data) ? entry->len : sizeof(data));
+        /*uart stores and OUT_PORT writes share the ring, in the order the guest made them*/
+        if (entry->pio || !uart_mmio(&kvm->uart, entry->phys_addr, entry->data, entry->len, 1, 1))
+            kvm_out_value(kvm, out, entry->phys_addr, entry->len, data, -1);
+        first = (first + 1) % COALESCED_RING_MAX;
+    }
+    __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE); /*hand the slots back to the kernel in one go*/
+    pthread_mutex_unlock(&kvm->coalesced_lock);
+}
 
-	if (ioctl(vcpu->vcpu_fd, KVM_SET_REGS, &(vcpu->regs)) < 0) { /*set*/
-		perror("KVM SET REGS\n");
-		exit(1);
-	}
+/*idle mode: end of a wakeup latency sample, the guest acks every injected msi*/
+static void kvm_idle_ack(struct vcpu *vcpu) {
+    __u64 sent = atomic_exchange_explicit(&vcpu->msi_tsc, 0, memory_order_relaxed);
+
+    if (sent)
+        vcpu_hist_add(&vcpu->wake, __rdtsc() - sent);
 }
 
 void *kvm_cpu_thread(void *data) { /*per vpcu function*/
     struct vcpu *vcpu = (struct vcpu*)data;
+    struct kvm *kvm = vcpu->kvm;
 	int ret = 0;
-	kvm_reset_vcpu(vcpu); /*initialize vpcu regs*/
+	int halted = 0;
+	if (!opts.restore) { /*a restored vcpu already has its state*/
+		if (opts.long_mode)
+			kvm_reset_vcpu_long(vcpu); /*64 bit, paging on, through the tables of kvm_setup_long_mode()*/
+		else
+			kvm_reset_vcpu(vcpu); /*initialize vpcu regs*/
+	}
 
-	while (1) { /*starts the VM and loop to catch vmexit reasons and then resume the vm*/
-		printf("KVM start run\n");
+	while (!halted && !atomic_load_explicit(&kvm->stop, memory_order_relaxed)) { /*starts the VM and loop to catch vmexit reasons and then resume the vm*/
+		if (!opts.quiet)
+			printf("KVM start run\n");
+		__u64 run_tsc = vcpu_stats_run_begin(&vcpu->stats);
 		ret = ioctl(vcpu->vcpu_fd, KVM_RUN, 0); /*starts the vm*/
+		vcpu_stats_run_end(&vcpu->stats, run_tsc, ret, vcpu->kvm_run->exit_reason);
+		if (vcpu->flight.hdr)
+			flight_record(&vcpu->flight, run_tsc, vcpu->stats.last_exit_tsc, ret, vcpu->kvm_run);
+		if (atomic_load_explicit(&kvm->first_exit_ns, memory_order_relaxed) == 0)
+			kvm_note_first_exit(kvm);
 	
+		if (ret < 0 && errno == EINTR) { /*kicked for a pause or the end of the run, both flags are set before*/
+			vcpu->kvm_run->immediate_exit = 0;
+			kvm_pause_point(vcpu);
+			continue;
+		}
 		if (ret < 0) {
 			fprintf(stderr, "KVM_RUN failed\n");
 			exit(1);
 		}
 
+		/*whatever made us exit, older coalesced writes come before it*/
+		kvm_drain_coalesced(kvm, vcpu->ring);
+
+		if (vcpu->replay.mode == REPLAY_PLAY) { /*io and mmio come from the log, the devices are not run*/
+			int played = replay_play_exit(&vcpu->replay, vcpu->kvm_run);
+			if (played < 0) /*the log is through, this exit was never recorded*/
+				break;
+			if (played) {
+				kvm_pause_point(vcpu);
+				continue;
+			}
+		}
+
 		switch (vcpu->kvm_run->exit_reason) {
 		case KVM_EXIT_UNKNOWN:
 			printf("KVM_EXIT_UNKNOWN\n");
@@ -101,19 +127,39 @@ void *kvm_cpu_thread(void *data) { /*per vpcu function*/
 			printf("KVM_EXIT_DEBUG\n");
 			break;
 		case KVM_EXIT_IO: /*reason to exit when write to IO, we print in on stdout*/
-            printf("KVM_EXIT_IO\n");
-            printf("out port: %d, data: %d cpuid: %d\n", 
-				vcpu->kvm_run->io.port,  
-				*(int *)((char *)(vcpu->kvm_run) + vcpu->kvm_run->io.data_offset),
-				vcpu->vcpu_id);
-			sleep(1); /*sleep for a sec, who cares we are in vmexit :))*/
+		{
+			__u32 value = 0;
+			memcpy(&value, (char *)(vcpu->kvm_run) + vcpu->kvm_run->io.data_offset,
+				vcpu->kvm_run->io.size < sizeof(value) ? vcpu->kvm_run->io.size : sizeof(value));
+			if (!opts.quiet)
+				printf("KVM_EXIT_IO\n");
+			if (uart_pio(&kvm->uart, vcpu->kvm_run->io.port, (__u8 *)vcpu->kvm_run + vcpu->kvm_run->io.data_offset,
+				     vcpu->kvm_run->io.size, vcpu->kvm_run->io.direction == KVM_EXIT_IO_OUT))
+				break;
+			if (opts.idle_hz && vcpu->kvm_run->io.port == IDLE_ACK_PORT) { /*the msi woke the guest*/
+				kvm_idle_ack(vcpu);
+				break;
+			}
+			kvm_out_value(kvm, vcpu->ring, vcpu->kvm_run->io.port, vcpu->kvm_run->io.size, value, vcpu->vcpu_id);
 			break;
-		case KVM_EXIT_MMIO:
+		}
+		case KVM_EXIT_MMIO: /*a uart store with the coalesced ring full, or every one without it*/
+			if (uart_mmio(&kvm->uart, vcpu->kvm_run->mmio.phys_addr, vcpu->kvm_run->mmio.data, vcpu->kvm_run->mmio.len,
+				      vcpu->kvm_run->mmio.is_write, 0))
+				break;
 			printf("KVM_EXIT_MMIO\n");
 			break;
+		case KVM_EXIT_HLT: /*job mode: the vcpu is through its partition and has written its result*/
+			if (!kvm->job)
+				errx(1, "KVM_EXIT_HLT");
+			halted = 1;
+			break;
 		case KVM_EXIT_INTR:
 			printf("KVM_EXIT_INTR\n");
 			break;
+		case KVM_EXIT_DIRTY_RING_FULL: /*make room, the guest write is retried on the next KVM_RUN*/
+			dirty_ring_harvest(kvm, vcpu);
+			break;
 		case KVM_EXIT_SHUTDOWN:
 			printf("KVM_EXIT_SHUTDOWN\n");
 			break;
@@ -135,174 +181,474 @@ void *kvm_cpu_thread(void *data) { /*per vpcu function*/
         default:
             errx(1, "exit_reason = 0x%x", vcpu->kvm_run->exit_reason);
         }
+		if (vcpu->replay.mode == REPLAY_RECORD) /*reads carry what the device answered*/
+			replay_record_exit(&vcpu->replay, vcpu->kvm_run);
+		kvm_pause_point(vcpu); /*checkpoints and resets happen while every vcpu sits here*/
 	}
+	if (opts.snapshot)
+		snapshot_quiesce_vcpu(vcpu);
+	kvm_vcpu_done(vcpu);
 	return 0;
 }
 
-
-/*to load data from binary to a buffer*/
-void load_binary(struct kvm *kvm) {
-    int fd = open(BINARY_FILE, O_RDONLY); /*open the bin file*/
-
-    if (fd < 0) {
-        fprintf(stderr, "can not open binary file\n");
-        exit(1);
+/*idle mode summary: wakeups the guest counted, msi wakeup latency and the host cpu the idle vcpus cost*/
+static void kvm_idle_print(FILE *out, struct kvm *kvm, double secs, double cpu_secs) {
+    fprintf(out, "idle: pit %d Hz, halt poll %s%ld ns, host cpu %.3f s in %.2f s (%.1f%% of a cpu) for %d vcpus\n",
+            opts.idle_hz, opts.halt_poll_ns < 0 ? "default " : "", opts.halt_poll_ns < 0 ? 0 : opts.halt_poll_ns,
+            cpu_secs, secs, cpu_secs / secs * 100, kvm->vcpu_number);
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        struct idle_counters *c = (struct idle_counters *)((char *)kvm->ram_start + IDLE_COUNTERS + i * 64);
+        fprintf(out, "vcpu %d: %llu timer, %llu ipi, %llu msi wakeups\n", i, c->timer, c->ipi, c->msi);
+        vcpu_hist_text(out, "msi wakeup", &kvm->vcpus[i].wake);
     }
+}
 
-    int ret = 0;
-    char *p = (char *)kvm->ram_start; /*addr from where bin will be kept*/
+/*timer thread: drains the coalesced ring even when no vcpu exits and ends the run after opts.run_secs*/
+void *kvm_timer_thread(void *data) {
+    struct kvm *kvm = (struct kvm *)data;
+    struct timespec start, now;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = DRAIN_INTERVAL_MS * 1000000L };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long tick = 0; !atomic_load(&kvm->stop); tick++) {
+        nanosleep(&interval, NULL);
+        kvm_drain_coalesced(kvm, kvm->timer_ring);
+        if (opts.idle_hz) /*wake one halted vcpu after the other from the host*/
+            kvm_inject_msi(&kvm->vcpus[tick % kvm->vcpu_number], IDLE_VECTOR_MSI);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (opts.run_secs > 0 && (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) >= opts.run_secs * 1000000000L) {
+            atomic_store(&kvm->stop, 1);
+            if (opts.irqchip) /*the guest no longer exits on its own or halts in the kernel*/
+                kvm_kick_vcpus(kvm);
+        }
+    }
+    return NULL;
+}
 
-    while(1) {
-        ret = read(fd, p, 4096); /*read upto 4096 bytes*/
-        if (ret <= 0) {
-            break;
+/*sampler thread: reads the kernel stats fds every opts.kstats_ms, the vcpu threads are never touched*/
+void *kvm_kstats_thread(void *data) {
+    struct kvm *kvm = (struct kvm *)data;
+    struct timespec interval = { .tv_sec = opts.kstats_ms / 1000, .tv_nsec = (opts.kstats_ms % 1000) * 1000000L };
+
+    while (!atomic_load(&kvm->stop)) {
+        nanosleep(&interval, NULL);
+        if (kvm_stats_sample(&kvm->kstats) == 0)
+            kvm_stats_print(stderr, &kvm->kstats, 1);
+        for (int i = 0; i < kvm->vcpu_number; i++) {
+            if (kvm_stats_sample(&kvm->vcpus[i].kstats) == 0)
+                kvm_stats_print(stderr, &kvm->vcpus[i].kstats, 1);
         }
-        printf("read size: %d\n", ret);
-        p += ret; /*move pointer ahead of last offset upto which data is written*/
     }
+    return NULL;
 }
 
-/*utility function to initialize and open kvm device*/
-struct kvm *kvm_init(void) {
-    struct kvm *kvm = malloc(sizeof(struct kvm)); /*allocate mem for kvm struct*/
-    kvm->dev_fd = open(KVM_DEVICE, O_RDWR); /*open kvm device and store the file descriptor*/
+/*checkpoint thread: every opts.checkpoint_ms writes the pages dirtied since the last checkpoint
+ *to opts.snapshot, or every opts.reset_ms puts the vm back to the opts.restore baseline*/
+void *kvm_checkpoint_thread(void *data) {
+    struct kvm *kvm = (struct kvm *)data;
+    int ms = opts.checkpoint_ms ? opts.checkpoint_ms : opts.reset_ms;
+    struct timespec interval = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    struct snapshot_baseline base;
+    const char *what = opts.checkpoint_ms ? "checkpoint" : "reset";
+    unsigned long nr = 0, total_pages = 0;
+    double total_ms = 0;
+
+    kvm_pause(kvm);
+    if (opts.checkpoint_ms ? snapshot_save(kvm, opts.snapshot) : snapshot_baseline_open(&base, opts.restore)) {
+        fprintf(stderr, "%s setup fault\n", what);
+        exit(1);
+    }
+    if (opts.reset_ms) { /*the pages written since the restore count for the first reset*/
+        if (dirty_log_sync(kvm) < 0)
+            exit(1);
+    }
+    kvm_resume(kvm);
+
+    while (!atomic_load(&kvm->stop)) {
+        struct timespec t0, t1;
+
+        nanosleep(&interval, NULL);
+        kvm_pause(kvm);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long pages = opts.checkpoint_ms ? snapshot_checkpoint(kvm, opts.snapshot) : snapshot_reset(kvm, &base);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        kvm_resume(kvm);
+        if (pages < 0) {
+            fprintf(stderr, "%s fault\n", what);
+            exit(1);
+        }
 
-    if (kvm->dev_fd < 0) {
-        perror("open kvm device fault: ");
-        return NULL;
+        double took = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        nr++;
+        total_pages += pages;
+        total_ms += took;
+        if (!opts.quiet)
+            printf("%s %lu: %ld pages, %ld KB in %.3f ms\n", what, nr, pages, pages * (DIRTY_PAGE_SIZE / 1024), took);
     }
 
-    kvm->kvm_version = ioctl(kvm->dev_fd, KVM_GET_API_VERSION, 0); /*get the KVM API version should be 12*/
+    if (opts.reset_ms)
+        snapshot_baseline_close(&base);
+    if (nr)
+        printf("%s: %lu in %.2f ms, %.1f pages (%.0f KB) and %.3f ms each, %.0f pages/ms\n", what, nr, total_ms,
+               (double)total_pages / nr, (double)total_pages / nr * (DIRTY_PAGE_SIZE / 1024), total_ms / nr,
+               total_ms > 0 ? total_pages / total_ms : 0.0);
+    return NULL;
+}
+
+/*register OUT_PORT as a coalesced pio zone, guest writes then land in a ring instead of exiting*/
+int kvm_setup_coalesced_pio(struct kvm *kvm) {
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = OUT_PORT,
+        .size = 2, /*test.S writes %ax*/
+        .pio = 1,
+    };
 
-    return kvm;
+    if (kvm_coalesced_ring(kvm) == NULL || ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0) {
+        fprintf(stderr, "coalesced pio not supported by this kernel\n");
+        return -1;
+    }
+
+    if (ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+        perror("can not register coalesced pio zone");
+        return -1;
+    }
+    return 0;
 }
 
-/*utility function to clean up the allocated mem for kvm struct and close the fd*/
-void kvm_clean(struct kvm *kvm) {
-    assert (kvm != NULL);
-    close(kvm->dev_fd);
-    free(kvm);
+/*wire OUT_PORT to an ioeventfd serviced by the device thread, guest writes no longer exit*/
+int kvm_setup_ioeventfd(struct kvm *kvm) {
+    if (ioevent_init(&kvm->dev, kvm) < 0)
+        return -1;
+    if (ioevent_add_port(&kvm->dev, OUT_PORT, 2, kvm_out_event, NULL) < 0) /*test.S writes %ax*/
+        return -1;
+    return ioevent_start(&kvm->dev);
 }
 
-/*function to create vm*/
-int kvm_create_vm(struct kvm *kvm, int ram_size) {
-    int ret = 0;
-    kvm->vm_fd = ioctl(kvm->dev_fd, KVM_CREATE_VM, 0); /*create VM*/
+/*function to run each vcpu of the vm per thread, end is when the last vcpu thread is through:
+ *the helper threads may still be sleeping out their interval then*/
+void kvm_run_vm(struct kvm *kvm, struct timespec *end) {
+    int i = 0;
+    pthread_t timer_thread, kstats_thread, checkpoint_thread;
 
-    if (kvm->vm_fd < 0) {
-        perror("can not create vm");
-        return -1;
+    if (pthread_create(&timer_thread, NULL, kvm_timer_thread, kvm) != 0) {
+        perror("can not create timer thread");
+        exit(1);
     }
 
-    kvm->ram_size = ram_size;
-    /* Allocate mem (aligned to page) of guest memory to hold the code. it is not backed by any file/fd stating from offset 0*/
-    kvm->ram_start =  (__u64)mmap(NULL, kvm->ram_size, 
-                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
-                -1, 0);
+    if (opts.kstats_ms && pthread_create(&kstats_thread, NULL, kvm_kstats_thread, kvm) != 0) {
+        perror("can not create kernel stats thread");
+        exit(1);
+    }
 
-    if ((void *)kvm->ram_start == MAP_FAILED) {
-        perror("can not mmap ram");
-        return -1;
+    for (i = 0; i < kvm->vcpu_number; i++) { /*pthread_create create thread within process and calls kvm_cpu_thread function*/
+        if (kvm_start_vcpu(&kvm->vcpus[i]) < 0)
+            exit(1);
+    }
+
+    if ((opts.checkpoint_ms || opts.reset_ms) &&
+        pthread_create(&checkpoint_thread, NULL, kvm_checkpoint_thread, kvm) != 0) {
+        perror("can not create checkpoint thread");
+        exit(1);
+    }
+
+    for (i = 0; i < kvm->vcpu_number; i++) 
+    {
+        pthread_join(kvm->vcpus[i].vcpu_thread, NULL);
     }
-    
-    kvm->mem.slot = 0; /*provides an integer index identifying each region of memory we hand to KVM; calling KVM_SET_USER_MEMORY_REGION again with the same slot will replace this mapping*/
-    kvm->mem.guest_phys_addr = 0; /*specifies the base "physical" address as seen from the guest*/
-    kvm->mem.memory_size = kvm->ram_size; 
-    kvm->mem.userspace_addr = kvm->ram_start; /*points to the backing memory in our process that we allocated with mmap()*/
+    clock_gettime(CLOCK_MONOTONIC, end);
+    atomic_store(&kvm->stop, 1);
+    pthread_join(timer_thread, NULL);
+    if (opts.kstats_ms)
+        pthread_join(kstats_thread, NULL);
+    if (opts.checkpoint_ms || opts.reset_ms)
+        pthread_join(checkpoint_thread, NULL);
+    kvm_drain_coalesced(kvm, kvm->timer_ring); /*pick up whatever the last exits left behind*/
+}
 
-    ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &(kvm->mem)); /*set the region*/
+/*give every vcpu its own out ring and start the writer thread on opts.out_log*/
+int kvm_setup_out_log(struct kvm *kvm) {
+    /*one ring per vcpu plus one for the timer thread, each ring has exactly one producer*/
+    struct out_ring **rings = calloc(kvm->vcpu_number + 1, sizeof(struct out_ring *));
 
-    if (ret < 0) {
-        perror("can not set user memory region");
-        return ret;
+    if (rings == NULL) {
+        perror("can not allocate out rings");
+        return -1;
     }
 
-    return ret;
+    for (int i = 0; i <= kvm->vcpu_number; i++) {
+        rings[i] = out_ring_alloc();
+        if (rings[i] == NULL)
+            return -1;
+        if (i < kvm->vcpu_number)
+            kvm->vcpus[i].ring = rings[i];
+        else
+            kvm->timer_ring = rings[i];
+    }
+
+    return out_writer_start(&kvm->writer, opts.out_log, rings, kvm->vcpu_number + 1);
 }
 
-/*function to close vm fd and unmap ram data*/
-void kvm_clean_vm(struct kvm *kvm) {
-    close(kvm->vm_fd);
-    munmap((void *)kvm->ram_start, kvm->ram_size);
+/*stop the writer after the last producer is gone and release the rings*/
+void kvm_clean_out_log(struct kvm *kvm) {
+    struct out_ring **rings = kvm->writer.rings;
+
+    out_writer_stop(&kvm->writer);
+    for (int i = 0; i <= kvm->vcpu_number; i++)
+        out_ring_free(rings[i]);
+    free(rings);
 }
 
-/*function to create vpcu*/
-int kvm_init_vcpu(struct kvm *kvm, struct vcpu* vcpu, int vcpu_id, void *(*fn)(void *)) {
-    vcpu->vcpu_id = vcpu_id;
-    vcpu->vcpu_fd = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, vcpu->vcpu_id); /*create vpcu*/
+/*-M: opts.nr_vms vms of one vcpu each running bench_mixed.bin or the -f image, all in this process on one /dev/kvm fd*/
+int kvm_run_host(void) {
+    struct vm_host host;
+    double secs;
 
-    if (vcpu->vcpu_fd < 0) {
-        perror("can not create vcpu");
+    if (vm_host_init(&host, opts.nr_vms, opts.nr_vms, 0) < 0)
         return -1;
+    host.counters = opts.image == NULL;
+    for (int i = 0; i < opts.nr_vms; i++) {
+        if (vm_host_add(&host, opts.image ? opts.image : VM_HOST_FILE, opts.ram_mb ? (__u64)opts.ram_mb << 20 : RAM_SIZE, 1) < 0) {
+            fprintf(stderr, "vm host: can not create vm %d\n", i);
+            return -1;
+        }
     }
+    if (vm_host_run(&host, (opts.run_secs ? opts.run_secs : 1) * 1000, &secs) < 0)
+        return -1;
+    vm_host_print(stdout, &host, secs);
+    vm_host_destroy(&host);
+    return 0;
+}
 
-    vcpu->kvm_run_mmap_size = ioctl(kvm->dev_fd, KVM_GET_VCPU_MMAP_SIZE, 0); /*get the mem size for vpcu*/
+/*the guest to load when -i gave none: -U, -I and -J bring their own, -L the 64 bit test*/
+static const char *default_image(void) {
+    if (opts.uart == UART_PIO)
+        return UART_PIO_FILE;
+    if (opts.uart)
+        return UART_FILE;
+    if (opts.idle_hz)
+        return IDLE_FILE;
+    if (opts.job_mb)
+        return SMP_JOB_FILE;
+    if (opts.long_mode)
+        return BINARY_FILE64;
+    return BINARY_FILE;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c] [-q] [-t secs] [-o file] [-j file] [-k ms] [-p cpus] [-m policy] [-b backing] [-r MB] [-i mode] [-S file] [-R file]\n"
+            "          [-D bitmap|ring] [-C ms] [-B ms] [-l pages] [-e] [-M vms] [-L 2M|1G] [-f image] [-n vcpus] [-J MB]\n"
+            "          [-I hz] [-H ns] [-U ring|mmio|pio] [-F dir] [-X record:dir|replay:dir]\n"
+            "  -c       coalesce port 0x%x writes in the kernel ring (KVM_CAP_COALESCED_PIO)\n"
+            "  -q       quiet, do not print every exit and value\n"
+            "  -t secs  stop after secs seconds and report values/sec\n"
+            "  -o file  log values as binary records through per vcpu rings and a writer thread\n"
+            "  -j file  also write the vcpu exit stats as json to file (SIGUSR1 and end of run)\n"
+            "  -k ms    sample the kernel vm/vcpu stats fds every ms and print what changed\n"
+            "  -p cpus  pin vcpu threads, \"auto\" for topology order or a cpu list like 0-3,8\n"
+            "  -m pol   guest ram numa policy: interleave, bind:N, preferred:N or local\n"
+            "  -b back  guest ram backing: anon, thp, hugetlb[:2M|:1G], memfd, memfd-hugetlb[:2M|:1G]\n"
+            "  -r MB    guest ram size in MB (default 1)\n"
+            "  -i mode  image loading: copy (read into ram), map (mmap MAP_PRIVATE into its own memslot)\n"
+            "           or ro (same, KVM_MEM_READONLY)\n"
+            "  -S file  write a snapshot of ram and vcpu state to file when the run ends (-t)\n"
+            "  -R file  restore from a snapshot file instead of loading test.bin\n"
+            "  -D mode  track guest writes with the memslot dirty bitmap or the per vcpu dirty ring\n"
+            "  -C ms    incremental checkpoint into the -S file every ms, only dirty pages are written (needs -D)\n"
+            "  -B ms    reset to the -R snapshot every ms, only dirty pages are copied back (needs -D)\n"
+            "  -l pages demand page guest ram with userfaultfd from test.bin or the -R snapshot,\n"
+            "           sequential faults prefetch up to pages pages\n"
+            "  -e       in kernel irqchip, port 0x%x through KVM_IOEVENTFD and an epoll device thread,\n"
+            "           writes are counted without a vcpu exit (the values themselves are not seen)\n"
+            "  -M vms   run vms single vcpu vms of %s (or -f) in this process, at most one running vcpu\n"
+            "           per host cpu, for -t secs (default 1), only -r, -b, -m and -i apply to them\n"
+            "  -L size  boot the vcpus straight into 64 bit long mode running test64.bin, guest ram\n"
+            "           (at least the low 4GB) identity mapped with 2M or 1G pages\n"
+            "  -f image guest image instead of test.bin: a flat binary loaded at 0x%x or an elf file,\n"
+            "           its segments go to their physical addresses and it starts at its entry point\n"
+            "  -n vcpus number of vcpus (default %d)\n"
+            "  -J MB    smp job: every vcpu sums its own partition of MB of guest ram in long mode (job64.bin),\n"
+            "           writes the result to its own cache line and halts, the host checks the checksum\n"
+            "  -I hz    idle mode: in kernel irqchip and pit, the vcpus halt in idle64.bin until the pit at hz\n"
+            "           (vcpu 0, passed on as ipis) or an msi the host injects every %d ms wakes them\n"
+            "  -H ns    halt polling window of the vm (KVM_CAP_HALT_POLL), 0 sleeps right away\n"
+            "  -U mode  uart console: the vcpus run print_uart0() in long mode and the host reports bytes/sec,\n"
+            "           ring stores to the mmio register at 0x%x through a coalesced mmio zone, mmio takes an\n"
+            "           exit per byte, pio an exit per out to port 0x%x (%s)\n"
+            "  -F dir   flight recorder: the last %d exits of every vcpu go to dir/vcpu<id>.flight (mmap),\n"
+            "           synced on SIGUSR1 and fatal signals, read them with kvm_flight\n"
+            "  -X mode  record:dir logs every io/mmio exit of a vcpu to dir/vcpu<id>.replay, replay:dir runs\n"
+            "           the vcpus against such a log instead of the devices (reads get the recorded values)\n"
+            "           and stops each vcpu at the end of its log\n", prog, OUT_PORT, OUT_PORT, VM_HOST_FILE, IMAGE_START, NUM_VPCUS,
+            DRAIN_INTERVAL_MS, UART_MMIO_BASE, UART_PIO_PORT, UART_PIO_FILE, FLIGHT_EVENTS);
+}
+
+int main(int argc, char **argv) {
+    int ret = 0;
+    int opt;
+    int image_mode = 0; /*-i given*/
+    struct timespec start, end;
+
+    while ((opt = getopt(argc, argv, "cqt:o:j:k:p:m:b:r:i:S:R:D:C:B:l:eM:L:f:n:J:I:H:U:F:X:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            opts.coalesced_pio = 1;
+            break;
+        case 'q':
+            opts.quiet = 1;
+            break;
+        case 't':
+            opts.run_secs = atoi(optarg);
+            break;
+        case 'o':
+            opts.out_log = optarg;
+            opts.quiet = 1; /*values go to the log, keep stdout off the exit path*/
+            break;
+        case 'j':
+            opts.stats_json = optarg;
+            break;
+        case 'k':
+            opts.kstats_ms = atoi(optarg);
+            break;
+        case 'p':
+            opts.cpus = optarg;
+            break;
+        case 'm':
+            opts.mem_policy = optarg;
+            break;
+        case 'b':
+            opts.ram_backing = optarg;
+            break;
+        case 'r':
+            opts.ram_mb = atoi(optarg);
+            break;
+        case 'i':
+            if ((opts.image_map = kvm_image_mode(optarg)) < 0)
+                return -1;
+            image_mode = 1;
+            break;
+        case 'S':
+            opts.snapshot = optarg;
+            break;
+        case 'R':
+            opts.restore = optarg;
+            break;
+        case 'D':
+            if ((opts.dirty_log = dirty_mode(optarg)) < 0)
+                return -1;
+            break;
+        case 'C':
+            opts.checkpoint_ms = atoi(optarg);
+            break;
+        case 'B':
+            opts.reset_ms = atoi(optarg);
+            break;
+        case 'l':
+            opts.lazy_window = atoi(optarg);
+            break;
+        case 'e':
+            opts.irqchip = 1;
+            opts.ioeventfd = 1;
+            break;
+        case 'M':
+            opts.nr_vms = atoi(optarg);
+            break;
+        case 'n':
+            opts.nr_vcpus = atoi(optarg);
+            break;
+        case 'J':
+            opts.job_mb = atoi(optarg);
+            break;
+        case 'I':
+            opts.idle_hz = atoi(optarg);
+            opts.irqchip = 1;
+            opts.pit = 1;
+            break;
+        case 'H':
+            opts.halt_poll_ns = atol(optarg);
+            break;
+        case 'f':
+            opts.image = optarg;
+            break;
+        case 'U':
+            if ((opts.uart = uart_mode(optarg)) < 0)
+                return -1;
+            break;
+        case 'F':
+            opts.flight_dir = optarg;
+            break;
+        case 'X':
+            if ((opts.replay = replay_mode(optarg, &opts.replay_dir)) < 0)
+                return -1;
+            break;
+        case 'L':
+            if ((opts.long_mode = kvm_long_mode(optarg)) == 0)
+                return -1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
 
-    if (vcpu->kvm_run_mmap_size < 0) {
-        perror("can not get vcpu mmsize");
+    if ((opts.checkpoint_ms && (!opts.snapshot || !opts.dirty_log)) ||
+        (opts.reset_ms && (!opts.restore || !opts.dirty_log)) || (opts.checkpoint_ms && opts.reset_ms)) {
+        fprintf(stderr, "-C needs -S and -D, -B needs -R and -D, not both\n");
         return -1;
     }
 
-    // printf("%d\n", vcpu->kvm_run_mmap_size);
-    /*map the struct kvm_run into vcpufd starting from offset 0 upto mmap_size, so it is sahred between vcpu and we also see the same thing*/
-    vcpu->kvm_run = mmap(NULL, vcpu->kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd, 0);
+    if (opts.mem_policy && placement_check_policy(opts.mem_policy) < 0)
+        return -1;
 
-    if (vcpu->kvm_run == MAP_FAILED) {
-        perror("can not mmap kvm_run");
+    if (opts.lazy_window && image_mode) {
+        fprintf(stderr, "-l does not go with -i, the fault handler reads the image in\n");
         return -1;
     }
 
-    vcpu->vcpu_thread_func = fn;
-    return 0;
-}
+    if (opts.ioeventfd && opts.coalesced_pio) {
+        fprintf(stderr, "-e does not go with -c, both want port 0x%x\n", OUT_PORT);
+        return -1;
+    }
 
-/*function to create vpcus*/
-struct vcpu* kvm_create_vpcus(struct kvm* kvm, int num_vcpus, void *(*fn)(void *))
-{
-    struct vcpu *vcpus = malloc(num_vcpus * sizeof(struct vcpu));
-    if(vcpus == NULL){
-        printf("failed to allocate mem for vpcus\n");
-        return NULL;
+    if (opts.job_mb && (opts.restore || opts.nr_vms || opts.ioeventfd || opts.checkpoint_ms || opts.reset_ms)) {
+        fprintf(stderr, "-J does not go with -R, -M, -e, -C or -B, the vcpus have to halt into userspace\n");
+        return -1;
     }
-    for(int vcpu_id = 0; vcpu_id < num_vcpus; vcpu_id++)
-    {
-        if(kvm_init_vcpu(kvm, &vcpus[vcpu_id], vcpu_id, fn) < 0){
-            printf("failed to init vpcu %d\n", vcpu_id);
-            return NULL;
-        }
+    if (opts.idle_hz && (opts.restore || opts.nr_vms || opts.job_mb)) {
+        fprintf(stderr, "-I does not go with -R, -M or -J, it brings its own guest\n");
+        return -1;
     }
-    return vcpus;
-}
-
-/*function to unmap kvm_run to vcpu mem and close vcpu fd*/
-void kvm_clean_vcpus(struct vcpu *vcpu, int num_vcpus) {
-    for(int id=0;id<num_vcpus;id++)
-    {
-        munmap(vcpu[id].kvm_run, vcpu[id].kvm_run_mmap_size);
-        close(vcpu[id].vcpu_fd);
+    if (opts.uart && (opts.restore || opts.nr_vms || opts.job_mb || opts.idle_hz)) {
+        fprintf(stderr, "-U does not go with -R, -M, -J or -I, it brings its own guest\n");
+        return -1;
+    }
+    if ((opts.job_mb || opts.idle_hz || opts.uart) && !opts.long_mode)
+        opts.long_mode = 2ULL << 20;
+    if (opts.nr_vcpus < 0 || opts.nr_vcpus > 64) {
+        fprintf(stderr, "-n takes 1 to 64 vcpus\n");
+        return -1;
     }
-    free(vcpu);
-}
 
-/*function to run each vcpu of the vm per thread*/
-void kvm_run_vm(struct kvm *kvm) {
-    int i = 0;
+    if ((opts.long_mode || opts.flight_dir || opts.replay) && opts.nr_vms) {
+        fprintf(stderr, "-L, -F and -X do not go with -M\n");
+        return -1;
+    }
 
-    for (i = 0; i < kvm->vcpu_number; i++) { /*pthread_create create thread within process and calls kvm_cpu_thread function*/
-        if (pthread_create(&(kvm->vcpus[i].vcpu_thread), (const pthread_attr_t *)NULL, kvm->vcpus[i].vcpu_thread_func, (void*)&kvm->vcpus[i]) != 0) {
-            perror("can not create kvm thread");
-            exit(1);
-        }
+    if (opts.nr_vms > 0) {
+        opts.quiet = 1;
+        return kvm_run_host();
     }
 
-    for (i = 0; i < kvm->vcpu_number; i++) 
-    {
-        pthread_join(kvm->vcpus[i].vcpu_thread, NULL);
+    if (opts.restore) { /*a snapshot taken with the in kernel irqchip restores into a vm that has one*/
+        int flags = snapshot_flags(opts.restore);
+        if (flags < 0)
+            return -1;
+        if (flags & SNAPSHOT_IRQCHIP)
+            opts.irqchip = 1;
+        if (flags & SNAPSHOT_PIT)
+            opts.pit = 1;
     }
-}
 
-int main(void) {
-    int ret = 0;
+    vcpu_stats_block_signals(); /*before any thread exists so SIGUSR1 only reaches the dumper*/
     struct kvm *kvm = kvm_init();
 
     if (kvm == NULL) {
@@ -310,19 +656,176 @@ int main(void) {
         return -1;
     }
 
-    if (kvm_create_vm(kvm, RAM_SIZE) < 0) {
+    __u64 ram_size = opts.ram_mb ? (__u64)opts.ram_mb << 20 : RAM_SIZE;
+    if (opts.job_mb && ram_size < SMP_JOB_BUF + ((__u64)(opts.job_mb + 1) << 20)) /*the buffer from 1MB and a MB of stacks*/
+        ram_size = SMP_JOB_BUF + ((__u64)(opts.job_mb + 1) << 20);
+    if (kvm_create_vm(kvm, ram_size) < 0) {
         fprintf(stderr, "create vm fault\n");
         return -1;
     }
 
-    load_binary(kvm);
+    if (!opts.restore && kvm_load_image(kvm, opts.image ? opts.image : default_image()) < 0) {
+        fprintf(stderr, "load image fault\n");
+        return -1;
+    }
 
-    // only support one vcpu now
-    kvm->vcpu_number = NUM_VPCUS;
+    /*a snapshot already holds the tables in ram and long mode in its sregs*/
+    if (opts.long_mode && !opts.restore && kvm_setup_long_mode(kvm, opts.long_mode) < 0) {
+        fprintf(stderr, "long mode setup fault\n");
+        return -1;
+    }
+
+    if (opts.idle_hz && kvm_set_pit_hz(kvm, opts.idle_hz) < 0) {
+        fprintf(stderr, "pit setup fault\n");
+        return -1;
+    }
+
+    // -n vcpus, NUM_VPCUS when not given
+    kvm->vcpu_number = opts.nr_vcpus ? opts.nr_vcpus : NUM_VPCUS;
+    struct smp_job job;
+    if (opts.job_mb) { /*before the vcpus start, their reset registers come from it*/
+        if (smp_job_init(&job, kvm, (__u64)opts.job_mb << 20, kvm->vcpu_number) < 0) {
+            fprintf(stderr, "job setup fault\n");
+            return -1;
+        }
+        kvm->job = &job;
+    }
     kvm->vcpus = kvm_create_vpcus(kvm, kvm->vcpu_number, kvm_cpu_thread);
+    if (kvm->vcpus == NULL) {
+        fprintf(stderr, "create vcpus fault\n");
+        return -1;
+    }
+
+    if (opts.restore) {
+        if (snapshot_restore_vcpus(kvm, opts.restore) < 0) {
+            fprintf(stderr, "restore fault\n");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("restored %s: %llu MB, %d vcpus in %.3f ms\n", opts.restore, kvm->ram_size >> 20, kvm->vcpu_number,
+               ((end.tv_sec - kvm->created.tv_sec) * 1000000000L + (end.tv_nsec - kvm->created.tv_nsec)) / 1e6);
+    }
 
-    kvm_run_vm(kvm);
+    if (opts.coalesced_pio && kvm_setup_coalesced_pio(kvm) < 0) {
+        fprintf(stderr, "coalesced pio setup fault\n");
+        return -1;
+    }
+
+    if (opts.uart && uart_init(&kvm->uart, kvm, opts.uart, opts.quiet ? NULL : stdout) < 0) {
+        fprintf(stderr, "uart setup fault\n");
+        return -1;
+    }
+
+    if (opts.ioeventfd && kvm_setup_ioeventfd(kvm) < 0) {
+        fprintf(stderr, "ioeventfd setup fault\n");
+        return -1;
+    }
+
+    if (opts.flight_dir) {
+        for (int i = 0; i < kvm->vcpu_number; i++) {
+            if (flight_open(&kvm->vcpus[i].flight, opts.flight_dir, i, vcpu_stats_tsc_per_us()) < 0) {
+                fprintf(stderr, "flight recorder setup fault\n");
+                return -1;
+            }
+        }
+        flight_crash_handlers();
+    }
+
+    for (int i = 0; opts.replay && i < kvm->vcpu_number; i++) {
+        if (replay_open(&kvm->vcpus[i].replay, opts.replay, opts.replay_dir, i) < 0) {
+            fprintf(stderr, "replay setup fault\n");
+            return -1;
+        }
+    }
+
+    struct vcpu_stats *stats[kvm->vcpu_number];
+    struct vcpu_stats_report report = {
+        .name = "kvm_code_bin_multi",
+        .stats = stats,
+        .nr = kvm->vcpu_number,
+        .json_path = opts.stats_json,
+        .on_dump = opts.flight_dir ? flight_sync_all : NULL, /*SIGUSR1 leaves readable flight files*/
+    };
+    for (int i = 0; i < kvm->vcpu_number; i++)
+        stats[i] = &kvm->vcpus[i].stats;
+    vcpu_stats_start_dumper(&report);
+
+    if (opts.out_log && kvm_setup_out_log(kvm) < 0) {
+        fprintf(stderr, "out log setup fault\n");
+        return -1;
+    }
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    kvm_run_vm(kvm, &end);
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    if (opts.out_log)
+        kvm_clean_out_log(kvm);
+    if (opts.ioeventfd) /*every write the vcpus made is counted once the device thread is gone*/
+        ioevent_stop(&kvm->dev);
+
+    if (opts.snapshot) {
+        struct timespec snap_start, snap_end;
+        clock_gettime(CLOCK_MONOTONIC, &snap_start);
+        /*with checkpoints running the file only needs the last dirty pages*/
+        if ((opts.checkpoint_ms ? snapshot_checkpoint(kvm, opts.snapshot) : snapshot_save(kvm, opts.snapshot)) < 0) {
+            fprintf(stderr, "snapshot fault\n");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &snap_end);
+        printf("snapshot %s: %llu MB, %d vcpus in %.3f ms\n", opts.snapshot, kvm->ram_size >> 20, kvm->vcpu_number,
+               ((snap_end.tv_sec - snap_start.tv_sec) * 1000000000L + (snap_end.tv_nsec - snap_start.tv_nsec)) / 1e6);
+    }
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (kvm->job) { /*every vcpu has halted, the results are in guest ram*/
+        if (smp_job_collect(kvm->job, kvm) < 0)
+            ret = -1;
+        smp_job_print(stdout, kvm->job, secs);
+    }
+    if (opts.uart)
+        uart_print(stdout, &kvm->uart, secs);
+    for (int i = 0; opts.replay && i < kvm->vcpu_number; i++) {
+        replay_print(stdout, &kvm->vcpus[i].replay, secs);
+        if (replay_close(&kvm->vcpus[i].replay) < 0)
+            ret = -1;
+    }
+    unsigned long values = atomic_load(&kvm->out_values);
+    printf("%s: %lu values in %.2f s, %.0f values/sec\n",
+           opts.coalesced_pio ? "coalesced pio" : opts.ioeventfd ? "ioeventfd" : "exit per write", values, secs, values / secs);
+    printf("ram: %llu MB %s%s, image: %s in %.3f ms, time to first exit: %.3f ms\n", kvm->ram_size >> 20,
+           kvm->ram.backing, opts.long_mode == (1ULL << 30) ? ", long mode 1G pages" : opts.long_mode ? ", long mode 2M pages" : "", kvm->elf.segments ? "elf" : kvm->image ? "mapped" : opts.restore ? "from snapshot" : opts.lazy_window ? "demand paged" : "copied", kvm->image_load_ns / 1e6,
+           atomic_load(&kvm->first_exit_ns) / 1e6);
+    fflush(stdout);
+    vcpu_stats_dump(&report);
+    if (kvm->lazy.uffd >= 0)
+        lazy_mem_print(stderr, &kvm->lazy);
+    if (kvm->elf.segments)
+        elf_print(stderr, &kvm->elf);
+    if (kvm->pause_hist.count) /*checkpoints and resets: request to every vcpu parked*/
+        vcpu_hist_text(stderr, "pause latency", &kvm->pause_hist);
+    if (opts.idle_hz) {
+        double cpu_secs = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                          (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1e6 +
+                          (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                          (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+        kvm_idle_print(stderr, kvm, secs, cpu_secs);
+    }
+    if (opts.ioeventfd)
+        ioevent_print(stderr, &kvm->dev);
+    if (opts.kstats_ms) { /*final kernel side totals next to our own counters*/
+        kvm_stats_sample(&kvm->kstats);
+        kvm_stats_print(stderr, &kvm->kstats, 0);
+        for (int i = 0; i < kvm->vcpu_number; i++) {
+            kvm_stats_sample(&kvm->vcpus[i].kstats);
+            kvm_stats_print(stderr, &kvm->vcpus[i].kstats, 0);
+        }
+    }
 
+    for (int i = 0; i < kvm->vcpu_number; i++)
+        flight_close(&kvm->vcpus[i].flight);
     kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
     kvm_clean_vm(kvm);
     kvm_clean(kvm);
@@ -0,0 +1,219 @@
+/*
+ * KVM x86 VM multicore, shared definitions.
+ * author: rkroshan 
+ */
+
+#ifndef KVM_CODE_BIN_MULTI_H
+#define KVM_CODE_BIN_MULTI_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <linux/kvm.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "out_ring.h"
+#include "vcpu_stats.h"
+#include "kvm_stats.h"
+#include "guest_ram.h"
+#include "snapshot.h"
+#include "dirty.h"
+#include "lazy_mem.h"
+#include "ioevent.h"
+#include "vm_host.h"
+#include "elf_image.h"
+#include "smp_job.h"
+#include "uart.h"
+#include "flight.h"
+#include "replay.h"
+
+#define KVM_DEVICE "/dev/kvm"
+#define RAM_SIZE 0x100000
+#define CODE_START 0x1000
+#define IMAGE_START (CODE_START * 16) /*guest physical address of the image, segment bases point here, the Makefile links at it*/
+#define BINARY_FILE "test.bin"
+#define BINARY_FILE64 "test64.bin" /*image of the long mode boot path*/
+#define NUM_VPCUS   4
+#define VCPU_ALIGN  4096 /*struct vcpu alignment, one page each so it can be placed on its own numa node*/
+#define OUT_PORT    0x10 /*port test.S writes its counter to*/
+#define KICK_SIGNAL SIGUSR2 /*interrupts KVM_RUN of a vcpu that does not exit on its own*/
+#define DRAIN_INTERVAL_MS 10 /*how often the timer thread drains the coalesced ring*/
+/*KVM_COALESCED_MMIO_MAX needs the kernel PAGE_SIZE, the ring is one 4K page on x86*/
+#define COALESCED_RING_MAX ((4096 - sizeof(struct kvm_coalesced_mmio_ring)) / sizeof(struct kvm_coalesced_mmio))
+
+/*how the image gets into the guest*/
+#define IMAGE_COPY     0 /*read() into guest ram*/
+#define IMAGE_MAP      1 /*mmap MAP_PRIVATE into its own memslot, guest writes are copy on write*/
+#define IMAGE_READONLY 2 /*same with a KVM_MEM_READONLY memslot, guest writes exit as mmio*/
+
+/*memslots when the image is mapped: ram below the image, the image, ram above it*/
+#define RAM_SLOT       0
+#define IMAGE_SLOT     1
+#define RAM_HIGH_SLOT  2
+#define NR_SLOTS       3
+
+/*long mode boot (kvm_setup_long_mode()): gdt and identity page tables below the image*/
+#define LONG_GDT  0x800
+#define LONG_PML4 0x1000
+#define LONG_PDPT 0x2000
+#define LONG_PD   0x3000 /*one page directory per GB with 2M pages, up to IMAGE_START*/
+#define LONG_MAP_MIN (4ULL << 30) /*map at least the low 4GB so the apic and other mmio are reachable*/
+
+/*idle guest (idle64.S): halts until the pit, an ipi or a host msi wakes it*/
+#define IDLE_FILE "idle64.bin"
+#define IDLE_COUNTERS (IMAGE_START + 0x8000) /*struct idle_counters of every vcpu, 64 bytes apart*/
+#define IDLE_VECTOR_MSI 0x40 /*what kvm_inject_msi() sends, 0x20 is the pit and 0x41 the ipi*/
+#define IDLE_ACK_PORT 0x11 /*the msi handler writes it, the exit ends the wakeup latency sample*/
+#define PIT_HZ 1193182
+
+/*wakeups of one vcpu as the guest counts them*/
+struct idle_counters {
+    __u64 timer; /*pit ticks, vcpu 0 only*/
+    __u64 ipi; /*ticks passed on by vcpu 0*/
+    __u64 msi; /*kvm_inject_msi() from the host*/
+    __u64 pad[5];
+};
+
+/*command line options*/
+struct options {
+    int coalesced_pio; /*register OUT_PORT with the coalesced pio ring*/
+    int quiet; /*do not print every exit and value*/
+    int run_secs; /*stop after this many seconds, 0 runs forever*/
+    const char *out_log; /*push values to the per vcpu rings and log them to this file*/
+    const char *stats_json; /*also dump the vcpu stats as json to this file*/
+    int kstats_ms; /*sample the kernel stats fds every kstats_ms, 0 disables them*/
+    const char *cpus; /*pin vcpu threads: "auto" or a cpu list, NULL leaves them unpinned*/
+    const char *mem_policy; /*numa policy of guest ram, see placement_mem_policy()*/
+    const char *ram_backing; /*guest ram backing, see guest_ram_alloc(), NULL for anon*/
+    int ram_mb; /*guest ram size in MB, 0 for RAM_SIZE*/
+    int image_map; /*IMAGE_COPY, IMAGE_MAP or IMAGE_READONLY, see kvm_load_image()*/
+    const char *snapshot; /*write a snapshot to this file once the vcpus stop*/
+    const char *restore; /*start from this snapshot instead of the image*/
+    int dirty_log; /*DIRTY_OFF, DIRTY_BITMAP or DIRTY_RING*/
+    int checkpoint_ms; /*incremental checkpoint into opts.snapshot every checkpoint_ms*/
+    int reset_ms; /*reset to the opts.restore baseline every reset_ms*/
+    int lazy_window; /*demand page guest ram through userfaultfd with this prefetch window, 0 is off*/
+    int irqchip; /*create the in kernel pic, ioapic and local apics*/
+    int ioeventfd; /*OUT_PORT through KVM_IOEVENTFD and the device thread instead of an exit*/
+    int nr_vms; /*run this many single vcpu vms in one process instead, see vm_host.h*/
+    const char *image; /*guest image, a flat binary or an elf file, NULL for test.bin (test64.bin with -L)*/
+    int job_mb; /*smp job mode: the vcpus checksum this many MB of guest ram and halt, see smp_job.h*/
+    int nr_vcpus; /*vcpus of the vm, 0 for NUM_VPCUS*/
+    int pit; /*KVM_CREATE_PIT2 next to the irqchip*/
+    int idle_hz; /*idle mode: the pit ticks at this rate, the host injects an msi every DRAIN_INTERVAL_MS*/
+    long halt_poll_ns; /*KVM_CAP_HALT_POLL of the vm, -1 leaves the kernel default*/
+    __u64 long_mode; /*boot the vcpus in 64 bit long mode with pages of this size, 0 for real mode*/
+    int uart; /*UART_RING, UART_MMIO or UART_PIO: run print_uart0() against the uart device, see uart.h*/
+    int no_sync_regs; /*register access through the ioctls even when the kernel has KVM_CAP_SYNC_REGS*/
+    const char *flight_dir; /*record the last exits of every vcpu into <dir>/vcpu<id>.flight, see flight.h*/
+    int replay; /*REPLAY_RECORD or REPLAY_PLAY the io/mmio exits through <replay_dir>/vcpu<id>.replay, see replay.h*/
+    const char *replay_dir;
+};
+
+extern struct options opts;
+
+struct vm_host;
+
+struct kvm {
+   int dev_fd;	/*device file descriptor*/
+   int vm_fd;   /*vm file descriptor*/
+   __u64 ram_size;  /*vm ram size*/
+   __u64 ram_start; /*vm ram start*/
+   struct guest_ram ram; /*mapping behind ram_start*/
+   struct timespec created; /*when kvm_create_vm started*/
+   atomic_long first_exit_ns; /*time from created to the first exit of any vcpu, 0 until then*/
+   int kvm_version; /*kvm version*/
+   int irqchip; /*KVM_CREATE_IRQCHIP done*/
+   __u64 sync_regs; /*KVM_SYNC_X86_* state the vcpus keep in kvm_run->s.regs, 0 without KVM_CAP_SYNC_REGS*/
+   int shared_dev; /*dev_fd belongs to the caller of kvm_init_dev()*/
+   struct vm_host *host; /*vm_host.c table running this vm, NULL otherwise*/
+   struct kvm_userspace_memory_region slots[NR_SLOTS]; /*memslots as last set, memory_size 0 when unused*/
+   void *image; /*file mapping behind IMAGE_SLOT, NULL when the image was copied into ram*/
+   size_t image_size; /*image file size, the slot is rounded up to a page*/
+   long image_load_ns; /*time spent getting the image into the guest*/
+   struct elf_image elf; /*segments and entry point when the image is an elf file*/
+   struct smp_job *job; /*job mode: per vcpu arguments in the reset registers, NULL otherwise*/
+   struct vcpu *vcpus; /*vpcu struct pointer*/
+   int vcpu_number; /*number of vpcus*/
+   struct kvm_coalesced_mmio_ring *coalesced_ring; /*coalesced pio/mmio ring shared by all vcpus, NULL if not used*/
+   struct uart uart; /*console device, only with opts.uart*/
+   pthread_mutex_t coalesced_lock; /*the ring has a single consumer, serialize the drainers*/
+   atomic_ulong out_values; /*values written to OUT_PORT during this run*/
+   atomic_int stop; /*set once the run duration is over*/
+   struct out_ring *timer_ring; /*ring for values drained by the timer thread*/
+   struct out_writer writer; /*drains all out rings into opts.out_log*/
+   struct kvm_stats_fd kstats; /*kernel per vm stats*/
+   struct dirty_log dirty; /*pages written by the guest, only with opts.dirty_log*/
+   struct lazy_mem lazy; /*userfaultfd handler of guest ram, only with opts.lazy_window*/
+   struct ioevent dev; /*ioeventfd/irqfd devices, only with opts.ioeventfd*/
+   pthread_mutex_t pause_lock; /*guards pause_req and nr_parked*/
+   pthread_cond_t pause_cond; /*signalled when either changes*/
+   int pause_req; /*vcpus park at their next exit while set*/
+   int nr_parked; /*vcpus parked or done, out of KVM_RUN*/
+   atomic_int pausing; /*pause_req for the vcpu fast path*/
+   struct vcpu_hist pause_hist; /*cycles from kvm_pause() to every vcpu parked, only kvm_pause() adds*/
+};
+
+struct vcpu {
+    _Alignas(VCPU_ALIGN) int vcpu_id; /*vpcu index*/
+    int cpu; /*host cpu the vcpu thread is pinned to, -1 if not pinned*/
+    int vcpu_fd; /*vpcu file descriptor*/
+    pthread_t vcpu_thread; /*vpcu thread*/
+    struct kvm *kvm; /*vm this vcpu belongs to*/
+    struct kvm_run *kvm_run; /*kvm run struct per vpcu*/
+    int kvm_run_mmap_size; /*kvm run struct mmap size*/
+    struct kvm_regs regs; /*kvm regs struct*/
+    struct kvm_sregs sregs; /*kvm special regs struct*/
+    struct kvm_vcpu_events events; /*pending exceptions and interrupts, nmi and smi state*/
+    void *(*vcpu_thread_func)(void *); /*vpcu thread function*/
+    int done; /*left its loop (kvm_vcpu_done()), no more kicks, under kvm->pause_lock*/
+    struct out_ring *ring; /*values written by this vcpu, NULL unless opts.out_log*/
+    struct vcpu_stats stats; /*exit counters and KVM_RUN histograms, cache line aligned*/
+    struct kvm_stats_fd kstats; /*kernel per vcpu stats, only read by the sampler thread*/
+    struct dirty_ring dirty_ring; /*only with opts.dirty_log == DIRTY_RING*/
+    atomic_ullong msi_tsc; /*tsc of the last kvm_inject_msi() to it, 0 once the guest acked*/
+    struct vcpu_hist wake; /*cycles from kvm_inject_msi() to the ack exit, only the vcpu thread adds*/
+    struct flight flight; /*last exits of this vcpu, only with opts.flight_dir*/
+    struct replay replay; /*io/mmio exit log of this vcpu, only with opts.replay*/
+};
+
+/*kvm_vm.c*/
+int kvm_sync_regs_load(struct vcpu *vcpu);
+int vcpu_get_regs(struct vcpu *vcpu);
+int vcpu_set_regs(struct vcpu *vcpu);
+int vcpu_get_sregs(struct vcpu *vcpu);
+int vcpu_set_sregs(struct vcpu *vcpu);
+int vcpu_get_events(struct vcpu *vcpu);
+int vcpu_set_events(struct vcpu *vcpu);
+void kvm_reset_vcpu(struct vcpu *vcpu);
+__u64 kvm_long_mode(const char *name);
+int kvm_setup_long_mode(struct kvm *kvm, __u64 page_size);
+int kvm_set_cpuid(struct vcpu *vcpu);
+void kvm_reset_vcpu_long(struct vcpu *vcpu);
+int kvm_set_pit_hz(struct kvm *kvm, int hz);
+int kvm_inject_msi(struct vcpu *vcpu, int vector);
+int kvm_set_halt_poll(struct kvm *kvm, long ns);
+void load_binary(struct kvm *kvm, const char *path);
+int kvm_set_region(struct kvm *kvm, __u32 slot, __u32 flags, __u64 guest_phys_addr, __u64 size, void *addr);
+int kvm_map_image(struct kvm *kvm, const char *path, int readonly);
+int kvm_image_mode(const char *name);
+int kvm_load_image(struct kvm *kvm, const char *path);
+struct kvm *kvm_init(void);
+struct kvm *kvm_init_dev(int dev_fd);
+void kvm_clean(struct kvm *kvm);
+int kvm_create_vm(struct kvm *kvm, __u64 ram_size);
+int kvm_create_vm_from(struct kvm *kvm, __u64 ram_size, const struct guest_ram *template);
+void kvm_clean_vm(struct kvm *kvm);
+struct kvm_coalesced_mmio_ring *kvm_coalesced_ring(struct kvm *kvm);
+void kvm_note_first_exit(struct kvm *kvm);
+int kvm_init_vcpu(struct kvm *kvm, struct vcpu *vcpu, int vcpu_id, void *(*fn)(void *));
+struct vcpu *kvm_create_vpcus(struct kvm *kvm, int num_vcpus, void *(*fn)(void *));
+void kvm_clean_vcpus(struct vcpu *vcpu, int num_vcpus);
+int kvm_start_vcpu(struct vcpu *vcpu);
+void kvm_kick_vcpu(struct vcpu *vcpu);
+void kvm_kick_vcpus(struct kvm *kvm);
+void kvm_pause_point(struct vcpu *vcpu);
+void kvm_vcpu_done(struct vcpu *vcpu);
+int kvm_pause(struct kvm *kvm);
+void kvm_resume(struct kvm *kvm);
+
+#endif
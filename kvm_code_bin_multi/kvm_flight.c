@@ -0,0 +1,194 @@
+/*
+ * Reader for the exit flight recorder files of kvm_code_bin_multi -F (flight.h).
+ * Prints per vcpu: the exit rate over the recorded window, a per reason breakdown
+ * of counts and run/handler time, the last exits and the slowest round trips.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flight.h"
+#include "vcpu_stats.h"
+
+#define FLIGHT_SLOTS 20 /*timeline resolution*/
+#define FLIGHT_BAR 50 /*width of the longest timeline bar*/
+#define FLIGHT_EINTR_SLOT VCPU_STATS_EXIT_REASONS /*one past the vcpu_stats reasons*/
+
+/*per exit reason totals as in vcpu_stats, plus FLIGHT_EINTR_SLOT*/
+struct flight_reason {
+    __u64 count;
+    __u64 run; /*cycles in KVM_RUN*/
+    __u64 handle; /*cycles in the handler*/
+};
+
+static const char *flight_reason_name(int reason) {
+    return reason == FLIGHT_EINTR ? "KVM_RUN EINTR" : vcpu_stats_exit_name(reason);
+}
+
+static int flight_reason_slot(int reason) {
+    if (reason == FLIGHT_EINTR)
+        return FLIGHT_EINTR_SLOT;
+    return reason >= VCPU_STATS_EXIT_REASONS - 1 ? VCPU_STATS_EXIT_REASONS - 1 : reason;
+}
+
+static void flight_print_event(const struct flight_event *ev, __u64 first_tsc, double rate) {
+    printf("  %12.3f ms  %-16s run %10.2f us  handler %10.2f us", (ev->entry_tsc - first_tsc) / rate / 1e3,
+           flight_reason_name(ev->reason), ev->run_cycles / rate, ev->handle_cycles / rate);
+    if (ev->reason == KVM_EXIT_IO || ev->reason == KVM_EXIT_MMIO) {
+        printf("  %s 0x%llx/%u", ev->flags & FLIGHT_WRITE ? "write" : "read", (unsigned long long)ev->addr, ev->size);
+        if (ev->flags & FLIGHT_WRITE)
+            printf(" = 0x%x", ev->data);
+    }
+    printf("\n");
+}
+
+/*descending by run + handler cycles*/
+static int flight_cmp_cost(const void *a, const void *b) {
+    const struct flight_event *x = *(const struct flight_event *const *)a;
+    const struct flight_event *y = *(const struct flight_event *const *)b;
+    __u64 cx = (__u64)x->run_cycles + x->handle_cycles, cy = (__u64)y->run_cycles + y->handle_cycles;
+
+    return cx < cy ? 1 : cx > cy ? -1 : 0;
+}
+
+static void flight_report(const char *path, int nr_tail, int nr_outliers) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+        err(1, "%s", path);
+    if (st.st_size < (off_t)sizeof(struct flight_header))
+        errx(1, "%s: not a flight recorder file", path);
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        err(1, "%s", path);
+    close(fd);
+
+    const struct flight_header *hdr = (const struct flight_header *)addr;
+    const struct flight_event *events = (const struct flight_event *)(hdr + 1);
+    if (memcmp(hdr->magic, FLIGHT_MAGIC, sizeof(hdr->magic)) != 0 || hdr->nr_events == 0 ||
+        (hdr->nr_events & (hdr->nr_events - 1)) != 0 ||
+        st.st_size < (off_t)(sizeof(struct flight_header) + (size_t)hdr->nr_events * sizeof(struct flight_event)))
+        errx(1, "%s: not a flight recorder file", path);
+
+    /*a live file keeps moving, work on the events up to the head read now*/
+    __u64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    __u64 nr = head < hdr->nr_events ? head : hdr->nr_events;
+    double rate = hdr->tsc_per_us;
+    const struct flight_event **ring = malloc((nr ? nr : 1) * sizeof(*ring)); /*oldest first*/
+
+    if (ring == NULL)
+        err(1, "malloc");
+    for (__u64 i = 0; i < nr; i++)
+        ring[i] = &events[(head - nr + i) & (hdr->nr_events - 1)];
+    printf("%s: vcpu %u, %llu of %llu exits in the ring, tsc %.0f MHz\n", path, hdr->vcpu_id, (unsigned long long)nr,
+           (unsigned long long)head, rate);
+    if (nr == 0) {
+        free(ring);
+        munmap(addr, st.st_size);
+        return;
+    }
+
+    __u64 first_tsc = ring[0]->entry_tsc;
+    const struct flight_event *last = ring[nr - 1];
+    __u64 span = last->entry_tsc + last->run_cycles - first_tsc;
+    double span_us = span / rate;
+    printf("window: %.3f ms, %.0f exits/sec\n", span_us / 1e3, span_us > 0 ? nr / span_us * 1e6 : 0.0);
+
+    /*exit rate timeline over the window*/
+    __u64 slots[FLIGHT_SLOTS] = { 0 }, slot_max = 0;
+    for (__u64 i = 0; i < nr; i++) {
+        __u64 s = span ? (ring[i]->entry_tsc - first_tsc) * FLIGHT_SLOTS / (span + 1) : 0;
+        slots[s]++;
+    }
+    for (int s = 0; s < FLIGHT_SLOTS; s++)
+        slot_max = slots[s] > slot_max ? slots[s] : slot_max;
+    printf("timeline (%.3f ms per slot):\n", span_us / 1e3 / FLIGHT_SLOTS);
+    for (int s = 0; s < FLIGHT_SLOTS; s++) {
+        int width = slot_max ? (int)(slots[s] * FLIGHT_BAR / slot_max) : 0;
+        printf("  %10.3f ms %12.0f/s |%.*s\n", span_us * s / FLIGHT_SLOTS / 1e3,
+               span_us > 0 ? slots[s] / (span_us / FLIGHT_SLOTS) * 1e6 : 0.0, width,
+               "##################################################");
+    }
+
+    /*per reason breakdown*/
+    struct flight_reason reasons[FLIGHT_EINTR_SLOT + 1];
+    memset(reasons, 0, sizeof(reasons));
+    for (__u64 i = 0; i < nr; i++) {
+        struct flight_reason *r = &reasons[flight_reason_slot(ring[i]->reason)];
+        r->count++;
+        r->run += ring[i]->run_cycles;
+        r->handle += ring[i]->handle_cycles;
+    }
+    printf("%-16s %10s %7s %12s %14s %14s\n", "exit", "count", "%", "per sec", "avg run us", "avg handler us");
+    for (int i = 0; i <= FLIGHT_EINTR_SLOT; i++) {
+        const struct flight_reason *r = &reasons[i];
+        if (r->count == 0)
+            continue;
+        printf("%-16s %10llu %6.2f%% %12.0f %14.2f %14.2f\n",
+               flight_reason_name(i == FLIGHT_EINTR_SLOT ? FLIGHT_EINTR : i),
+               (unsigned long long)r->count, 100.0 * r->count / nr, span_us > 0 ? r->count / span_us * 1e6 : 0.0,
+               r->run / rate / r->count, r->handle / rate / r->count);
+    }
+
+    int tail = nr_tail < (int)nr ? nr_tail : (int)nr;
+    if (tail > 0) {
+        printf("last %d exits:\n", tail);
+        for (__u64 i = nr - tail; i < nr; i++)
+            flight_print_event(ring[i], first_tsc, rate);
+    }
+
+    int outliers = nr_outliers < (int)nr ? nr_outliers : (int)nr;
+    if (outliers > 0) {
+        qsort(ring, nr, sizeof(*ring), flight_cmp_cost);
+        printf("slowest %d round trips (run + handler):\n", outliers);
+        for (int i = 0; i < outliers; i++)
+            flight_print_event(ring[i], first_tsc, rate);
+    }
+    free(ring);
+    munmap(addr, st.st_size);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n events] [-o outliers] file...\n"
+            "  -n events  print the last events exits of every file (default 10)\n"
+            "  -o count   print the count slowest exits by run + handler time (default 10)\n"
+            "  file       vcpu<id>.flight written by kvm_code_bin_multi -F, also while it runs\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int nr_tail = 10;
+    int nr_outliers = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_tail = atoi(optarg);
+            break;
+        case 'o':
+            nr_outliers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        return -1;
+    }
+    for (int i = optind; i < argc; i++) {
+        flight_report(argv[i], nr_tail, nr_outliers);
+        if (i + 1 < argc)
+            printf("\n");
+    }
+    return 0;
+}
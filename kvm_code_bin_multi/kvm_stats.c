@@ -0,0 +1,115 @@
+/*
+ * Kernel side KVM statistics read through the binary stats fd (KVM_GET_STATS_FD).
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "kvm_stats.h"
+
+/*get the stats fd of a vm or vcpu fd and parse its descriptor table*/
+int kvm_stats_open(struct kvm_stats_fd *stats, int fd, const char *owner) {
+    memset(stats, 0, sizeof(struct kvm_stats_fd));
+    snprintf(stats->owner, sizeof(stats->owner), "%s", owner);
+    stats->fd = ioctl(fd, KVM_GET_STATS_FD, NULL);
+
+    if (stats->fd < 0) {
+        perror("can not get kvm stats fd");
+        return -1;
+    }
+
+    if (pread(stats->fd, &stats->header, sizeof(stats->header), 0) != sizeof(stats->header)) {
+        perror("can not read kvm stats header");
+        goto fail;
+    }
+
+    stats->desc_size = sizeof(struct kvm_stats_desc) + stats->header.name_size;
+    stats->desc_buf = calloc(stats->header.num_desc, stats->desc_size);
+    if (stats->desc_buf == NULL) {
+        perror("can not allocate kvm stats descriptors");
+        goto fail;
+    }
+
+    ssize_t len = stats->header.num_desc * stats->desc_size;
+    if (pread(stats->fd, stats->desc_buf, len, stats->header.desc_offset) != len) {
+        perror("can not read kvm stats descriptors");
+        goto fail;
+    }
+
+    /*the data block ends after the furthest descriptor*/
+    for (unsigned int i = 0; i < stats->header.num_desc; i++) {
+        struct kvm_stats_desc *desc = kvm_stats_desc(stats, i);
+        size_t end = desc->offset + desc->size * sizeof(__u64);
+        if (end > stats->data_size)
+            stats->data_size = end;
+    }
+
+    stats->data = calloc(1, stats->data_size);
+    stats->prev = calloc(1, stats->data_size);
+    if (stats->data == NULL || stats->prev == NULL) {
+        perror("can not allocate kvm stats data");
+        goto fail;
+    }
+    return kvm_stats_sample(stats);
+
+fail:
+    kvm_stats_close(stats);
+    return -1;
+}
+
+/*one pread of the whole data block, the previous sample is kept for deltas*/
+int kvm_stats_sample(struct kvm_stats_fd *stats) {
+    __u64 *tmp = stats->prev;
+
+    if (stats->fd < 0)
+        return -1;
+
+    stats->prev = stats->data;
+    stats->data = tmp;
+    if (pread(stats->fd, stats->data, stats->data_size, stats->header.data_offset) != (ssize_t)stats->data_size) {
+        perror("can not read kvm stats data");
+        return -1;
+    }
+    return 0;
+}
+
+/*one line per stat, cumulative counters also show the delta since the previous sample*/
+void kvm_stats_print(FILE *out, struct kvm_stats_fd *stats, int changed_only) {
+    if (stats->fd < 0)
+        return;
+
+    fprintf(out, "kvm stats %s:", stats->owner);
+    for (unsigned int i = 0; i < stats->header.num_desc; i++) {
+        struct kvm_stats_desc *desc = kvm_stats_desc(stats, i);
+        __u64 *now = (__u64 *)((char *)stats->data + desc->offset);
+        __u64 *before = (__u64 *)((char *)stats->prev + desc->offset);
+        __u64 value = 0, prev = 0;
+
+        for (int j = 0; j < desc->size; j++) { /*histograms are reported as their total count*/
+            value += now[j];
+            prev += before[j];
+        }
+        if (changed_only ? value == prev : value == 0)
+            continue;
+        if ((desc->flags & KVM_STATS_TYPE_MASK) == KVM_STATS_TYPE_CUMULATIVE)
+            fprintf(out, " %s=%llu(+%llu)", desc->name, (unsigned long long)value,
+                    (unsigned long long)(value - prev));
+        else
+            fprintf(out, " %s=%llu", desc->name, (unsigned long long)value);
+    }
+    fprintf(out, "\n");
+}
+
+void kvm_stats_close(struct kvm_stats_fd *stats) {
+    if (stats->fd >= 0)
+        close(stats->fd);
+    free(stats->desc_buf);
+    free(stats->data);
+    free(stats->prev);
+    stats->fd = -1;
+    stats->desc_buf = NULL;
+    stats->data = stats->prev = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * Kernel side KVM statistics read through the binary stats fd (KVM_GET_STATS_FD).
+ * The descriptor table is parsed once at open, a sample is a single pread of the
+ * data block into a preallocated buffer, nothing is shared with the vcpu threads.
+ * author: rkroshan
+ */
+
+#ifndef KVM_STATS_H
+#define KVM_STATS_H
+
+#include <stdio.h>
+#include <linux/kvm.h>
+
+struct kvm_stats_fd {
+    int fd; /*stats fd, -1 when not available*/
+    char owner[16]; /*"vm" or "vcpuN", used when printing*/
+    struct kvm_stats_header header; /*read once at open*/
+    char *desc_buf; /*descriptor block, num_desc entries of desc_size bytes*/
+    size_t desc_size; /*sizeof(struct kvm_stats_desc) + header.name_size*/
+    __u64 *data; /*last sample of the data block*/
+    __u64 *prev; /*sample before that, to print deltas*/
+    size_t data_size; /*bytes in the data block*/
+};
+
+/*descriptor i of an open stats fd*/
+static inline struct kvm_stats_desc *kvm_stats_desc(struct kvm_stats_fd *stats, unsigned int i) {
+    return (struct kvm_stats_desc *)(stats->desc_buf + i * stats->desc_size);
+}
+
+int kvm_stats_open(struct kvm_stats_fd *stats, int fd, const char *owner);
+int kvm_stats_sample(struct kvm_stats_fd *stats);
+void kvm_stats_print(FILE *out, struct kvm_stats_fd *stats, int changed_only);
+void kvm_stats_close(struct kvm_stats_fd *stats);
+
+#endif
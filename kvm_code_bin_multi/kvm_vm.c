@@ -0,0 +1,856 @@
+/*
+ * KVM x86 VM multicore, vm and vcpu life cycle shared by kvm_code_bin_multi and kvm_bench.
+ * author: rkroshan 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "kvm_code_bin_multi.h"
+#include "placement.h"
+
+struct options opts = { .halt_poll_ns = -1 };
+
+/*register access: vcpu->regs, vcpu->sregs and vcpu->events are the working copies. with
+ *KVM_CAP_SYNC_REGS the kernel leaves the guest state in kvm_run->s.regs on every exit and takes
+ *back what has its dirty bit set on the next KVM_RUN, so an exit handler reads and writes
+ *registers without a syscall; without it every get and set is an ioctl*/
+
+/*fill the sync area from the kernel: once the vcpu exists and again after its state was set
+ *with the plain ioctls (snapshot restore), the kernel only refreshes it on the next exit*/
+int kvm_sync_regs_load(struct vcpu *vcpu) {
+    struct kvm_sync_regs *sync = &vcpu->kvm_run->s.regs;
+    int fd = vcpu->vcpu_fd;
+
+    vcpu->kvm_run->kvm_valid_regs = vcpu->kvm->sync_regs;
+    vcpu->kvm_run->kvm_dirty_regs = 0; /*what the ioctls set wins over older pending writes*/
+    if (((vcpu->kvm->sync_regs & KVM_SYNC_X86_REGS) && ioctl(fd, KVM_GET_REGS, &sync->regs) < 0) ||
+        ((vcpu->kvm->sync_regs & KVM_SYNC_X86_SREGS) && ioctl(fd, KVM_GET_SREGS, &sync->sregs) < 0) ||
+        ((vcpu->kvm->sync_regs & KVM_SYNC_X86_EVENTS) && ioctl(fd, KVM_GET_VCPU_EVENTS, &sync->events) < 0)) {
+        perror("can not load sync regs");
+        return -1;
+    }
+    vcpu->stats.reg_ioctls += __builtin_popcountll(vcpu->kvm->sync_regs);
+    return 0;
+}
+
+/*copy one kind of state from the sync area, or ask the kernel*/
+static int vcpu_get_state(struct vcpu *vcpu, __u64 kind, void *copy, const void *sync, size_t size, unsigned long get) {
+    if (vcpu->kvm->sync_regs & kind) {
+        memcpy(copy, sync, size);
+        return 0;
+    }
+    vcpu->stats.reg_ioctls++;
+    return ioctl(vcpu->vcpu_fd, get, copy);
+}
+
+/*hand one kind of state back, through the sync area only when it changed*/
+static int vcpu_set_state(struct vcpu *vcpu, __u64 kind, const void *copy, void *sync, size_t size, unsigned long set) {
+    if (vcpu->kvm->sync_regs & kind) {
+        if (memcmp(sync, copy, size) != 0) {
+            memcpy(sync, copy, size);
+            vcpu->kvm_run->kvm_dirty_regs |= kind;
+        }
+        return 0;
+    }
+    vcpu->stats.reg_ioctls++;
+    return ioctl(vcpu->vcpu_fd, set, copy);
+}
+
+int vcpu_get_regs(struct vcpu *vcpu) {
+    if (vcpu_get_state(vcpu, KVM_SYNC_X86_REGS, &vcpu->regs, &vcpu->kvm_run->s.regs.regs, sizeof(struct kvm_regs),
+                       KVM_GET_REGS) < 0) {
+        perror("can not get regs");
+        return -1;
+    }
+    return 0;
+}
+
+int vcpu_set_regs(struct vcpu *vcpu) {
+    if (vcpu_set_state(vcpu, KVM_SYNC_X86_REGS, &vcpu->regs, &vcpu->kvm_run->s.regs.regs, sizeof(struct kvm_regs),
+                       KVM_SET_REGS) < 0) {
+        perror("can not set regs");
+        return -1;
+    }
+    return 0;
+}
+
+int vcpu_get_sregs(struct vcpu *vcpu) {
+    if (vcpu_get_state(vcpu, KVM_SYNC_X86_SREGS, &vcpu->sregs, &vcpu->kvm_run->s.regs.sregs, sizeof(struct kvm_sregs),
+                       KVM_GET_SREGS) < 0) {
+        perror("can not get sregs");
+        return -1;
+    }
+    return 0;
+}
+
+int vcpu_set_sregs(struct vcpu *vcpu) {
+    if (vcpu_set_state(vcpu, KVM_SYNC_X86_SREGS, &vcpu->sregs, &vcpu->kvm_run->s.regs.sregs, sizeof(struct kvm_sregs),
+                       KVM_SET_SREGS) < 0) {
+        perror("can not set sregs");
+        return -1;
+    }
+    return 0;
+}
+
+int vcpu_get_events(struct vcpu *vcpu) {
+    if (vcpu_get_state(vcpu, KVM_SYNC_X86_EVENTS, &vcpu->events, &vcpu->kvm_run->s.regs.events,
+                       sizeof(struct kvm_vcpu_events), KVM_GET_VCPU_EVENTS) < 0) {
+        perror("can not get vcpu events");
+        return -1;
+    }
+    return 0;
+}
+
+int vcpu_set_events(struct vcpu *vcpu) {
+    if (vcpu_set_state(vcpu, KVM_SYNC_X86_EVENTS, &vcpu->events, &vcpu->kvm_run->s.regs.events,
+                       sizeof(struct kvm_vcpu_events), KVM_SET_VCPU_EVENTS) < 0) {
+        perror("can not set vcpu events");
+        return -1;
+    }
+    return 0;
+}
+
+/*function to setup reset values for vcpu regs and special regs*/
+void kvm_reset_vcpu (struct vcpu *vcpu) {
+	if (vcpu_get_sregs(vcpu) < 0) /*get the kvm special regs for the vpcu*/
+		exit(1);
+    /*setting up global descriptor table information for each segment*/
+    /*since it is a simple program pointing every one to same offset*/
+	vcpu->sregs.cs.selector = CODE_START;
+	vcpu->sregs.cs.base = CODE_START * 16;
+	vcpu->sregs.ss.selector = CODE_START;
+	vcpu->sregs.ss.base = CODE_START * 16;
+	vcpu->sregs.ds.selector = CODE_START;
+	vcpu->sregs.ds.base = CODE_START *16;
+	vcpu->sregs.es.selector = CODE_START;
+	vcpu->sregs.es.base = CODE_START * 16;
+	vcpu->sregs.fs.selector = CODE_START;
+	vcpu->sregs.fs.base = CODE_START * 16;
+	vcpu->sregs.gs.selector = CODE_START;
+
+	if (vcpu_set_sregs(vcpu) < 0) /*set*/
+		exit(1);
+
+	vcpu->regs.rflags = 0x0000000000000002ULL; /*necessary to run the VM in x86*/
+	vcpu->regs.rip = 0; /*instruction pointer starts from zero*/
+	if (vcpu->kvm->elf.entry) { /*cs:ip has to reach it from the image base*/
+		if (vcpu->kvm->elf.entry < IMAGE_START || vcpu->kvm->elf.entry >= IMAGE_START + 0x10000) {
+			fprintf(stderr, "elf entry 0x%llx out of reach of real mode cs\n", vcpu->kvm->elf.entry);
+			exit(1);
+		}
+		vcpu->regs.rip = vcpu->kvm->elf.entry - IMAGE_START;
+	}
+	if (vcpu->kvm->job)
+		smp_job_vcpu_regs(vcpu->kvm->job, vcpu->vcpu_id, &vcpu->regs);
+	vcpu->regs.rsp = 0xffffffff; /*stack pointer at 4GB*/
+	vcpu->regs.rbp= 0; /*base pointer at 0*/
+
+	if (vcpu_set_regs(vcpu) < 0) /*set*/
+		exit(1);
+}
+
+/*"2M" or "1G" from the command line, the page size of the long mode identity map, 0 if unknown*/
+__u64 kvm_long_mode(const char *name) {
+    if (strcmp(name, "2M") == 0)
+        return 2ULL << 20;
+    if (strcmp(name, "1G") == 0)
+        return 1ULL << 30;
+    fprintf(stderr, "unknown long mode page size: %s\n", name);
+    return 0;
+}
+
+/*what this kvm can offer the guest, malloc'ed*/
+static struct kvm_cpuid2 *kvm_supported_cpuid(struct kvm *kvm) {
+    int nent = 256;
+    struct kvm_cpuid2 *cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+
+    if (cpuid == NULL) {
+        perror("can not allocate cpuid");
+        return NULL;
+    }
+    cpuid->nent = nent;
+    if (ioctl(kvm->dev_fd, KVM_GET_SUPPORTED_CPUID, cpuid) < 0) {
+        perror("can not get supported cpuid");
+        free(cpuid);
+        return NULL;
+    }
+    return cpuid;
+}
+
+/*gdt plus page tables identity mapping all of guest ram (and at least the low 4GB) with 2M or 1G pages,
+ *written to guest memory below the image. every vcpu reset with kvm_reset_vcpu_long() shares them*/
+int kvm_setup_long_mode(struct kvm *kvm, __u64 page_size) {
+    __u64 *gdt = (__u64 *)(kvm->ram_start + LONG_GDT);
+    __u64 *pml4 = (__u64 *)(kvm->ram_start + LONG_PML4);
+    __u64 *pdpt = (__u64 *)(kvm->ram_start + LONG_PDPT);
+    __u64 map = kvm->ram_size > LONG_MAP_MIN ? kvm->ram_size : LONG_MAP_MIN;
+    __u64 gbs = (map + (1ULL << 30) - 1) >> 30;
+
+    if (page_size == (1ULL << 30)) {
+        struct kvm_cpuid2 *cpuid = kvm_supported_cpuid(kvm);
+        int pdpe1gb = 0;
+        if (cpuid == NULL)
+            return -1;
+        for (__u32 i = 0; i < cpuid->nent; i++) {
+            if (cpuid->entries[i].function == 0x80000001)
+                pdpe1gb = (cpuid->entries[i].edx >> 26) & 1;
+        }
+        free(cpuid);
+        if (!pdpe1gb) {
+            fprintf(stderr, "1G pages not supported, use -L 2M\n");
+            return -1;
+        }
+    }
+    if (gbs > 512 || (page_size != (1ULL << 30) && LONG_PD + gbs * 4096 > IMAGE_START)) {
+        fprintf(stderr, "%llu GB of ram do not fit in the long mode page tables\n", (unsigned long long)gbs);
+        return -1;
+    }
+
+    gdt[0] = 0;
+    gdt[1] = 0x00af9a000000ffffULL; /*0x08: 64 bit code*/
+    gdt[2] = 0x00cf92000000ffffULL; /*0x10: data*/
+    memset(pml4, 0, 4096);
+    memset(pdpt, 0, 4096);
+    pml4[0] = LONG_PDPT | 0x3; /*present, writable*/
+    for (__u64 gb = 0; gb < gbs; gb++) {
+        if (page_size == (1ULL << 30)) {
+            pdpt[gb] = (gb << 30) | 0x83; /*present, writable, 1G page*/
+            continue;
+        }
+        __u64 *pd = (__u64 *)(kvm->ram_start + LONG_PD + gb * 4096);
+        pdpt[gb] = (LONG_PD + gb * 4096) | 0x3;
+        for (__u64 i = 0; i < 512; i++)
+            pd[i] = (gb << 30) + (i << 21) + 0x83; /*present, writable, 2M page*/
+    }
+    return 0;
+}
+
+/*hand the guest the cpuid kvm supports, EFER.LME is refused unless it has long mode*/
+int kvm_set_cpuid(struct vcpu *vcpu) {
+    struct kvm_cpuid2 *cpuid = kvm_supported_cpuid(vcpu->kvm);
+    int ret;
+
+    if (cpuid == NULL)
+        return -1;
+    ret = ioctl(vcpu->vcpu_fd, KVM_SET_CPUID2, cpuid);
+    if (ret < 0)
+        perror("can not set cpuid");
+    free(cpuid);
+    return ret;
+}
+
+/*64 bit long mode straight from reset: cpuid, paging on through the tables of kvm_setup_long_mode(),
+ *flat segments from its gdt, rip at the image and rsp at the top of ram, a page per vcpu*/
+void kvm_reset_vcpu_long(struct vcpu *vcpu) {
+    struct kvm_segment code = {
+        .base = 0, .limit = 0xffffffff, .selector = 0x8,
+        .type = 0xb, .present = 1, .dpl = 0, .db = 0, .s = 1, .l = 1, .g = 1,
+    };
+    struct kvm_segment data = code;
+
+    if (kvm_set_cpuid(vcpu) < 0)
+        exit(1);
+    if (vcpu_get_sregs(vcpu) < 0)
+        exit(1);
+    data.type = 0x3;
+    data.selector = 0x10;
+    data.db = 1;
+    data.l = 0;
+    vcpu->sregs.cs = code;
+    vcpu->sregs.ds = vcpu->sregs.es = vcpu->sregs.fs = vcpu->sregs.gs = vcpu->sregs.ss = data;
+    vcpu->sregs.gdt.base = LONG_GDT;
+    vcpu->sregs.gdt.limit = 3 * 8 - 1;
+    vcpu->sregs.cr3 = LONG_PML4;
+    vcpu->sregs.cr4 = 1 << 5; /*PAE*/
+    vcpu->sregs.cr0 = 0x80050033; /*PG, AM, WP, NE, ET, MP, PE*/
+    vcpu->sregs.efer = 0x500; /*LMA, LME*/
+    if (vcpu_set_sregs(vcpu) < 0)
+        exit(1);
+
+    memset(&vcpu->regs, 0, sizeof(struct kvm_regs));
+    vcpu->regs.rflags = 0x2;
+    vcpu->regs.rip = vcpu->kvm->elf.entry ? vcpu->kvm->elf.entry : IMAGE_START;
+    vcpu->regs.rsp = vcpu->kvm->ram_size - vcpu->vcpu_id * 4096;
+    if (vcpu->kvm->job)
+        smp_job_vcpu_regs(vcpu->kvm->job, vcpu->vcpu_id, &vcpu->regs);
+    if (vcpu_set_regs(vcpu) < 0)
+        exit(1);
+}
+
+/*channel 0 of the in kernel pit as a rate generator at hz, it raises irq 0*/
+int kvm_set_pit_hz(struct kvm *kvm, int hz) {
+    struct kvm_pit_state2 state;
+
+    if (hz < PIT_HZ / 0xffff || hz > PIT_HZ) {
+        fprintf(stderr, "pit rate %d Hz out of range\n", hz);
+        return -1;
+    }
+    if (ioctl(kvm->vm_fd, KVM_GET_PIT2, &state) < 0) {
+        perror("can not get pit state");
+        return -1;
+    }
+    state.channels[0].count = PIT_HZ / hz;
+    state.channels[0].mode = 2;
+    state.channels[0].rw_mode = state.channels[0].read_state = state.channels[0].write_state = 3; /*lsb then msb*/
+    state.channels[0].gate = 1;
+    if (ioctl(kvm->vm_fd, KVM_SET_PIT2, &state) < 0) {
+        perror("can not set pit state");
+        return -1;
+    }
+    return 0;
+}
+
+/*fixed interrupt vector straight to the local apic of vcpu, returns > 0 when delivered,
+ *0 when the guest blocked it*/
+int kvm_inject_msi(struct vcpu *vcpu, int vector) {
+    struct kvm_msi msi = {
+        .address_lo = 0xfee00000 | vcpu->vcpu_id << 12, /*apic id == vcpu id, physical destination*/
+        .data = vector,
+    };
+    int ret;
+
+    atomic_store_explicit(&vcpu->msi_tsc, __rdtsc(), memory_order_relaxed);
+    ret = ioctl(vcpu->kvm->vm_fd, KVM_SIGNAL_MSI, &msi);
+    if (ret < 0)
+        perror("can not signal msi");
+    return ret;
+}
+
+/*how long a halted vcpu spins in the kernel for a wakeup before it sleeps: lower wakeup latency
+ *against host cpu burnt while idle. 0 turns polling off*/
+int kvm_set_halt_poll(struct kvm *kvm, long ns) {
+    struct kvm_enable_cap cap = { .cap = KVM_CAP_HALT_POLL, .args[0] = ns };
+
+    if (ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0) {
+        fprintf(stderr, "KVM_CAP_HALT_POLL not supported\n");
+        return -1;
+    }
+    if (ioctl(kvm->vm_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("can not set halt poll");
+        return -1;
+    }
+    return 0;
+}
+
+/*to load data from binary to a buffer*/
+void load_binary(struct kvm *kvm, const char *path) {
+    int fd = open(path, O_RDONLY); /*open the bin file*/
+
+    if (fd < 0) {
+        fprintf(stderr, "can not open binary file\n");
+        exit(1);
+    }
+
+    int ret = 0;
+    char *p = (char *)kvm->ram_start + IMAGE_START; /*addr from where bin will be kept, where cs:ip 0 points*/
+
+    while(1) {
+        ret = read(fd, p, 4096); /*read upto 4096 bytes*/
+        if (ret <= 0) {
+            break;
+        }
+        if (!opts.quiet)
+            printf("read size: %d\n", ret);
+        p += ret; /*move pointer ahead of last offset upto which data is written*/
+    }
+    close(fd);
+}
+
+/*set a memslot and remember it in kvm->slots, size 0 deletes it.
+ *writable slots log dirty pages when opts.dirty_log is on*/
+int kvm_set_region(struct kvm *kvm, __u32 slot, __u32 flags, __u64 guest_phys_addr, __u64 size, void *addr) {
+    struct kvm_userspace_memory_region region = {
+        .slot = slot, /*provides an integer index identifying each region of memory we hand to KVM; calling KVM_SET_USER_MEMORY_REGION again with the same slot will replace this mapping*/
+        .flags = flags,
+        .guest_phys_addr = guest_phys_addr, /*specifies the base "physical" address as seen from the guest*/
+        .memory_size = size,
+        .userspace_addr = (__u64)addr, /*points to the backing memory in our process that we allocated with mmap()*/
+    };
+
+    if (opts.dirty_log && size && !(flags & KVM_MEM_READONLY))
+        region.flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    if (ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0) {
+        perror("can not set user memory region");
+        return -1;
+    }
+    kvm->slots[slot] = region;
+    return 0;
+}
+
+/*map the image file MAP_PRIVATE into its own memslot at IMAGE_START instead of copying it,
+ *pages fault in when the guest first touches them and are copied only when it writes them.
+ *the ram slot is split around the image, memslots can not overlap*/
+int kvm_map_image(struct kvm *kvm, const char *path, int readonly) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "can not open binary file\n");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "can not map empty binary file\n");
+        close(fd);
+        return -1;
+    }
+
+    size_t page = getpagesize();
+    __u64 slot_size = (st.st_size + page - 1) & ~(page - 1);
+    __u64 high = IMAGE_START + slot_size; /*first guest address above the image*/
+
+    if (high > kvm->ram_size) {
+        fprintf(stderr, "image does not fit in %llu bytes of ram\n", kvm->ram_size);
+        close(fd);
+        return -1;
+    }
+    if (readonly && ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_READONLY_MEM) <= 0) {
+        fprintf(stderr, "KVM_CAP_READONLY_MEM not supported\n");
+        close(fd);
+        return -1;
+    }
+
+    /*the tail of the last page past the end of file reads as zero*/
+    kvm->image = mmap(NULL, slot_size, readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); /*the mapping holds its own reference*/
+    if (kvm->image == MAP_FAILED) {
+        kvm->image = NULL;
+        perror("can not mmap binary file");
+        return -1;
+    }
+    kvm->image_size = st.st_size;
+
+    /*a slot is deleted by setting its size to 0, then ram is put back in two pieces*/
+    if (kvm_set_region(kvm, RAM_SLOT, 0, 0, 0, (void *)kvm->ram_start) < 0)
+        return -1;
+    if (kvm_set_region(kvm, RAM_SLOT, 0, 0, IMAGE_START, (void *)kvm->ram_start) < 0)
+        return -1;
+    if (kvm_set_region(kvm, IMAGE_SLOT, readonly ? KVM_MEM_READONLY : 0, IMAGE_START, slot_size, kvm->image) < 0)
+        return -1;
+    if (high < kvm->ram_size &&
+        kvm_set_region(kvm, RAM_HIGH_SLOT, 0, high, kvm->ram_size - high, (char *)kvm->ram_start + high) < 0)
+        return -1;
+
+    if (!opts.quiet)
+        printf("mapped %s: %zu bytes%s\n", path, kvm->image_size, readonly ? " read only" : "");
+    return 0;
+}
+
+/*"copy", "map" or "ro" from the command line, -1 if unknown*/
+int kvm_image_mode(const char *name) {
+    if (strcmp(name, "copy") == 0)
+        return IMAGE_COPY;
+    if (strcmp(name, "map") == 0)
+        return IMAGE_MAP;
+    if (strcmp(name, "ro") == 0)
+        return IMAGE_READONLY;
+    fprintf(stderr, "unknown image mode: %s\n", name);
+    return -1;
+}
+
+/*get the image into the guest the way opts.image_map asks and time it, an elf image (by its magic)
+ *is loaded segment by segment with elf_load() instead*/
+int kvm_load_image(struct kvm *kvm, const char *path) {
+    struct timespec start, end;
+    int ret = 0;
+    int elf = elf_probe(path);
+
+    if (elf < 0)
+        return -1;
+    if (elf && kvm->lazy.uffd >= 0) {
+        fprintf(stderr, "demand paging needs a flat binary, elf segments are mapped from the file anyway\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (elf) /*segments go to their own addresses, -i does not apply*/
+        ret = elf_load(kvm, &kvm->elf, path);
+    else if (kvm->lazy.uffd >= 0) { /*the fault handler reads the image when the guest touches it*/
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            fprintf(stderr, "can not open binary file\n");
+            return -1;
+        }
+        ret = lazy_mem_source(&kvm->lazy, path, 0, IMAGE_START, st.st_size);
+        if (ret == 0)
+            ret = lazy_mem_start(&kvm->lazy);
+    } else if (opts.image_map == IMAGE_COPY)
+        load_binary(kvm, path);
+    else
+        ret = kvm_map_image(kvm, path, opts.image_map == IMAGE_READONLY);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    kvm->image_load_ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    return ret;
+}
+
+/*utility function to initialize and open kvm device*/
+struct kvm *kvm_init(void) {
+    return kvm_init_dev(-1);
+}
+
+/*same on an already open /dev/kvm fd (-1 opens a new one), kvm_clean() then leaves it open.
+ *a process running many vms opens the device once*/
+struct kvm *kvm_init_dev(int dev_fd) {
+    struct kvm *kvm = malloc(sizeof(struct kvm)); /*allocate mem for kvm struct*/
+    memset(kvm, 0, sizeof(struct kvm));
+    kvm->kstats.fd = -1;
+    kvm->lazy.uffd = kvm->lazy.stop_fd = kvm->lazy.src_fd = -1;
+    kvm->ram.fd = -1; /*kvm_clean_vm() of a vm that failed before its ram was set up*/
+    pthread_mutex_init(&kvm->coalesced_lock, NULL);
+    pthread_mutex_init(&kvm->pause_lock, NULL);
+    pthread_cond_init(&kvm->pause_cond, NULL);
+    kvm->shared_dev = dev_fd >= 0;
+    kvm->dev_fd = dev_fd >= 0 ? dev_fd : open(KVM_DEVICE, O_RDWR); /*open kvm device and store the file descriptor*/
+
+    if (kvm->dev_fd < 0) {
+        perror("open kvm device fault: ");
+        return NULL;
+    }
+
+    kvm->kvm_version = ioctl(kvm->dev_fd, KVM_GET_API_VERSION, 0); /*get the KVM API version should be 12*/
+
+    return kvm;
+}
+
+/*utility function to clean up the allocated mem for kvm struct and close the fd*/
+void kvm_clean(struct kvm *kvm) {
+    assert (kvm != NULL);
+    if (!kvm->shared_dev)
+        close(kvm->dev_fd);
+    free(kvm);
+}
+
+/*function to create vm*/
+int kvm_create_vm(struct kvm *kvm, __u64 ram_size) {
+    return kvm_create_vm_from(kvm, ram_size, NULL);
+}
+
+/*create the vm with ram_size bytes of new guest ram, or with a copy on write clone of template*/
+int kvm_create_vm_from(struct kvm *kvm, __u64 ram_size, const struct guest_ram *template) {
+    int ret = 0;
+    clock_gettime(CLOCK_MONOTONIC, &kvm->created); /*start of the time to first exit*/
+    kvm->vm_fd = ioctl(kvm->dev_fd, KVM_CREATE_VM, 0); /*create VM*/
+
+    if (kvm->vm_fd < 0) {
+        perror("can not create vm");
+        return -1;
+    }
+
+    if (opts.kstats_ms && kvm_stats_open(&kvm->kstats, kvm->vm_fd, "vm") < 0)
+        fprintf(stderr, "kernel vm stats not available\n");
+
+    if (template) { /*ram_size is the template size*/
+        if (guest_ram_clone(&kvm->ram, template) < 0)
+            return -1;
+    } else if (opts.restore && !opts.lazy_window) { /*ram comes from the snapshot file, ram_size with it*/
+        if (snapshot_map_ram(&kvm->ram, opts.restore) < 0)
+            return -1;
+    } else {
+        off_t snap_off = 0;
+        if (opts.restore && snapshot_ram_section(opts.restore, &snap_off, &ram_size) < 0)
+            return -1;
+        /* Allocate mem (aligned to the backing page size) of guest memory to hold the code, 4K anonymous pages unless opts.ram_backing says otherwise*/
+        if (guest_ram_alloc(&kvm->ram, ram_size, opts.ram_backing) < 0)
+            return -1;
+        /*lazy: nothing is populated now, the handler fills pages as the guest touches them*/
+        if (opts.lazy_window && lazy_mem_init(&kvm->lazy, kvm->ram.addr, kvm->ram.size, opts.lazy_window) < 0)
+            return -1;
+        if (opts.lazy_window && opts.restore &&
+            (lazy_mem_source(&kvm->lazy, opts.restore, snap_off, 0, ram_size) < 0 || lazy_mem_start(&kvm->lazy) < 0))
+            return -1;
+    }
+    kvm->ram_start = (__u64)kvm->ram.addr;
+    kvm->ram_size = kvm->ram.size;
+
+    if (opts.mem_policy) { /*nothing is touched yet, the policy decides where every page lands*/
+        int cpu;
+        placement_vcpu_cpus(opts.cpus, &cpu, 1); /*"local" means the node of vcpu 0*/
+        if (placement_mem_policy((void *)kvm->ram_start, kvm->ram_size, opts.mem_policy,
+                                 cpu >= 0 ? placement_cpu_node(cpu) : -1) < 0)
+            return -1;
+    }
+
+    /*pic, ioapic and a local apic per vcpu emulated in the kernel, before any vcpu is created*/
+    if (opts.irqchip) {
+        if (ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+            perror("can not create irqchip");
+            return -1;
+        }
+        kvm->irqchip = 1;
+    }
+    if (opts.pit) {
+        struct kvm_pit_config pit = { .flags = 0 };
+        if (!kvm->irqchip || ioctl(kvm->vm_fd, KVM_CREATE_PIT2, &pit) < 0) {
+            perror("can not create pit");
+            return -1;
+        }
+    }
+    if (opts.halt_poll_ns >= 0 && kvm_set_halt_poll(kvm, opts.halt_poll_ns) < 0)
+        return -1;
+
+    /*regs, sregs and events through kvm_run on every exit, whatever subset the kernel offers*/
+    if (!opts.no_sync_regs) {
+        int kinds = ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+        kvm->sync_regs = kinds > 0 ? kinds & (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS | KVM_SYNC_X86_EVENTS) : 0;
+    }
+
+    /*the dirty ring has to be enabled before the vcpus exist*/
+    if (opts.dirty_log && dirty_log_init(kvm) < 0)
+        return -1;
+
+    /*all of guest ram in one slot at guest physical address 0*/
+    ret = kvm_set_region(kvm, RAM_SLOT, 0, 0, kvm->ram_size, (void *)kvm->ram_start);
+
+    return ret;
+}
+
+/*function to close vm fd and unmap ram data*/
+void kvm_clean_vm(struct kvm *kvm) {
+    kvm_stats_close(&kvm->kstats);
+    close(kvm->vm_fd);
+    if (kvm->lazy.uffd >= 0)
+        lazy_mem_stop(&kvm->lazy);
+    if (kvm->image)
+        munmap(kvm->image, (kvm->image_size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1));
+    guest_ram_free(&kvm->ram);
+    dirty_log_free(kvm);
+}
+
+/*the ring of every coalesced mmio and pio zone, one page shared by the whole vm that any vcpu
+ *mapping reaches. the vcpus have to exist, NULL when the kernel has no coalesced mmio*/
+struct kvm_coalesced_mmio_ring *kvm_coalesced_ring(struct kvm *kvm) {
+    int ring_page = ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO); /*page offset of the ring in the kvm_run mmap*/
+
+    if (kvm->coalesced_ring == NULL && ring_page > 0 && kvm->vcpus)
+        kvm->coalesced_ring = (struct kvm_coalesced_mmio_ring *)((char *)kvm->vcpus[0].kvm_run + ring_page * getpagesize());
+    return kvm->coalesced_ring;
+}
+
+/*first exit of any vcpu, called from the vcpu threads until it is recorded*/
+void kvm_note_first_exit(struct kvm *kvm) {
+    struct timespec now;
+    long expected = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ns = (now.tv_sec - kvm->created.tv_sec) * 1000000000L + (now.tv_nsec - kvm->created.tv_nsec);
+    atomic_compare_exchange_strong(&kvm->first_exit_ns, &expected, ns);
+}
+
+/*function to create vpcu*/
+int kvm_init_vcpu(struct kvm *kvm, struct vcpu* vcpu, int vcpu_id, void *(*fn)(void *)) {
+    vcpu->vcpu_id = vcpu_id;
+    vcpu->kvm = kvm;
+    vcpu->kstats.fd = -1;
+    vcpu->vcpu_fd = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, vcpu->vcpu_id); /*create vpcu*/
+
+    if (vcpu->vcpu_fd < 0) {
+        perror("can not create vcpu");
+        return -1;
+    }
+
+    if (opts.kstats_ms) {
+        char owner[16];
+        snprintf(owner, sizeof(owner), "vcpu%d", vcpu_id);
+        if (kvm_stats_open(&vcpu->kstats, vcpu->vcpu_fd, owner) < 0)
+            fprintf(stderr, "kernel vcpu stats not available\n");
+    }
+
+    vcpu->kvm_run_mmap_size = ioctl(kvm->dev_fd, KVM_GET_VCPU_MMAP_SIZE, 0); /*get the mem size for vpcu*/
+
+    if (vcpu->kvm_run_mmap_size < 0) {
+        perror("can not get vcpu mmsize");
+        return -1;
+    }
+
+    // printf("%d\n", vcpu->kvm_run_mmap_size);
+    /*map the struct kvm_run into vcpufd starting from offset 0 upto mmap_size, so it is sahred between vcpu and we also see the same thing*/
+    vcpu->kvm_run = mmap(NULL, vcpu->kvm_run_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->vcpu_fd, 0);
+
+    if (vcpu->kvm_run == MAP_FAILED) {
+        perror("can not mmap kvm_run");
+        return -1;
+    }
+
+    if (kvm->dirty.ring_entries && dirty_ring_map(kvm, vcpu) < 0)
+        return -1;
+
+    /*with the in kernel apic only vcpu 0 starts, the others wait for INIT/SIPI unless made runnable*/
+    if (kvm->irqchip && vcpu_id != 0) {
+        struct kvm_mp_state mp = { .mp_state = KVM_MP_STATE_RUNNABLE };
+        if (ioctl(vcpu->vcpu_fd, KVM_SET_MP_STATE, &mp) < 0) {
+            perror("can not set mp state");
+            return -1;
+        }
+    }
+    if (kvm->sync_regs && kvm_sync_regs_load(vcpu) < 0)
+        return -1;
+
+    vcpu->vcpu_thread_func = fn;
+    return 0;
+}
+
+/*function to create vpcus*/
+struct vcpu* kvm_create_vpcus(struct kvm* kvm, int num_vcpus, void *(*fn)(void *))
+{
+    int cpus[num_vcpus];
+
+    if (placement_vcpu_cpus(opts.cpus, cpus, num_vcpus) < 0)
+        return NULL;
+
+    /*every struct vcpu is VCPU_ALIGN (a page) aligned, so each one can sit on the numa node of its pinned cpu*/
+    struct vcpu *vcpus = mmap(NULL, num_vcpus * sizeof(struct vcpu), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(vcpus == MAP_FAILED){
+        printf("failed to allocate mem for vpcus\n");
+        return NULL;
+    }
+    for(int vcpu_id = 0; vcpu_id < num_vcpus; vcpu_id++)
+    {
+        /*before the first touch, the page is then allocated on that node*/
+        if (cpus[vcpu_id] >= 0 &&
+            placement_bind(&vcpus[vcpu_id], sizeof(struct vcpu), placement_cpu_node(cpus[vcpu_id])) < 0) {
+            printf("failed to place vcpu %d on the node of cpu %d\n", vcpu_id, cpus[vcpu_id]);
+            munmap(vcpus, num_vcpus * sizeof(struct vcpu));
+            return NULL;
+        }
+        memset(&vcpus[vcpu_id], 0, sizeof(struct vcpu));
+        vcpus[vcpu_id].cpu = cpus[vcpu_id];
+    }
+    for(int vcpu_id = 0; vcpu_id < num_vcpus; vcpu_id++)
+    {
+        if(kvm_init_vcpu(kvm, &vcpus[vcpu_id], vcpu_id, fn) < 0){
+            printf("failed to init vpcu %d\n", vcpu_id);
+            return NULL;
+        }
+    }
+    return vcpus;
+}
+
+/*function to unmap kvm_run to vcpu mem and close vcpu fd*/
+void kvm_clean_vcpus(struct vcpu *vcpu, int num_vcpus) {
+    for(int id=0;id<num_vcpus;id++)
+    {
+        kvm_stats_close(&vcpu[id].kstats);
+        dirty_ring_unmap(vcpu[id].kvm, &vcpu[id]);
+        munmap(vcpu[id].kvm_run, vcpu[id].kvm_run_mmap_size);
+        close(vcpu[id].vcpu_fd);
+    }
+    munmap(vcpu, num_vcpus * sizeof(struct vcpu));
+}
+
+/*function to start the vcpu thread, pinned to vcpu->cpu if it has one*/
+int kvm_start_vcpu(struct vcpu *vcpu) {
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    if (vcpu->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(vcpu->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    ret = pthread_create(&vcpu->vcpu_thread, &attr, vcpu->vcpu_thread_func, vcpu);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("can not create vcpu thread");
+        return -1;
+    }
+    return 0;
+}
+
+static void kvm_kick(int sig) {
+    (void)sig; /*only there to make KVM_RUN return EINTR*/
+}
+
+static void kvm_kick_init(void) {
+    struct sigaction sa = { .sa_handler = kvm_kick }; /*no SA_RESTART, KVM_RUN has to fail with EINTR*/
+
+    sigaction(KICK_SIGNAL, &sa, NULL);
+}
+
+/*get the vcpu out of KVM_RUN with EINTR, the vcpu thread clears immediate_exit before it runs again.
+ *immediate_exit covers a vcpu between its last check and KVM_RUN, the signal one that is inside*/
+void kvm_kick_vcpu(struct vcpu *vcpu) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, kvm_kick_init);
+    vcpu->kvm_run->immediate_exit = 1;
+    pthread_kill(vcpu->vcpu_thread, KICK_SIGNAL);
+}
+
+/*get every vcpu out of KVM_RUN, for a pause or once kvm->stop is set with guests that never exit
+ *on their own. a vcpu past kvm_vcpu_done() is skipped, its thread may already be joined*/
+void kvm_kick_vcpus(struct kvm *kvm) {
+    pthread_mutex_lock(&kvm->pause_lock);
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        if (!kvm->vcpus[i].done)
+            kvm_kick_vcpu(&kvm->vcpus[i]);
+    }
+    pthread_mutex_unlock(&kvm->pause_lock);
+}
+
+/*called by a vcpu thread after every exit and after every kick (EINTR, immediate_exit cleared):
+ *parks it outside KVM_RUN while a pause is requested. the pending exit is completed first so the
+ *parked vcpu state can be saved as is*/
+void kvm_pause_point(struct vcpu *vcpu) {
+    struct kvm *kvm = vcpu->kvm;
+
+    if (!atomic_load_explicit(&kvm->pausing, memory_order_acquire))
+        return;
+    snapshot_quiesce_vcpu(vcpu);
+    pthread_mutex_lock(&kvm->pause_lock);
+    kvm->nr_parked++;
+    pthread_cond_broadcast(&kvm->pause_cond);
+    while (kvm->pause_req)
+        pthread_cond_wait(&kvm->pause_cond, &kvm->pause_lock);
+    kvm->nr_parked--;
+    pthread_mutex_unlock(&kvm->pause_lock);
+}
+
+/*called by a vcpu thread when it leaves its loop, it counts as parked from then on*/
+void kvm_vcpu_done(struct vcpu *vcpu) {
+    struct kvm *kvm = vcpu->kvm;
+
+    pthread_mutex_lock(&kvm->pause_lock);
+    vcpu->done = 1;
+    kvm->nr_parked++;
+    pthread_cond_broadcast(&kvm->pause_cond);
+    pthread_mutex_unlock(&kvm->pause_lock);
+}
+
+/*kick every vcpu out of KVM_RUN and wait until all of them are parked, guests that never exit
+ *or halt in the kernel included. the time from the request to the last vcpu parked goes to
+ *kvm->pause_hist, it bounds the downtime of a snapshot*/
+int kvm_pause(struct kvm *kvm) {
+    __u64 begin = __rdtsc();
+
+    pthread_mutex_lock(&kvm->pause_lock);
+    kvm->pause_req = 1;
+    atomic_store_explicit(&kvm->pausing, 1, memory_order_release);
+    pthread_mutex_unlock(&kvm->pause_lock);
+    kvm_kick_vcpus(kvm); /*after pausing is set, a vcpu that missed it gets the kick*/
+    pthread_mutex_lock(&kvm->pause_lock);
+    while (kvm->nr_parked < kvm->vcpu_number)
+        pthread_cond_wait(&kvm->pause_cond, &kvm->pause_lock);
+    pthread_mutex_unlock(&kvm->pause_lock);
+    vcpu_hist_add(&kvm->pause_hist, __rdtsc() - begin);
+    return 0;
+}
+
+void kvm_resume(struct kvm *kvm) {
+    pthread_mutex_lock(&kvm->pause_lock);
+    atomic_store_explicit(&kvm->pausing, 0, memory_order_relaxed);
+    kvm->pause_req = 0;
+    pthread_cond_broadcast(&kvm->pause_cond);
+    pthread_mutex_unlock(&kvm->pause_lock);
+}
@@ -0,0 +1,239 @@
+/*
+ * Demand paged guest ram through userfaultfd.
+ * author: rkroshan
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include "lazy_mem.h"
+
+static int page_populated(const struct lazy_mem *lazy, unsigned long page) {
+    return (lazy->populated[page / 64] >> (page % 64)) & 1;
+}
+
+/*register ram for missing page faults, nothing is filled before lazy_mem_start()*/
+int lazy_mem_init(struct lazy_mem *lazy, void *ram, size_t size, int window) {
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg = {
+        .range = { .start = (unsigned long)ram, .len = size },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    memset(lazy, 0, sizeof(struct lazy_mem));
+    lazy->src_fd = -1;
+    lazy->stop_fd = -1;
+    lazy->ram = ram;
+    lazy->size = size;
+    lazy->window = window < 1 ? 1 : window;
+    lazy->cur_window = 1;
+
+    /*no UFFD_USER_MODE_ONLY, the faults KVM takes on behalf of the guest are kernel mode*/
+    lazy->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (lazy->uffd < 0) {
+        perror("can not open userfaultfd");
+        return -1;
+    }
+    if (ioctl(lazy->uffd, UFFDIO_API, &api) < 0 || ioctl(lazy->uffd, UFFDIO_REGISTER, &reg) < 0) {
+        perror("can not register guest ram with userfaultfd");
+        close(lazy->uffd);
+        lazy->uffd = -1;
+        return -1;
+    }
+    if (!(reg.ioctls & ((__u64)1 << _UFFDIO_ZEROPAGE))) {
+        fprintf(stderr, "userfaultfd: UFFDIO_ZEROPAGE not available on guest ram\n");
+        close(lazy->uffd);
+        lazy->uffd = -1;
+        return -1;
+    }
+
+    lazy->populated = calloc((size / LAZY_PAGE_SIZE + 63) / 64, sizeof(unsigned long));
+    lazy->buf = aligned_alloc(LAZY_PAGE_SIZE, (size_t)lazy->window * LAZY_PAGE_SIZE);
+    if (lazy->populated == NULL || lazy->buf == NULL) {
+        perror("can not allocate lazy memory state");
+        lazy_mem_stop(lazy);
+        return -1;
+    }
+    return 0;
+}
+
+/*len bytes of path at offset back guest addresses gpa..gpa+len, a short file reads zero past its end*/
+int lazy_mem_source(struct lazy_mem *lazy, const char *path, off_t offset, __u64 gpa, __u64 len) {
+    if (gpa + len > lazy->size) {
+        fprintf(stderr, "%s does not fit in %zu bytes of ram\n", path, lazy->size);
+        return -1;
+    }
+    lazy->src_fd = open(path, O_RDONLY);
+    if (lazy->src_fd < 0) {
+        perror("can not open lazy memory source");
+        return -1;
+    }
+    lazy->src_off = offset;
+    lazy->src_gpa = gpa;
+    lazy->src_len = len;
+    return 0;
+}
+
+/*fill [page, page + n), from the file or with zero pages. a partial fill (EAGAIN) goes on
+ *from where the kernel stopped, only pages that are really there are marked populated*/
+static int lazy_fill(struct lazy_mem *lazy, unsigned long page, unsigned long n, int from_file) {
+    __u64 gpa = (__u64)page * LAZY_PAGE_SIZE;
+    size_t len = n * LAZY_PAGE_SIZE;
+    size_t done = 0;
+
+    if (from_file) {
+        memset(lazy->buf, 0, len);
+        if (pread(lazy->src_fd, lazy->buf, len, lazy->src_off + (gpa - lazy->src_gpa)) < 0) {
+            perror("can not read lazy memory source");
+            return -1;
+        }
+    }
+    while (done < len) {
+        __s64 filled;
+        int ret;
+
+        if (from_file) {
+            struct uffdio_copy copy = { .dst = (unsigned long)lazy->ram + gpa + done,
+                                        .src = (unsigned long)lazy->buf + done, .len = len - done };
+            ret = ioctl(lazy->uffd, UFFDIO_COPY, &copy);
+            filled = copy.copy;
+        } else {
+            struct uffdio_zeropage zero = { .range = { .start = (unsigned long)lazy->ram + gpa + done, .len = len - done } };
+            ret = ioctl(lazy->uffd, UFFDIO_ZEROPAGE, &zero);
+            filled = zero.zeropage;
+        }
+        if (ret < 0 && errno == EEXIST) { /*this page is already there, wake whoever waits on it and go on*/
+            struct uffdio_range range = { .start = (unsigned long)lazy->ram + gpa + done, .len = LAZY_PAGE_SIZE };
+            if (ioctl(lazy->uffd, UFFDIO_WAKE, &range) < 0)
+                perror("UFFDIO_WAKE");
+            filled = LAZY_PAGE_SIZE;
+        } else {
+            if (ret == 0)
+                filled = len - done;
+            else if (errno != EAGAIN) {
+                perror("can not resolve guest ram fault");
+                return -1;
+            } else if (filled < 0) /*EAGAIN before the first page, try again*/
+                filled = 0;
+            if (from_file)
+                lazy->copied += filled / LAZY_PAGE_SIZE;
+            else
+                lazy->zeroed += filled / LAZY_PAGE_SIZE;
+        }
+        for (unsigned long i = page + done / LAZY_PAGE_SIZE; i < page + (done + filled) / LAZY_PAGE_SIZE; i++)
+            lazy->populated[i / 64] |= 1UL << (i % 64);
+        done += filled;
+    }
+    return 0;
+}
+
+/*serve one fault: the faulting page plus up to cur_window - 1 following pages of the same kind*/
+static int lazy_fault(struct lazy_mem *lazy, unsigned long page) {
+    unsigned long nr_pages = lazy->size / LAZY_PAGE_SIZE;
+    unsigned long src_first = lazy->src_gpa / LAZY_PAGE_SIZE;
+    unsigned long src_end = (lazy->src_gpa + lazy->src_len + LAZY_PAGE_SIZE - 1) / LAZY_PAGE_SIZE;
+    int from_file = lazy->src_fd >= 0 && page >= src_first && page < src_end;
+    unsigned long n = 1;
+
+    if (page_populated(lazy, page)) { /*two threads faulted on the same page, the first fill is enough*/
+        struct uffdio_range range = { .start = (unsigned long)lazy->ram + page * LAZY_PAGE_SIZE, .len = LAZY_PAGE_SIZE };
+        if (ioctl(lazy->uffd, UFFDIO_WAKE, &range) < 0)
+            perror("UFFDIO_WAKE");
+        return 0;
+    }
+
+    /*sequential access doubles the window, anything else starts over*/
+    if (page == lazy->next_page)
+        lazy->cur_window = lazy->cur_window * 2 > lazy->window ? lazy->window : lazy->cur_window * 2;
+    else
+        lazy->cur_window = 1;
+
+    while (n < (unsigned long)lazy->cur_window && page + n < nr_pages && !page_populated(lazy, page + n) &&
+           (lazy->src_fd >= 0 && page + n >= src_first && page + n < src_end) == from_file)
+        n++;
+    lazy->prefetched += n - 1;
+    lazy->next_page = page + n;
+    return lazy_fill(lazy, page, n, from_file);
+}
+
+static void *lazy_thread(void *data) {
+    struct lazy_mem *lazy = (struct lazy_mem *)data;
+    struct pollfd fds[2] = { { .fd = lazy->uffd, .events = POLLIN }, { .fd = lazy->stop_fd, .events = POLLIN } };
+
+    for (;;) {
+        struct uffd_msg msg;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("userfaultfd poll");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (read(lazy->uffd, &msg, sizeof(msg)) != sizeof(msg))
+            continue; /*EAGAIN, another wakeup raced us*/
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        __u64 begin = __rdtsc();
+        unsigned long page = (msg.arg.pagefault.address - (unsigned long)lazy->ram) / LAZY_PAGE_SIZE;
+        if (lazy_fault(lazy, page) < 0)
+            exit(1); /*the faulting thread would hang forever*/
+        lazy->faults++;
+        vcpu_hist_add(&lazy->latency, __rdtsc() - begin);
+    }
+    return NULL;
+}
+
+int lazy_mem_start(struct lazy_mem *lazy) {
+    lazy->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (lazy->stop_fd < 0) {
+        perror("can not create eventfd");
+        return -1;
+    }
+    if (pthread_create(&lazy->thread, NULL, lazy_thread, lazy) != 0) {
+        perror("can not create userfaultfd thread");
+        return -1;
+    }
+    return 0;
+}
+
+/*end the handler thread, guest ram must not be touched afterwards unless it is unmapped first*/
+void lazy_mem_stop(struct lazy_mem *lazy) {
+    __u64 one = 1;
+
+    if (lazy->stop_fd >= 0) {
+        if (write(lazy->stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("can not stop userfaultfd thread");
+        pthread_join(lazy->thread, NULL);
+        close(lazy->stop_fd);
+        lazy->stop_fd = -1;
+    }
+    if (lazy->uffd >= 0)
+        close(lazy->uffd);
+    if (lazy->src_fd >= 0)
+        close(lazy->src_fd);
+    lazy->uffd = lazy->src_fd = -1;
+    free(lazy->populated);
+    free(lazy->buf);
+    lazy->populated = NULL;
+    lazy->buf = NULL;
+}
+
+void lazy_mem_print(FILE *out, const struct lazy_mem *lazy) {
+    fprintf(out, "lazy memory: %llu faults, %llu pages copied, %llu zero pages, %llu prefetched, window %d\n",
+            (unsigned long long)lazy->faults, (unsigned long long)lazy->copied, (unsigned long long)lazy->zeroed,
+            (unsigned long long)lazy->prefetched, lazy->window);
+    vcpu_hist_text(out, "fault service (cycles)", &lazy->latency);
+}
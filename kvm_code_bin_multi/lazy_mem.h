@@ -0,0 +1,49 @@
+/*
+ * Demand paged guest ram through userfaultfd. Guest ram is registered for
+ * missing page faults, a handler thread fills every page the first time the
+ * guest (or KVM on its behalf) touches it: UFFDIO_COPY from the backing file
+ * (the image or the ram section of a snapshot) or UFFDIO_ZEROPAGE outside it.
+ * Sequential faults double the prefetch window up to its maximum, any other
+ * fault shrinks it back to one page.
+ * author: rkroshan
+ */
+
+#ifndef LAZY_MEM_H
+#define LAZY_MEM_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include "vcpu_stats.h"
+
+#define LAZY_PAGE_SIZE 4096
+
+struct lazy_mem {
+    int uffd; /*-1 when lazy memory is off*/
+    int stop_fd; /*eventfd that ends the handler thread*/
+    char *ram; /*registered range, guest physical address 0*/
+    size_t size;
+    int src_fd; /*backing file, -1 for all zero ram*/
+    off_t src_off; /*file offset of src_gpa*/
+    __u64 src_gpa, src_len; /*guest range backed by the file, the rest reads zero*/
+    unsigned long *populated; /*pages already filled, only the handler thread touches it*/
+    char *buf; /*staging buffer of window pages for UFFDIO_COPY*/
+    int window; /*prefetch window maximum in pages*/
+    int cur_window; /*current window, grows on sequential faults*/
+    unsigned long next_page; /*page right after the last filled range*/
+    pthread_t thread;
+    /*stats, written by the handler thread, read after lazy_mem_stop()*/
+    __u64 faults; /*page faults served*/
+    __u64 copied; /*pages filled from the file*/
+    __u64 zeroed; /*pages mapped to the zero page*/
+    __u64 prefetched; /*pages filled beyond the faulting one*/
+    struct vcpu_hist latency; /*cycles from reading the fault to waking the faulting thread*/
+};
+
+int lazy_mem_init(struct lazy_mem *lazy, void *ram, size_t size, int window);
+int lazy_mem_source(struct lazy_mem *lazy, const char *path, off_t offset, __u64 gpa, __u64 len);
+int lazy_mem_start(struct lazy_mem *lazy);
+void lazy_mem_stop(struct lazy_mem *lazy);
+void lazy_mem_print(FILE *out, const struct lazy_mem *lazy);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Lock-free single producer / single consumer rings for guest output.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "out_ring.h"
+
+/*allocate a zeroed, cache line aligned ring*/
+struct out_ring *out_ring_alloc(void) {
+    struct out_ring *ring = aligned_alloc(64, sizeof(struct out_ring));
+
+    if (ring == NULL) {
+        perror("can not allocate out ring");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct out_ring));
+    return ring;
+}
+
+void out_ring_free(struct out_ring *ring) {
+    free(ring);
+}
+
+/*write the staged records to the log file*/
+static void out_writer_flush(struct out_writer *writer) {
+    size_t off = 0;
+
+    while (off < writer->len) {
+        ssize_t ret = write(writer->fd, writer->buf + off, writer->len - off);
+        if (ret < 0) {
+            perror("can not write out log");
+            break;
+        }
+        off += ret;
+    }
+    writer->len = 0;
+}
+
+/*consumer side, move every published record of one ring into the staging buffer*/
+static unsigned long out_writer_drain(struct out_writer *writer, struct out_ring *ring) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long count = head - tail;
+
+    while (tail != head) {
+        if (writer->len + sizeof(struct out_record) > OUT_WRITER_BUF)
+            out_writer_flush(writer);
+        memcpy(writer->buf + writer->len, &ring->records[tail & (OUT_RING_SIZE - 1)], sizeof(struct out_record));
+        writer->len += sizeof(struct out_record);
+        tail++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release); /*give the slots back to the producer*/
+    return count;
+}
+
+static void *out_writer_thread(void *data) {
+    struct out_writer *writer = (struct out_writer *)data;
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = 1000000L }; /*1ms*/
+
+    while (1) {
+        int stop = atomic_load(&writer->stop); /*read before draining so nothing pushed before stop is missed*/
+        unsigned long count = 0;
+
+        for (int i = 0; i < writer->nr_rings; i++)
+            count += out_writer_drain(writer, writer->rings[i]);
+        writer->written += count;
+
+        if (stop)
+            break;
+        if (count == 0) { /*nothing to do, flush what we have and back off*/
+            out_writer_flush(writer);
+            nanosleep(&idle, NULL);
+        }
+    }
+    out_writer_flush(writer);
+    return NULL;
+}
+
+/*open the log file and start draining the rings*/
+int out_writer_start(struct out_writer *writer, const char *path, struct out_ring **rings, int nr_rings) {
+    memset(writer, 0, sizeof(struct out_writer));
+    writer->rings = rings;
+    writer->nr_rings = nr_rings;
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (writer->fd < 0) {
+        perror("can not open out log");
+        return -1;
+    }
+
+    writer->buf = malloc(OUT_WRITER_BUF);
+    if (writer->buf == NULL) {
+        perror("can not allocate out log buffer");
+        close(writer->fd);
+        return -1;
+    }
+
+    if (pthread_create(&writer->thread, NULL, out_writer_thread, writer) != 0) {
+        perror("can not create writer thread");
+        free(writer->buf);
+        close(writer->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*stop the writer once every producer is done, the last pass drains what is left*/
+void out_writer_stop(struct out_writer *writer) {
+    unsigned long dropped = 0;
+
+    atomic_store(&writer->stop, 1);
+    pthread_join(writer->thread, NULL);
+    for (int i = 0; i < writer->nr_rings; i++)
+        dropped += atomic_load(&writer->rings[i]->dropped);
+    printf("out log: %lu records written, %lu dropped\n", writer->written, dropped);
+    free(writer->buf);
+    close(writer->fd);
+}
@@ -0,0 +1,72 @@
+/*
+ * Lock-free single producer / single consumer rings for guest output.
+ * Every vcpu owns one ring and pushes from its exit handler, one writer
+ * thread drains all of them into a log file.
+ * author: rkroshan
+ */
+
+#ifndef OUT_RING_H
+#define OUT_RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/types.h>
+#include <x86intrin.h>
+
+#define OUT_RING_SIZE 4096 /*records per ring, must be a power of two*/
+#define OUT_WRITER_BUF (1 << 20) /*writer flushes to the log file in chunks of this size*/
+#define OUT_VCPU_NONE 0xff /*vcpu_id of records whose writer is unknown (coalesced ring)*/
+
+/*fixed size binary record as it lands in the log file*/
+struct out_record {
+    __u64 tsc; /*rdtsc when the exit handler saw the value*/
+    __u32 data; /*value written by the guest*/
+    __u16 port; /*io port*/
+    __u8 size; /*access size in bytes*/
+    __u8 vcpu_id; /*vcpu that wrote it or OUT_VCPU_NONE*/
+};
+
+struct out_ring {
+    _Alignas(64) atomic_uint head; /*next slot the producer fills, only the producer writes it*/
+    _Alignas(64) atomic_uint tail; /*next slot the consumer reads, only the consumer writes it*/
+    _Alignas(64) atomic_ulong dropped; /*records lost because the ring was full*/
+    struct out_record records[OUT_RING_SIZE];
+};
+
+struct out_writer {
+    pthread_t thread; /*writer thread*/
+    int fd; /*log file*/
+    char *buf; /*staging buffer of OUT_WRITER_BUF bytes*/
+    size_t len; /*bytes staged in buf*/
+    struct out_ring **rings; /*rings to drain*/
+    int nr_rings; /*number of rings*/
+    atomic_int stop; /*ask the writer to drain one last time and exit*/
+    unsigned long written; /*records written to the log*/
+};
+
+/*producer side, never blocks: a full ring drops the record so the vcpu goes back to KVM_RUN*/
+static inline int out_ring_push(struct out_ring *ring, __u16 port, __u8 size, __u32 data, __u8 vcpu_id) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == OUT_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    struct out_record *rec = &ring->records[head & (OUT_RING_SIZE - 1)];
+    rec->tsc = __rdtsc();
+    rec->data = data;
+    rec->port = port;
+    rec->size = size;
+    rec->vcpu_id = vcpu_id;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release); /*publish the record*/
+    return 0;
+}
+
+struct out_ring *out_ring_alloc(void);
+void out_ring_free(struct out_ring *ring);
+int out_writer_start(struct out_writer *writer, const char *path, struct out_ring **rings, int nr_rings);
+void out_writer_stop(struct out_writer *writer);
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * vcpu thread pinning and numa placement of vcpu state and guest ram.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+
+#define PLACEMENT_MAX_NODES 64
+
+/*cpu order used by automatic pinning*/
+struct cpu_topo {
+    int cpu;
+    int node; /*numa node*/
+    int package; /*socket*/
+    int core; /*core id inside the package*/
+    int thread; /*0 for the first hyperthread of a core, 1 for its sibling...*/
+};
+
+/*parse a kernel style cpu/node list such as "0-3,8,10-11", returns the number of entries*/
+int placement_parse_list(const char *list, int *out, int max) {
+    int n = 0;
+    const char *p = list;
+
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        for (long i = first; i <= last && n < max; i++)
+            out[n++] = i;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static int read_sysfs_list(const char *path, int *out, int max) {
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return -1;
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return placement_parse_list(buf, out, max);
+}
+
+static int read_sysfs_int(const char *path) {
+    int val = -1;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%d", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+/*numa node of a cpu, 0 when the machine has no numa information*/
+int placement_cpu_node(int cpu) {
+    int nodes[PLACEMENT_MAX_NODES], cpus[PLACEMENT_MAX_CPUS];
+    int nr_nodes = read_sysfs_list("/sys/devices/system/node/online", nodes, PLACEMENT_MAX_NODES);
+
+    for (int i = 0; i < nr_nodes; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+        int nr_cpus = read_sysfs_list(path, cpus, PLACEMENT_MAX_CPUS);
+        for (int j = 0; j < nr_cpus; j++) {
+            if (cpus[j] == cpu)
+                return nodes[i];
+        }
+    }
+    return 0;
+}
+
+static int cmp_topo(const void *a, const void *b) {
+    const struct cpu_topo *x = a, *y = b;
+
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->thread != y->thread)
+        return x->thread - y->thread;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/*online cpus ordered so the first ones are distinct physical cores of the lowest node*/
+static int placement_auto_order(int *order, int max) {
+    static struct cpu_topo topo[PLACEMENT_MAX_CPUS];
+    int online[PLACEMENT_MAX_CPUS];
+    int nr = read_sysfs_list("/sys/devices/system/cpu/online", online, PLACEMENT_MAX_CPUS);
+
+    for (int i = 0; i < nr; i++) {
+        char path[128];
+        int siblings[PLACEMENT_MAX_CPUS];
+
+        topo[i].cpu = online[i];
+        topo[i].node = placement_cpu_node(online[i]);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", online[i]);
+        topo[i].package = read_sysfs_int(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", online[i]);
+        topo[i].core = read_sysfs_int(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", online[i]);
+        int nr_siblings = read_sysfs_list(path, siblings, PLACEMENT_MAX_CPUS);
+        topo[i].thread = 0;
+        for (int j = 0; j < nr_siblings && siblings[j] != online[i]; j++)
+            topo[i].thread++;
+    }
+    qsort(topo, nr, sizeof(struct cpu_topo), cmp_topo);
+    for (int i = 0; i < nr && i < max; i++)
+        order[i] = topo[i].cpu;
+    return nr < max ? nr : max;
+}
+
+/*fill cpus[] with the host cpu of every vcpu, -1 when it is not pinned
+ *spec is NULL (no pinning), "auto" (topology order) or a cpu list used round robin*/
+int placement_vcpu_cpus(const char *spec, int *cpus, int nr_vcpus) {
+    int list[PLACEMENT_MAX_CPUS];
+    int nr = 0;
+
+    for (int i = 0; i < nr_vcpus; i++)
+        cpus[i] = -1;
+    if (spec == NULL)
+        return 0;
+
+    if (strcmp(spec, "auto") == 0)
+        nr = placement_auto_order(list, PLACEMENT_MAX_CPUS);
+    else
+        nr = placement_parse_list(spec, list, PLACEMENT_MAX_CPUS);
+    if (nr <= 0) {
+        fprintf(stderr, "bad cpu list: %s\n", spec);
+        return -1;
+    }
+
+    for (int i = 0; i < nr_vcpus; i++)
+        cpus[i] = list[i % nr];
+    return 0;
+}
+
+static long sys_mbind(void *addr, unsigned long len, int mode, const unsigned long *nodemask, unsigned long maxnode) {
+    return syscall(SYS_mbind, addr, len, mode, nodemask, maxnode, 0);
+}
+
+/*bind a page aligned range to one node before it is touched*/
+int placement_bind(void *addr, size_t len, int node) {
+    unsigned long mask;
+
+    if (node < 0 || node >= PLACEMENT_MAX_NODES)
+        return -1;
+    mask = 1UL << node;
+    if (sys_mbind(addr, len, MPOL_BIND, &mask, PLACEMENT_MAX_NODES) < 0) {
+        perror("mbind");
+        return -1;
+    }
+    return 0;
+}
+
+/*the N of "bind:N" and "preferred:N": a whole number below PLACEMENT_MAX_NODES naming an
+ *online node (only 0 when the machine has no numa information), -1 otherwise*/
+static int placement_policy_node(const char *arg) {
+    int nodes[PLACEMENT_MAX_NODES];
+    int nr = read_sysfs_list("/sys/devices/system/node/online", nodes, PLACEMENT_MAX_NODES);
+    char *end;
+    long node = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || node < 0 || node >= PLACEMENT_MAX_NODES)
+        return -1;
+    if (nr <= 0)
+        return node == 0 ? 0 : -1;
+    for (int i = 0; i < nr; i++) {
+        if (nodes[i] == node)
+            return node;
+    }
+    return -1;
+}
+
+/*0 when placement_mem_policy() takes policy, so a bad -m is refused before any vm exists*/
+int placement_check_policy(const char *policy) {
+    const char *arg = NULL;
+
+    if (strcmp(policy, "interleave") == 0 || strcmp(policy, "local") == 0)
+        return 0;
+    if (strncmp(policy, "bind:", 5) == 0)
+        arg = policy + 5;
+    else if (strncmp(policy, "preferred:", 10) == 0)
+        arg = policy + 10;
+    if (arg == NULL) {
+        fprintf(stderr, "unknown memory policy: %s\n", policy);
+        return -1;
+    }
+    if (placement_policy_node(arg) < 0) {
+        fprintf(stderr, "memory policy %s: N has to be an online numa node from 0 to %d\n", policy,
+                PLACEMENT_MAX_NODES - 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*apply a guest ram policy: "interleave" over all online nodes, "bind:N", "preferred:N"
+ *or "local" which binds to local_node (the node of the first pinned vcpu)*/
+int placement_mem_policy(void *addr, size_t len, const char *policy, int local_node) {
+    unsigned long mask = 0;
+    int mode;
+
+    if (placement_check_policy(policy) < 0)
+        return -1;
+    if (strcmp(policy, "interleave") == 0) {
+        int nodes[PLACEMENT_MAX_NODES];
+        int nr = read_sysfs_list("/sys/devices/system/node/online", nodes, PLACEMENT_MAX_NODES);
+        for (int i = 0; i < nr; i++)
+            mask |= 1UL << nodes[i];
+        if (nr <= 0)
+            mask = 1;
+        mode = MPOL_INTERLEAVE;
+    } else if (strncmp(policy, "bind:", 5) == 0) {
+        mask = 1UL << placement_policy_node(policy + 5);
+        mode = MPOL_BIND;
+    } else if (strncmp(policy, "preferred:", 10) == 0) {
+        mask = 1UL << placement_policy_node(policy + 10);
+        mode = MPOL_PREFERRED;
+    } else { /*local*/
+        mask = 1UL << (local_node < 0 ? 0 : local_node);
+        mode = MPOL_BIND;
+    }
+
+    if (sys_mbind(addr, len, mode, &mask, PLACEMENT_MAX_NODES) < 0) {
+        perror("mbind guest ram");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * vcpu thread pinning and numa placement of vcpu state and guest ram.
+ * Topology comes from sysfs and memory policy goes through the raw mbind
+ * syscall, so there is no libnuma dependency.
+ * author: rkroshan
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+
+#define PLACEMENT_MAX_CPUS 1024
+
+int placement_parse_list(const char *list, int *out, int max);
+int placement_cpu_node(int cpu);
+int placement_vcpu_cpus(const char *spec, int *cpus, int nr_vcpus);
+int placement_bind(void *addr, size_t len, int node);
+int placement_check_policy(const char *policy);
+int placement_mem_policy(void *addr, size_t len, const char *policy, int local_node);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Record/replay of device exits, see replay.h.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "replay.h"
+
+/*"record:dir" or "replay:dir", the directory goes to *dir*/
+int replay_mode(const char *arg, const char **dir) {
+    if (strncmp(arg, "record:", 7) == 0 && arg[7]) {
+        *dir = arg + 7;
+        return REPLAY_RECORD;
+    }
+    if (strncmp(arg, "replay:", 7) == 0 && arg[7]) {
+        *dir = arg + 7;
+        return REPLAY_PLAY;
+    }
+    fprintf(stderr, "unknown replay mode: %s, record:dir or replay:dir\n", arg);
+    return -1;
+}
+
+int replay_open(struct replay *rp, int mode, const char *dir, int vcpu_id) {
+    struct replay_header hdr;
+    char path[4096];
+
+    memset(rp, 0, sizeof(struct replay));
+    snprintf(path, sizeof(path), "%s/vcpu%d.replay", dir, vcpu_id);
+    rp->file = fopen(path, mode == REPLAY_RECORD ? "w" : "r");
+    if (rp->file == NULL) {
+        perror(mode == REPLAY_RECORD ? "can not create replay log" : "can not open replay log");
+        return -1;
+    }
+    rp->buf = malloc(REPLAY_BUF);
+    if (rp->buf == NULL) {
+        perror("can not allocate replay buffer");
+        fclose(rp->file);
+        return -1;
+    }
+    setvbuf(rp->file, rp->buf, _IOFBF, REPLAY_BUF);
+
+    if (mode == REPLAY_RECORD) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, REPLAY_MAGIC, sizeof(hdr.magic));
+        hdr.vcpu_id = vcpu_id;
+        hdr.record_size = sizeof(struct replay_record);
+        fwrite(&hdr, sizeof(hdr), 1, rp->file);
+    } else if (fread(&hdr, sizeof(hdr), 1, rp->file) != 1 || memcmp(hdr.magic, REPLAY_MAGIC, sizeof(hdr.magic)) != 0 ||
+               hdr.record_size != sizeof(struct replay_record) || hdr.vcpu_id != (__u32)vcpu_id) {
+        fprintf(stderr, "%s: not a replay log of vcpu %d\n", path, vcpu_id);
+        fclose(rp->file);
+        free(rp->buf);
+        return -1;
+    }
+    rp->mode = mode;
+    rp->vcpu_id = vcpu_id;
+    return 0;
+}
+
+/*a short write shows up here, at the end of the recording*/
+int replay_close(struct replay *rp) {
+    int ret = 0;
+
+    if (rp->mode == REPLAY_OFF)
+        return 0;
+    if (ferror(rp->file) || fclose(rp->file) != 0) {
+        fprintf(stderr, "replay log of vcpu %d: write error\n", rp->vcpu_id);
+        ret = -1;
+    }
+    free(rp->buf);
+    rp->mode = REPLAY_OFF;
+    return ret;
+}
+
+/*the device side of an io or mmio exit as the guest sees it*/
+static int replay_exit(const struct kvm_run *run, struct replay_record *rec, __u8 **data) {
+    memset(rec, 0, sizeof(struct replay_record));
+    if (run->exit_reason == KVM_EXIT_IO) {
+        rec->addr = run->io.port;
+        rec->len = run->io.size * run->io.count;
+        rec->flags = run->io.direction == KVM_EXIT_IO_OUT ? REPLAY_WRITE : 0;
+        *data = (__u8 *)run + run->io.data_offset;
+    } else if (run->exit_reason == KVM_EXIT_MMIO) {
+        rec->addr = run->mmio.phys_addr;
+        rec->len = run->mmio.len;
+        rec->flags = REPLAY_MMIO | (run->mmio.is_write ? REPLAY_WRITE : 0);
+        *data = (__u8 *)run->mmio.data;
+    } else {
+        return 0;
+    }
+    if (rec->len > REPLAY_MAX_DATA)
+        errx(1, "replay: %u bytes of io data, at most %d", rec->len, REPLAY_MAX_DATA);
+    return 1;
+}
+
+/*call for every exit once the handler ran, io and mmio exits go to the log*/
+void replay_record_exit(struct replay *rp, struct kvm_run *run) {
+    struct replay_record rec;
+    __u8 *data;
+
+    rp->seq++;
+    if (!replay_exit(run, &rec, &data))
+        return;
+    rec.seq_delta = rp->seq - rp->last_seq;
+    rp->last_seq = rp->seq;
+    fwrite_unlocked(&rec, sizeof(rec), 1, rp->file);
+    fwrite_unlocked(data, rec.len, 1, rp->file);
+    rp->records++;
+}
+
+/*call for every exit instead of the handler: 1 when it was an io or mmio exit and is done
+ *(a read has its recorded value), 0 for any other exit, -1 once the log is through*/
+int replay_play_exit(struct replay *rp, struct kvm_run *run) {
+    struct replay_record rec, want;
+    __u8 want_data[REPLAY_MAX_DATA];
+    __u8 *data;
+
+    rp->seq++;
+    if (!replay_exit(run, &rec, &data))
+        return 0;
+    if (fread_unlocked(&want, sizeof(want), 1, rp->file) != 1) {
+        rp->ended = 1;
+        return -1;
+    }
+    if (want.len > REPLAY_MAX_DATA || (want.len && fread_unlocked(want_data, want.len, 1, rp->file) != 1))
+        errx(1, "replay log of vcpu %d is cut short or corrupt at record %llu", rp->vcpu_id, rp->records);
+    if (rec.flags != want.flags || rec.addr != want.addr || rec.len != want.len)
+        errx(1, "replay of vcpu %d diverged at record %llu (exit %llu): %s %s 0x%llx/%u, the log has %s %s 0x%llx/%u",
+             rp->vcpu_id, rp->records, rp->seq, rec.flags & REPLAY_MMIO ? "mmio" : "io",
+             rec.flags & REPLAY_WRITE ? "write" : "read", (unsigned long long)rec.addr, rec.len,
+             want.flags & REPLAY_MMIO ? "mmio" : "io", want.flags & REPLAY_WRITE ? "write" : "read",
+             (unsigned long long)want.addr, want.len);
+    rp->last_seq += want.seq_delta;
+    if (rp->last_seq != rp->seq) /*other exits came and went in between, e.g. a kick*/
+        rp->seq_diffs++;
+    rp->seq = rp->last_seq;
+    if (!(rec.flags & REPLAY_WRITE))
+        memcpy(data, want_data, rec.len);
+    else if (memcmp(data, want_data, rec.len) != 0)
+        rp->value_diffs++;
+    rp->records++;
+    return 1;
+}
+
+void replay_print(FILE *out, const struct replay *rp, double secs) {
+    if (rp->mode == REPLAY_RECORD)
+        fprintf(out, "replay: vcpu %d recorded %llu io/mmio exits of %llu in %.2f s, %.0f exits/sec\n", rp->vcpu_id,
+                rp->records, rp->seq, secs, rp->records / secs);
+    else
+        fprintf(out, "replay: vcpu %d replayed %llu io/mmio exits%s in %.2f s, %.0f exits/sec, %llu written values and %llu "
+                "sequence numbers differed\n", rp->vcpu_id, rp->records, rp->ended ? " (whole log)" : "", secs,
+                rp->records / secs, rp->value_diffs, rp->seq_diffs);
+}
@@ -0,0 +1,69 @@
+/*
+ * Record/replay of device exits: in record mode every vcpu streams the
+ * KVM_EXIT_IO and KVM_EXIT_MMIO exits it handled (exit sequence number, port or
+ * address, direction and every byte of the data after the handler ran, so reads
+ * carry what the device answered, string io included) into <dir>/vcpu<id>.replay. In replay mode the vcpu
+ * loop takes the same exits from that file instead of the device code: reads get
+ * the recorded value, writes are only checked against it, the vcpu stops at the
+ * end of its log. A vm that diverges (another port, address or direction) stops
+ * with the exit that differs. Exits the guest never makes (coalesced rings,
+ * ioeventfd, in kernel irqchip) are not part of the log.
+ * author: rkroshan
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <linux/types.h>
+#include <linux/kvm.h>
+
+#define REPLAY_MAGIC "KVMRPL2" /*8 bytes with the nul*/
+#define REPLAY_BUF (1 << 20) /*stdio buffer per vcpu file*/
+#define REPLAY_MAX_DATA 4096 /*string io fills at most the pio page of kvm_run*/
+
+#define REPLAY_OFF    0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY   2
+
+#define REPLAY_MMIO  1 /*flags: KVM_EXIT_MMIO, KVM_EXIT_IO otherwise*/
+#define REPLAY_WRITE 2 /*flags: out or mmio store*/
+
+/*start of every file*/
+struct replay_header {
+    char magic[8]; /*REPLAY_MAGIC*/
+    __u32 vcpu_id;
+    __u32 record_size; /*sizeof(struct replay_record)*/
+};
+
+/*one handled exit, 24 bytes followed by its len bytes of data (written, or read back by the device)*/
+struct replay_record {
+    __u64 addr; /*port or guest physical address*/
+    __u32 seq_delta; /*exits of this vcpu since the previous record, this one included*/
+    __u32 len; /*access size times the count of string io, at most REPLAY_MAX_DATA*/
+    __u8 flags; /*REPLAY_MMIO, REPLAY_WRITE*/
+    __u8 pad[7];
+};
+
+/*a vcpu log, only its vcpu thread touches it*/
+struct replay {
+    int mode; /*REPLAY_RECORD or REPLAY_PLAY, REPLAY_OFF while off*/
+    int vcpu_id;
+    FILE *file;
+    char *buf; /*REPLAY_BUF bytes of stdio buffer*/
+    __u64 seq; /*exits of this vcpu so far*/
+    __u64 last_seq; /*seq of the last record*/
+    __u64 records; /*records written or replayed*/
+    __u64 value_diffs; /*replayed writes with another value than recorded*/
+    __u64 seq_diffs; /*replayed exits at another sequence number than recorded*/
+    int ended; /*replay: the log is through*/
+};
+
+int replay_mode(const char *arg, const char **dir);
+int replay_open(struct replay *rp, int mode, const char *dir, int vcpu_id);
+int replay_close(struct replay *rp);
+void replay_record_exit(struct replay *rp, struct kvm_run *run);
+int replay_play_exit(struct replay *rp, struct kvm_run *run);
+void replay_print(FILE *out, const struct replay *rp, double secs);
+
+#endif
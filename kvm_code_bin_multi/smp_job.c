@@ -0,0 +1,65 @@
+/*
+ * SMP job mode: a checksum over guest ram split across the vcpus.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "kvm_code_bin_multi.h"
+#include "smp_job.h"
+
+/*fill the buffer with a xorshift sequence the guest can not guess and sum it on the host*/
+int smp_job_init(struct smp_job *job, struct kvm *kvm, __u64 buf_len, int nr_vcpus) {
+    __u64 *buf = (__u64 *)((char *)kvm->ram_start + SMP_JOB_BUF);
+    __u64 x = 0x9e3779b97f4a7c15ULL;
+
+    memset(job, 0, sizeof(struct smp_job));
+    buf_len &= ~(__u64)(SMP_JOB_LINE - 1);
+    if (buf_len == 0 || SMP_JOB_BUF + buf_len > kvm->ram_size || nr_vcpus * SMP_JOB_LINE > 0x1000) {
+        fprintf(stderr, "job buffer of %llu bytes does not fit in %llu bytes of ram\n", buf_len, kvm->ram_size);
+        return -1;
+    }
+    job->buf_len = buf_len;
+    job->nr_vcpus = nr_vcpus;
+    for (__u64 i = 0; i < buf_len / 8; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x;
+        job->expected += x;
+    }
+    memset((char *)kvm->ram_start + SMP_JOB_RESULTS, 0, nr_vcpus * SMP_JOB_LINE);
+    return 0;
+}
+
+/*vcpu_id in %rdi, its partition in %rsi (base) and %rdx (bytes), its result line in %rcx.
+ *partitions are whole lines, the last vcpu takes what is left*/
+void smp_job_vcpu_regs(const struct smp_job *job, int vcpu_id, struct kvm_regs *regs) {
+    __u64 chunk = job->buf_len / job->nr_vcpus & ~(__u64)(SMP_JOB_LINE - 1);
+
+    regs->rdi = vcpu_id;
+    regs->rsi = SMP_JOB_BUF + vcpu_id * chunk;
+    regs->rdx = vcpu_id == job->nr_vcpus - 1 ? job->buf_len - vcpu_id * chunk : chunk;
+    regs->rcx = SMP_JOB_RESULTS + vcpu_id * SMP_JOB_LINE;
+}
+
+/*after every vcpu halted: combine the result lines, -1 when one is missing or the sum is wrong*/
+int smp_job_collect(struct smp_job *job, struct kvm *kvm) {
+    job->sum = 0;
+    job->done = 0;
+    for (int i = 0; i < job->nr_vcpus; i++) {
+        struct smp_job_result *res =
+            (struct smp_job_result *)((char *)kvm->ram_start + SMP_JOB_RESULTS + i * SMP_JOB_LINE);
+        if (!res->done || res->vcpu_id != (__u64)i)
+            continue;
+        job->sum += res->sum;
+        job->done++;
+    }
+    return job->done == job->nr_vcpus && job->sum == job->expected ? 0 : -1;
+}
+
+void smp_job_print(FILE *out, const struct smp_job *job, double secs) {
+    fprintf(out, "job: %d vcpus summed %llu MB in %.3f s, %.1f MB/sec, checksum 0x%016llx %s (%d of %d vcpus reported)\n",
+            job->nr_vcpus, job->buf_len >> 20, secs, job->buf_len / 1e6 / secs, job->sum,
+            job->sum == job->expected && job->done == job->nr_vcpus ? "ok" : "WRONG", job->done, job->nr_vcpus);
+}
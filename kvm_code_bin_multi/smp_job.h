@@ -0,0 +1,46 @@
+/*
+ * SMP job mode: every vcpu checksums its own partition of a buffer in guest
+ * ram. The partition reaches the guest in the reset registers (kvm_reset_vcpu()
+ * and kvm_reset_vcpu_long() ask smp_job_vcpu_regs()), the result goes to a
+ * cache line of its own in the result area and the vcpu halts. The host reads
+ * the results from guest ram once every vcpu has halted, the data itself never
+ * needs an exit.
+ * author: rkroshan
+ */
+
+#ifndef SMP_JOB_H
+#define SMP_JOB_H
+
+#include <stdio.h>
+#include <linux/types.h>
+#include <linux/kvm.h>
+
+#define SMP_JOB_FILE "job64.bin" /*the checksum guest, long mode*/
+#define SMP_JOB_RESULTS 0x18000 /*guest physical result area (IMAGE_START + 0x8000), one line per vcpu*/
+#define SMP_JOB_LINE 64
+#define SMP_JOB_BUF 0x100000 /*the buffer starts at 1MB*/
+
+struct kvm;
+
+/*what the guest leaves in its line of the result area, job64.S writes it*/
+struct smp_job_result {
+    __u64 sum; /*64 bit sum of the qwords of its partition*/
+    __u64 vcpu_id; /*%rdi as handed over, to catch a vcpu writing the wrong line*/
+    __u64 done; /*1 once sum is final*/
+    __u64 pad[5];
+};
+
+struct smp_job {
+    __u64 buf_len; /*bytes at SMP_JOB_BUF, a multiple of SMP_JOB_LINE*/
+    int nr_vcpus;
+    __u64 expected; /*sum over the whole buffer computed by the host*/
+    __u64 sum; /*sum of the vcpu results*/
+    int done; /*vcpus that reported*/
+};
+
+int smp_job_init(struct smp_job *job, struct kvm *kvm, __u64 buf_len, int nr_vcpus);
+void smp_job_vcpu_regs(const struct smp_job *job, int vcpu_id, struct kvm_regs *regs);
+int smp_job_collect(struct smp_job *job, struct kvm *kvm);
+void smp_job_print(FILE *out, const struct smp_job *job, double secs);
+
+#endif
@@ -0,0 +1,583 @@
+/*
+ * Whole vm snapshot and restore.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "kvm_code_bin_multi.h"
+#include "snapshot.h"
+
+/*struct kvm_msrs with room for the entries*/
+struct snapshot_msrs {
+    struct kvm_msrs hdr;
+    struct kvm_msr_entry entries[SNAPSHOT_MAX_MSRS];
+};
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, p, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int read_header(int fd, struct snapshot_header *hdr, const char *path) {
+    if (pread(fd, hdr, sizeof(struct snapshot_header), 0) != sizeof(struct snapshot_header) ||
+        memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        return -1;
+    }
+    if (hdr->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s: snapshot version %u, expected %u\n", path, hdr->version, SNAPSHOT_VERSION);
+        return -1;
+    }
+    if (hdr->vcpu_size != sizeof(struct snapshot_vcpu)) { /*same version, built against other kvm headers*/
+        fprintf(stderr, "%s: vcpu records of %u bytes, expected %zu\n", path, hdr->vcpu_size, sizeof(struct snapshot_vcpu));
+        return -1;
+    }
+    return 0;
+}
+
+/*file offset of the irqchip record, right after the vcpu records*/
+static off_t irqchip_offset(const struct snapshot_header *hdr) {
+    return sizeof(struct snapshot_header) + hdr->nr_vcpus * sizeof(struct snapshot_vcpu);
+}
+
+static int save_irqchip(struct kvm *kvm, struct snapshot_irqchip *rec) {
+    memset(rec, 0, sizeof(struct snapshot_irqchip));
+    for (int i = 0; i < 3; i++) {
+        rec->chips[i].chip_id = i; /*KVM_IRQCHIP_PIC_MASTER, KVM_IRQCHIP_PIC_SLAVE, KVM_IRQCHIP_IOAPIC*/
+        if (ioctl(kvm->vm_fd, KVM_GET_IRQCHIP, &rec->chips[i]) < 0) {
+            perror("can not get irqchip state");
+            return -1;
+        }
+    }
+    if (opts.pit && ioctl(kvm->vm_fd, KVM_GET_PIT2, &rec->pit) < 0) {
+        perror("can not get pit state");
+        return -1;
+    }
+    return 0;
+}
+
+/*the vm needs an irqchip of its own, it can not be added once the vcpus exist*/
+static int restore_irqchip(struct kvm *kvm, struct snapshot_irqchip *rec, __u32 flags, const char *path) {
+    if (!kvm->irqchip || ((flags & SNAPSHOT_PIT) && !opts.pit)) {
+        fprintf(stderr, "%s was taken with an in kernel irqchip%s, the vm has none\n", path,
+                flags & SNAPSHOT_PIT ? " and pit" : "");
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (ioctl(kvm->vm_fd, KVM_SET_IRQCHIP, &rec->chips[i]) < 0) {
+            perror("can not set irqchip state");
+            return -1;
+        }
+    }
+    if ((flags & SNAPSHOT_PIT) && ioctl(kvm->vm_fd, KVM_SET_PIT2, &rec->pit) < 0) {
+        perror("can not set pit state");
+        return -1;
+    }
+    return 0;
+}
+
+/*msrs KVM can save and restore, capped at SNAPSHOT_MAX_MSRS*/
+static int msr_index_list(int dev_fd, __u32 *indices) {
+    struct kvm_msr_list probe = { .nmsrs = 0 };
+    struct kvm_msr_list *list;
+    int nr;
+
+    /*the first call fails with E2BIG and says how many there are*/
+    if (ioctl(dev_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG) {
+        perror("can not get msr index list");
+        return -1;
+    }
+    list = malloc(sizeof(struct kvm_msr_list) + probe.nmsrs * sizeof(__u32));
+    if (list == NULL)
+        return -1;
+    list->nmsrs = probe.nmsrs;
+    if (ioctl(dev_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+        perror("can not get msr index list");
+        free(list);
+        return -1;
+    }
+    nr = list->nmsrs < SNAPSHOT_MAX_MSRS ? list->nmsrs : SNAPSHOT_MAX_MSRS;
+    if (list->nmsrs > SNAPSHOT_MAX_MSRS)
+        fprintf(stderr, "snapshot: only the first %d of %u msrs are saved\n", SNAPSHOT_MAX_MSRS, list->nmsrs);
+    memcpy(indices, list->indices, nr * sizeof(__u32));
+    free(list);
+    return nr;
+}
+
+/*KVM_GET_MSRS/KVM_SET_MSRS stop at the first msr they can not handle,
+ *skip it and go on with the rest. returns the number of entries handled*/
+static int msrs_ioctl(int vcpu_fd, unsigned long req, struct kvm_msr_entry *entries, int nr, struct kvm_msr_entry *done) {
+    static __thread struct snapshot_msrs buf;
+    int n = 0;
+
+    for (int i = 0; i < nr;) {
+        buf.hdr.nmsrs = nr - i;
+        memcpy(buf.entries, entries + i, (nr - i) * sizeof(struct kvm_msr_entry));
+        int ret = ioctl(vcpu_fd, req, &buf);
+        if (ret < 0)
+            return -1;
+        if (done)
+            memcpy(done + n, buf.entries, ret * sizeof(struct kvm_msr_entry));
+        n += ret;
+        i += ret + 1;
+    }
+    return n;
+}
+
+/*finish the exit the vcpu is stopped on (the second half of an in or out) without
+ *entering the guest again, so the saved registers are past that instruction*/
+void snapshot_quiesce_vcpu(struct vcpu *vcpu) {
+    vcpu->kvm_run->immediate_exit = 1;
+    if (ioctl(vcpu->vcpu_fd, KVM_RUN, 0) < 0 && errno != EINTR)
+        perror("can not complete pending exit");
+    vcpu->kvm_run->immediate_exit = 0;
+}
+
+static int save_vcpu(struct kvm *kvm, struct vcpu *vcpu, struct snapshot_vcpu *rec, const __u32 *msr_indices, int nr_msrs) {
+    struct kvm_msr_entry entries[SNAPSHOT_MAX_MSRS];
+    int fd = vcpu->vcpu_fd;
+
+    memset(rec, 0, sizeof(struct snapshot_vcpu));
+    if (ioctl(fd, KVM_GET_REGS, &rec->regs) < 0 || ioctl(fd, KVM_GET_SREGS, &rec->sregs) < 0 ||
+        ioctl(fd, KVM_GET_FPU, &rec->fpu) < 0 || ioctl(fd, KVM_GET_VCPU_EVENTS, &rec->events) < 0) {
+        perror("can not get vcpu state");
+        return -1;
+    }
+    if (ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) > 0 && ioctl(fd, KVM_GET_XSAVE, &rec->xsave) == 0)
+        rec->flags |= SNAPSHOT_XSAVE;
+    if (ioctl(kvm->dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0 && ioctl(fd, KVM_GET_XCRS, &rec->xcrs) == 0)
+        rec->flags |= SNAPSHOT_XCRS;
+    if (ioctl(fd, KVM_GET_LAPIC, &rec->lapic) == 0) /*fails unless the vm has an in kernel irqchip*/
+        rec->flags |= SNAPSHOT_LAPIC;
+
+    memset(entries, 0, sizeof(entries));
+    for (int i = 0; i < nr_msrs; i++)
+        entries[i].index = msr_indices[i];
+    int n = msrs_ioctl(fd, KVM_GET_MSRS, entries, nr_msrs, rec->msrs);
+    if (n < 0) {
+        perror("can not get msrs");
+        return -1;
+    }
+    rec->nmsrs = n;
+    return 0;
+}
+
+/*host address of what the guest sees at gpa, the image mapping covers part of ram in -i map mode*/
+static const char *gpa_src(struct kvm *kvm, __u64 gpa) {
+    size_t image_slot = (kvm->image_size + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+
+    if (kvm->image && gpa >= IMAGE_START && gpa < IMAGE_START + image_slot)
+        return (const char *)kvm->image + (gpa - IMAGE_START);
+    return (const char *)kvm->ram_start + gpa;
+}
+
+/*write the ram section, all zero pages are left as holes so untouched ram costs nothing*/
+static int save_ram(int fd, off_t off, struct kvm *kvm) {
+    static const char zero_page[SNAPSHOT_ALIGN];
+    size_t page = SNAPSHOT_ALIGN;
+
+    for (__u64 gpa = 0; gpa < kvm->ram_size; gpa += page) {
+        const char *src = gpa_src(kvm, gpa);
+
+        if (memcmp(src, zero_page, page) != 0 && pwrite_all(fd, src, page, off + gpa) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*save ram and every vcpu, the vcpu threads must have stopped and gone through snapshot_quiesce_vcpu()*/
+int snapshot_save(struct kvm *kvm, const char *path) {
+    __u32 msr_indices[SNAPSHOT_MAX_MSRS];
+    struct snapshot_header hdr;
+    struct snapshot_irqchip chip;
+    struct snapshot_vcpu *rec;
+    int nr_msrs, fd, ret = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.nr_vcpus = kvm->vcpu_number;
+    hdr.ram_size = kvm->ram_size;
+    hdr.vcpu_size = sizeof(struct snapshot_vcpu);
+    hdr.flags = (kvm->irqchip ? SNAPSHOT_IRQCHIP : 0) | (opts.pit ? SNAPSHOT_PIT : 0);
+    hdr.ram_offset = (irqchip_offset(&hdr) + (kvm->irqchip ? sizeof(struct snapshot_irqchip) : 0) + SNAPSHOT_ALIGN - 1) &
+                     ~(__u64)(SNAPSHOT_ALIGN - 1);
+
+    nr_msrs = msr_index_list(kvm->dev_fd, msr_indices);
+    if (nr_msrs < 0)
+        return -1;
+    if (opts.dirty_log) { /*everything is written below, later checkpoints start from here*/
+        dirty_log_sync(kvm);
+        dirty_log_clear(kvm);
+    }
+    rec = malloc(sizeof(struct snapshot_vcpu));
+    if (rec == NULL)
+        return -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("can not create snapshot file");
+        free(rec);
+        return -1;
+    }
+    if (ftruncate(fd, hdr.ram_offset + hdr.ram_size) < 0) {
+        perror("can not size snapshot file");
+        goto out;
+    }
+    if (pwrite_all(fd, &hdr, sizeof(hdr), 0) < 0)
+        goto write_fail;
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        if (save_vcpu(kvm, &kvm->vcpus[i], rec, msr_indices, nr_msrs) < 0)
+            goto out;
+        if (pwrite_all(fd, rec, sizeof(struct snapshot_vcpu), sizeof(hdr) + i * sizeof(struct snapshot_vcpu)) < 0)
+            goto write_fail;
+    }
+    if (kvm->irqchip) {
+        if (save_irqchip(kvm, &chip) < 0)
+            goto out;
+        if (pwrite_all(fd, &chip, sizeof(chip), irqchip_offset(&hdr)) < 0)
+            goto write_fail;
+    }
+    if (save_ram(fd, hdr.ram_offset, kvm) < 0)
+        goto write_fail;
+    ret = 0;
+    goto out;
+
+write_fail:
+    perror("can not write snapshot file");
+out:
+    close(fd);
+    free(rec);
+    return ret;
+}
+
+/*rewrite the vcpu records and the pages dirtied since the last checkpoint in a snapshot
+ *written by snapshot_save() for this vm, returns the pages written.
+ *the vcpus must be paused, the file is a complete snapshot again afterwards*/
+long snapshot_checkpoint(struct kvm *kvm, const char *path) {
+    __u32 msr_indices[SNAPSHOT_MAX_MSRS];
+    struct snapshot_header hdr;
+    struct snapshot_irqchip chip;
+    struct snapshot_vcpu *rec;
+    long written = 0;
+    int nr_msrs, fd;
+
+    if (!opts.dirty_log) {
+        fprintf(stderr, "incremental checkpoints need dirty tracking\n");
+        return -1;
+    }
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &hdr, path) < 0 || hdr.ram_size != kvm->ram_size || (int)hdr.nr_vcpus != kvm->vcpu_number ||
+        !(hdr.flags & SNAPSHOT_IRQCHIP) != !kvm->irqchip || !(hdr.flags & SNAPSHOT_PIT) != !opts.pit) {
+        fprintf(stderr, "%s does not belong to this vm\n", path);
+        close(fd);
+        return -1;
+    }
+    nr_msrs = msr_index_list(kvm->dev_fd, msr_indices);
+    rec = malloc(sizeof(struct snapshot_vcpu));
+    if (nr_msrs < 0 || rec == NULL) {
+        close(fd);
+        free(rec);
+        return -1;
+    }
+
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        if (save_vcpu(kvm, &kvm->vcpus[i], rec, msr_indices, nr_msrs) < 0 ||
+            pwrite_all(fd, rec, sizeof(struct snapshot_vcpu), sizeof(hdr) + i * sizeof(struct snapshot_vcpu)) < 0) {
+            written = -1;
+            goto out;
+        }
+    }
+    if (kvm->irqchip && (save_irqchip(kvm, &chip) < 0 || pwrite_all(fd, &chip, sizeof(chip), irqchip_offset(&hdr)) < 0)) {
+        written = -1;
+        goto out;
+    }
+
+    if (dirty_log_sync(kvm) < 0) {
+        written = -1;
+        goto out;
+    }
+    /*runs of dirty pages that are contiguous on the host go out in one pwrite*/
+    for (unsigned long page = 0; page < kvm->dirty.nr_pages;) {
+        if (!dirty_test(&kvm->dirty, page)) {
+            page++;
+            continue;
+        }
+        const char *src = gpa_src(kvm, (__u64)page * SNAPSHOT_ALIGN);
+        unsigned long n = 1;
+        while (page + n < kvm->dirty.nr_pages && dirty_test(&kvm->dirty, page + n) &&
+               gpa_src(kvm, (__u64)(page + n) * SNAPSHOT_ALIGN) == src + n * SNAPSHOT_ALIGN)
+            n++;
+        if (pwrite_all(fd, src, n * SNAPSHOT_ALIGN, hdr.ram_offset + (__u64)page * SNAPSHOT_ALIGN) < 0) {
+            perror("can not write snapshot file");
+            written = -1;
+            goto out;
+        }
+        written += n;
+        page += n;
+    }
+    dirty_log_clear(kvm);
+
+out:
+    close(fd);
+    free(rec);
+    return written;
+}
+
+/*SNAPSHOT_IRQCHIP and the like of a snapshot file, a restore creates the vm to match them*/
+int snapshot_flags(const char *path) {
+    struct snapshot_header hdr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &hdr, path) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return hdr.flags;
+}
+
+/*where the ram section of a snapshot file is, for restores that fill ram themselves*/
+int snapshot_ram_section(const char *path, off_t *offset, __u64 *size) {
+    struct snapshot_header hdr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &hdr, path) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *offset = hdr.ram_offset;
+    *size = hdr.ram_size;
+    return 0;
+}
+
+/*guest ram of a restore: the ram section of the snapshot mapped MAP_PRIVATE,
+ *pages are read in when the guest touches them and copied when it writes them*/
+int snapshot_map_ram(struct guest_ram *ram, const char *path) {
+    struct snapshot_header hdr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &hdr, path) < 0) {
+        close(fd);
+        return -1;
+    }
+    return guest_ram_map_file(ram, fd, hdr.ram_offset, hdr.ram_size);
+}
+
+static int restore_vcpu(struct vcpu *vcpu, struct snapshot_vcpu *rec) {
+    int fd = vcpu->vcpu_fd;
+
+    /*a long mode vcpu needs its cpuid before EFER.LME is accepted*/
+    if ((rec->sregs.efer & 0x100) && kvm_set_cpuid(vcpu) < 0)
+        return -1;
+    /*sregs first, they decide how the rest is interpreted*/
+    if (ioctl(fd, KVM_SET_SREGS, &rec->sregs) < 0 || ioctl(fd, KVM_SET_REGS, &rec->regs) < 0 ||
+        ioctl(fd, KVM_SET_FPU, &rec->fpu) < 0) {
+        perror("can not set vcpu state");
+        return -1;
+    }
+    vcpu->regs = rec->regs;
+    vcpu->sregs = rec->sregs;
+    if ((rec->flags & SNAPSHOT_XSAVE) && ioctl(fd, KVM_SET_XSAVE, &rec->xsave) < 0) {
+        perror("can not set xsave");
+        return -1;
+    }
+    if ((rec->flags & SNAPSHOT_XCRS) && ioctl(fd, KVM_SET_XCRS, &rec->xcrs) < 0) {
+        perror("can not set xcrs");
+        return -1;
+    }
+
+    int n = msrs_ioctl(fd, KVM_SET_MSRS, rec->msrs, rec->nmsrs, NULL);
+    if (n < 0) {
+        perror("can not set msrs");
+        return -1;
+    }
+    if ((__u32)n != rec->nmsrs && !opts.quiet)
+        printf("vcpu %d: %u of %u msrs not restored\n", vcpu->vcpu_id, rec->nmsrs - n, rec->nmsrs);
+
+    if ((rec->flags & SNAPSHOT_LAPIC) && ioctl(fd, KVM_SET_LAPIC, &rec->lapic) < 0) {
+        perror("can not set lapic");
+        return -1;
+    }
+    if (ioctl(fd, KVM_SET_VCPU_EVENTS, &rec->events) < 0) {
+        perror("can not set vcpu events");
+        return -1;
+    }
+    vcpu->events = rec->events;
+    /*the sync area still holds the state from before, the register api must not hand that out*/
+    return vcpu->kvm->sync_regs ? kvm_sync_regs_load(vcpu) : 0;
+}
+
+/*state of one vcpu into a record kept in memory, e.g. to put a reused vcpu back the way it was*/
+int snapshot_save_vcpu(struct vcpu *vcpu, struct snapshot_vcpu *rec) {
+    __u32 msr_indices[SNAPSHOT_MAX_MSRS];
+    int nr_msrs = msr_index_list(vcpu->kvm->dev_fd, msr_indices);
+
+    if (nr_msrs < 0)
+        return -1;
+    return save_vcpu(vcpu->kvm, vcpu, rec, msr_indices, nr_msrs);
+}
+
+int snapshot_restore_vcpu(struct vcpu *vcpu, struct snapshot_vcpu *rec) {
+    return restore_vcpu(vcpu, rec);
+}
+
+/*load the saved state into the freshly created vcpus, before their threads start*/
+int snapshot_restore_vcpus(struct kvm *kvm, const char *path) {
+    struct snapshot_header hdr;
+    struct snapshot_vcpu *rec;
+    int ret = -1;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &hdr, path) < 0)
+        goto out_close;
+    if ((int)hdr.nr_vcpus != kvm->vcpu_number) {
+        fprintf(stderr, "%s has %u vcpus, the vm has %d\n", path, hdr.nr_vcpus, kvm->vcpu_number);
+        goto out_close;
+    }
+    if (hdr.flags & SNAPSHOT_IRQCHIP) { /*before the lapics, they deliver into it*/
+        struct snapshot_irqchip chip;
+        if (pread(fd, &chip, sizeof(chip), irqchip_offset(&hdr)) != sizeof(chip)) {
+            fprintf(stderr, "%s: short irqchip record\n", path);
+            goto out_close;
+        }
+        if (restore_irqchip(kvm, &chip, hdr.flags, path) < 0)
+            goto out_close;
+    }
+    rec = malloc(sizeof(struct snapshot_vcpu));
+    if (rec == NULL)
+        goto out_close;
+
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        if (pread(fd, rec, sizeof(struct snapshot_vcpu), sizeof(hdr) + i * sizeof(struct snapshot_vcpu)) !=
+            sizeof(struct snapshot_vcpu)) {
+            fprintf(stderr, "%s: short vcpu record\n", path);
+            goto out_free;
+        }
+        if (restore_vcpu(&kvm->vcpus[i], rec) < 0)
+            goto out_free;
+    }
+    ret = 0;
+
+out_free:
+    free(rec);
+out_close:
+    close(fd);
+    return ret;
+}
+
+/*keep a snapshot mapped to reset a vm to it, the vcpu records are read once*/
+int snapshot_baseline_open(struct snapshot_baseline *base, const char *path) {
+    size_t len;
+    int fd = open(path, O_RDONLY);
+
+    memset(base, 0, sizeof(struct snapshot_baseline));
+    if (fd < 0) {
+        perror("can not open snapshot file");
+        return -1;
+    }
+    if (read_header(fd, &base->hdr, path) < 0) {
+        close(fd);
+        return -1;
+    }
+    len = base->hdr.nr_vcpus * sizeof(struct snapshot_vcpu);
+    base->vcpus = malloc(len);
+    if (base->vcpus == NULL || pread(fd, base->vcpus, len, sizeof(struct snapshot_header)) != (ssize_t)len) {
+        fprintf(stderr, "%s: short vcpu records\n", path);
+        free(base->vcpus);
+        close(fd);
+        return -1;
+    }
+    if ((base->hdr.flags & SNAPSHOT_IRQCHIP) &&
+        pread(fd, &base->irqchip, sizeof(base->irqchip), irqchip_offset(&base->hdr)) != sizeof(base->irqchip)) {
+        fprintf(stderr, "%s: short irqchip record\n", path);
+        free(base->vcpus);
+        close(fd);
+        return -1;
+    }
+    base->ram = mmap(NULL, base->hdr.ram_size, PROT_READ, MAP_PRIVATE, fd, base->hdr.ram_offset);
+    close(fd);
+    if (base->ram == MAP_FAILED) {
+        perror("can not mmap snapshot ram");
+        free(base->vcpus);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_baseline_close(struct snapshot_baseline *base) {
+    munmap((void *)base->ram, base->hdr.ram_size);
+    free(base->vcpus);
+}
+
+/*put the vm back to the baseline: only the pages the guest dirtied since the last reset are copied back,
+ *then every vcpu gets its saved state. the vcpus must be paused, returns the pages copied*/
+long snapshot_reset(struct kvm *kvm, struct snapshot_baseline *base) {
+    long dirty;
+
+    if (!opts.dirty_log || kvm->image || base->hdr.ram_size != kvm->ram_size ||
+        (int)base->hdr.nr_vcpus != kvm->vcpu_number) {
+        fprintf(stderr, "reset needs dirty tracking and a baseline of the same vm\n");
+        return -1;
+    }
+    dirty = dirty_log_sync(kvm);
+    if (dirty < 0)
+        return -1;
+    for (unsigned long w = 0; w < (kvm->dirty.nr_pages + 63) / 64; w++) {
+        unsigned long bits = atomic_load_explicit(&kvm->dirty.bitmap[w], memory_order_relaxed);
+        while (bits) {
+            __u64 gpa = (w * 64 + __builtin_ctzl(bits)) * (__u64)SNAPSHOT_ALIGN;
+            memcpy((char *)kvm->ram_start + gpa, base->ram + gpa, SNAPSHOT_ALIGN);
+            bits &= bits - 1;
+        }
+    }
+    dirty_log_clear(kvm);
+
+    if ((base->hdr.flags & SNAPSHOT_IRQCHIP) && restore_irqchip(kvm, &base->irqchip, base->hdr.flags, "the baseline") < 0)
+        return -1;
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        if (restore_vcpu(&kvm->vcpus[i], &base->vcpus[i]) < 0)
+            return -1;
+    }
+    return dirty;
+}
@@ -0,0 +1,86 @@
+/*
+ * Whole vm snapshot: guest ram plus the architectural state of every vcpu
+ * (regs, sregs, fpu, xsave, xcrs, events, msrs and lapic when there is an
+ * in kernel irqchip, then the pic, ioapic and pit state too). The ram section is page aligned so a restore maps it
+ * MAP_PRIVATE straight from the file instead of reading it. With dirty
+ * tracking a checkpoint only rewrites the pages written since the last one
+ * and a reset to baseline only copies those pages back.
+ * author: rkroshan
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <linux/kvm.h>
+#include "guest_ram.h"
+
+#define SNAPSHOT_MAGIC "KVMSNAP1"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_MSRS 256
+#define SNAPSHOT_ALIGN 4096 /*file offset of the ram section is a multiple of this*/
+
+/*snapshot_vcpu.flags, which optional parts were saved*/
+#define SNAPSHOT_XSAVE (1 << 0)
+#define SNAPSHOT_XCRS  (1 << 1)
+#define SNAPSHOT_LAPIC (1 << 2)
+
+/*snapshot_header.flags*/
+#define SNAPSHOT_IRQCHIP (1 << 0) /*the vm had an in kernel irqchip, a struct snapshot_irqchip follows the vcpu records*/
+#define SNAPSHOT_PIT     (1 << 1) /*and a pit, its state is in the irqchip record too*/
+
+/*file layout: header, nr_vcpus vcpu records, the irqchip record with SNAPSHOT_IRQCHIP, padding,
+ *ram_size bytes of guest ram at ram_offset*/
+struct snapshot_header {
+    char magic[8];
+    __u32 version;
+    __u32 nr_vcpus;
+    __u64 ram_size;
+    __u64 ram_offset;
+    __u32 vcpu_size; /*sizeof(struct snapshot_vcpu) of the writer*/
+    __u32 flags; /*SNAPSHOT_IRQCHIP, SNAPSHOT_PIT*/
+};
+
+struct snapshot_vcpu {
+    __u32 flags;
+    __u32 nmsrs;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_vcpu_events events;
+    struct kvm_lapic_state lapic;
+    struct kvm_msr_entry msrs[SNAPSHOT_MAX_MSRS];
+};
+
+/*vm wide state of the in kernel irqchip*/
+struct snapshot_irqchip {
+    struct kvm_irqchip chips[3]; /*KVM_IRQCHIP_PIC_MASTER, KVM_IRQCHIP_PIC_SLAVE and KVM_IRQCHIP_IOAPIC*/
+    struct kvm_pit_state2 pit; /*only with SNAPSHOT_PIT*/
+};
+
+/*a snapshot kept open to reset a vm to it*/
+struct snapshot_baseline {
+    struct snapshot_header hdr;
+    const char *ram; /*read only mapping of the ram section*/
+    struct snapshot_vcpu *vcpus; /*hdr.nr_vcpus records*/
+    struct snapshot_irqchip irqchip; /*only with SNAPSHOT_IRQCHIP*/
+};
+
+struct kvm;
+struct vcpu;
+
+void snapshot_quiesce_vcpu(struct vcpu *vcpu);
+int snapshot_save_vcpu(struct vcpu *vcpu, struct snapshot_vcpu *rec);
+int snapshot_restore_vcpu(struct vcpu *vcpu, struct snapshot_vcpu *rec);
+int snapshot_save(struct kvm *kvm, const char *path);
+int snapshot_map_ram(struct guest_ram *ram, const char *path);
+int snapshot_flags(const char *path);
+int snapshot_ram_section(const char *path, off_t *offset, __u64 *size);
+int snapshot_restore_vcpus(struct kvm *kvm, const char *path);
+long snapshot_checkpoint(struct kvm *kvm, const char *path);
+int snapshot_baseline_open(struct snapshot_baseline *base, const char *path);
+void snapshot_baseline_close(struct snapshot_baseline *base);
+long snapshot_reset(struct kvm *kvm, struct snapshot_baseline *base);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * UART like console device model, see uart.h.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "kvm_code_bin_multi.h"
+#include "uart.h"
+
+/*"ring", "mmio" or "pio" from the command line, -1 if unknown*/
+int uart_mode(const char *name) {
+    if (strcmp(name, "ring") == 0)
+        return UART_RING;
+    if (strcmp(name, "mmio") == 0)
+        return UART_MMIO;
+    if (strcmp(name, "pio") == 0)
+        return UART_PIO;
+    fprintf(stderr, "unknown uart mode: %s\n", name);
+    return -1;
+}
+
+/*the vcpus have to exist, the coalesced ring is reached through their kvm_run mapping*/
+int uart_init(struct uart *uart, struct kvm *kvm, int mode, FILE *out) {
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = UART_MMIO_BASE,
+        .size = UART_MMIO_SIZE,
+        .pio = 0,
+    };
+
+    memset(uart, 0, sizeof(struct uart));
+    uart->kvm = kvm;
+    uart->mode = mode;
+    uart->out = out;
+    if (kvm->ram_size > UART_MMIO_BASE) { /*a store there would just be a ram write*/
+        fprintf(stderr, "the uart at 0x%x is inside %llu MB of guest ram\n", UART_MMIO_BASE, kvm->ram_size >> 20);
+        return -1;
+    }
+    if (mode != UART_RING)
+        return 0;
+    if (kvm_coalesced_ring(kvm) == NULL) {
+        fprintf(stderr, "coalesced mmio not supported by this kernel\n");
+        return -1;
+    }
+    if (ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+        perror("can not register coalesced mmio zone");
+        return -1;
+    }
+    return 0;
+}
+
+/*an access to the mmio register, from a KVM_EXIT_MMIO or a coalesced ring entry (always a store).
+ *returns 0 when addr is not the uart, reads see an empty receiver*/
+int uart_mmio(struct uart *uart, __u64 addr, __u8 *data, __u32 len, int is_write, int coalesced) {
+    if (uart->mode == UART_OFF || addr < UART_MMIO_BASE || addr + len > UART_MMIO_BASE + UART_MMIO_SIZE)
+        return 0;
+    if (!is_write) {
+        memset(data, 0, len);
+        return 1;
+    }
+    if (uart->out && addr == UART_MMIO_BASE && len)
+        fputc(data[0], uart->out);
+    atomic_fetch_add_explicit(coalesced ? &uart->ring_bytes : &uart->mmio_exits, 1, memory_order_relaxed);
+    return 1;
+}
+
+/*a KVM_EXIT_IO, returns 0 when port is not the uart data port*/
+int uart_pio(struct uart *uart, __u16 port, __u8 *data, __u32 len, int is_write) {
+    if (uart->mode == UART_OFF || port != UART_PIO_PORT)
+        return 0;
+    if (!is_write) {
+        memset(data, 0, len);
+        return 1;
+    }
+    if (uart->out && len)
+        fputc(data[0], uart->out);
+    atomic_fetch_add_explicit(&uart->pio_exits, 1, memory_order_relaxed);
+    return 1;
+}
+
+void uart_print(FILE *out, const struct uart *uart, double secs) {
+    static const char *names[] = { "off", "coalesced mmio", "mmio", "pio" };
+    unsigned long long ring = atomic_load(&uart->ring_bytes), mmio = atomic_load(&uart->mmio_exits),
+                       pio = atomic_load(&uart->pio_exits);
+    unsigned long long bytes = ring + mmio + pio;
+
+    fprintf(out, "uart (%s): %llu bytes in %.2f s, %.0f bytes/sec, %llu through the coalesced ring, %llu mmio exits, %llu pio exits\n",
+            names[uart->mode], bytes, secs, bytes / secs, ring, mmio, pio);
+}
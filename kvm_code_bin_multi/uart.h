@@ -0,0 +1,47 @@
+/*
+ * UART like console device: a transmit data register at UART_MMIO_BASE, the
+ * address the arm64 sample (arm64/qemu-arm64) writes its characters to, and
+ * the 16550 data port UART_PIO_PORT as in kvm_code_struct. With UART_RING the
+ * register is a KVM_REGISTER_COALESCED_MMIO zone: guest stores land in the
+ * kernel ring shared with the coalesced pio of -c and are flushed in bulk on
+ * the next exit or timer tick, an exit only happens when the ring is full.
+ * UART_MMIO and UART_PIO take one exit per byte.
+ * author: rkroshan
+ */
+
+#ifndef UART_H
+#define UART_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <linux/types.h>
+
+#define UART_MMIO_BASE 0x09000000 /*UART0DR of the qemu virt board, above guest ram*/
+#define UART_MMIO_SIZE 4 /*the data register, the guest stores one character in its low byte*/
+#define UART_PIO_PORT 0x3f8 /*com1 data port*/
+#define UART_FILE "uart64.elf" /*print_uart0() through the mmio register, long mode*/
+#define UART_PIO_FILE "uart64_pio.elf" /*the same with an out to UART_PIO_PORT per character*/
+
+#define UART_OFF  0
+#define UART_RING 1 /*coalesced mmio zone, no exit per byte*/
+#define UART_MMIO 2 /*plain mmio, KVM_EXIT_MMIO per byte*/
+#define UART_PIO  3 /*port io, KVM_EXIT_IO per byte*/
+
+struct kvm;
+
+struct uart {
+    struct kvm *kvm;
+    int mode; /*UART_RING, UART_MMIO or UART_PIO*/
+    FILE *out; /*console, NULL only counts the bytes*/
+    atomic_ullong ring_bytes; /*drained from the coalesced ring*/
+    atomic_ullong mmio_exits; /*one byte each, with UART_RING only when the ring was full*/
+    atomic_ullong pio_exits; /*one byte each*/
+};
+
+int uart_mode(const char *name);
+int uart_init(struct uart *uart, struct kvm *kvm, int mode, FILE *out);
+int uart_mmio(struct uart *uart, __u64 addr, __u8 *data, __u32 len, int is_write, int coalesced);
+int uart_pio(struct uart *uart, __u16 port, __u8 *data, __u32 len, int is_write);
+void uart_print(FILE *out, const struct uart *uart, double secs);
+
+#endif
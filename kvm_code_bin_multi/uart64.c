@@ -0,0 +1,25 @@
+/*
+ * x86 version of print_uart0() of arm64/qemu-arm64, the guest of kvm_code_bin_multi -U.
+ * 64 bit long mode without libc: kvm_code_bin_multi enters at main with the stack at the
+ * top of guest ram and the uart identity mapped. Built twice, the UART_PIO build sends
+ * every character out of the com1 port instead (uart.h).
+ * author: rkroshan
+ */
+
+volatile unsigned char * const UART0DR = (unsigned char *) 0x09000000; /*UART_MMIO_BASE*/
+
+void print_uart0(const char *s) {
+    while (*s != '\0') {                /* Loop until end of string */
+#ifdef UART_PIO
+        __asm__ volatile("outb %0, %1" : : "a"(*s), "Nd"((unsigned short)0x3f8)); /* Transmit char, UART_PIO_PORT */
+#else
+        *UART0DR = (unsigned char)(*s); /* Transmit char */
+#endif
+        s++;                            /* Next char */
+    }
+}
+
+void main(void) {
+    for (;;) /*the host measures bytes/sec, there is nothing to return to*/
+        print_uart0("Hello what's up!\n");
+}
@@ -0,0 +1,272 @@
+/*
+ * Many small vms in one process with a bounded number of running vcpus.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include "kvm_code_bin_multi.h"
+#include "vm_host.h"
+
+static long host_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*wait for a run token in FIFO order, fails once the host stops*/
+static int host_token_get(struct vm_host *host, struct vm_host_vcpu *slot) {
+    pthread_mutex_lock(&host->lock);
+    unsigned long ticket = host->next_ticket++;
+    while (!atomic_load(&host->stop) && (ticket != host->serving || host->free_tokens == 0))
+        pthread_cond_wait(&host->token_cond, &host->lock);
+    if (atomic_load(&host->stop)) {
+        pthread_mutex_unlock(&host->lock);
+        return -1;
+    }
+    host->serving++;
+    host->free_tokens--;
+    pthread_cond_broadcast(&host->token_cond); /*the next ticket may find a free token too*/
+    pthread_mutex_unlock(&host->lock);
+    atomic_store(&slot->since, host_now_ns());
+    return 0;
+}
+
+static void host_token_put(struct vm_host *host, struct vm_host_vcpu *slot) {
+    atomic_store(&slot->since, 0);
+    pthread_mutex_lock(&host->lock);
+    host->free_tokens++;
+    pthread_cond_broadcast(&host->token_cond);
+    pthread_mutex_unlock(&host->lock);
+}
+
+static int host_waiters(struct vm_host *host) {
+    return __atomic_load_n(&host->next_ticket, __ATOMIC_RELAXED) != __atomic_load_n(&host->serving, __ATOMIC_RELAXED);
+}
+
+/*give the token to the longest waiter and queue up again behind it*/
+static int host_yield(struct vm_host *host, struct vm_host_vcpu *slot) {
+    host_token_put(host, slot);
+    return host_token_get(host, slot);
+}
+
+static void *host_vcpu_thread(void *data) {
+    struct vcpu *vcpu = (struct vcpu *)data;
+    struct vm_host *host = vcpu->kvm->host;
+    struct kvm_run *run = vcpu->kvm_run;
+    struct vm_host_vcpu *slot = NULL;
+
+    for (int i = 0; i < host->nr_vcpus && slot == NULL; i++) {
+        if (host->vcpus[i].vcpu == vcpu)
+            slot = &host->vcpus[i];
+    }
+    kvm_reset_vcpu(vcpu);
+    vcpu->regs.rbx = VM_HOST_COUNTERS + vcpu->vcpu_id * 64;
+    vcpu->regs.rsi = host->work;
+    vcpu->regs.rdi = host->exits_per_hlt;
+    if (vcpu_set_regs(vcpu) < 0)
+        exit(1);
+
+    if (host_token_get(host, slot) < 0)
+        return NULL;
+    while (!atomic_load_explicit(&host->stop, memory_order_relaxed)) {
+        int ret = ioctl(vcpu->vcpu_fd, KVM_RUN, 0);
+
+        if (ret < 0) {
+            if (errno != EINTR)
+                err(1, "KVM_RUN");
+            run->immediate_exit = 0;
+            if (atomic_load_explicit(&host->stop, memory_order_relaxed))
+                break;
+            slot->preempted++;
+            if (host_yield(host, slot) < 0)
+                return NULL;
+            continue;
+        }
+        if (atomic_load_explicit(&vcpu->kvm->first_exit_ns, memory_order_relaxed) == 0)
+            kvm_note_first_exit(vcpu->kvm);
+
+        switch (run->exit_reason) {
+        case KVM_EXIT_IO:
+            slot->exits++;
+            break;
+        case KVM_EXIT_HLT: /*idle: park without a token, no interrupt will come so wake after a tick*/
+            slot->halts++;
+            host_token_put(host, slot);
+            usleep(host->idle_us);
+            if (host_token_get(host, slot) < 0)
+                return NULL;
+            continue;
+        default:
+            errx(1, "vm host: unexpected exit_reason = 0x%x", run->exit_reason);
+        }
+
+        /*exits are a cheap place to give up a token that others wait for*/
+        if (host_waiters(host) && host_now_ns() - atomic_load(&slot->since) > host->slice_us * 1000L) {
+            if (host_yield(host, slot) < 0)
+                return NULL;
+        }
+    }
+    host_token_put(host, slot);
+    return NULL;
+}
+
+/*scheduler thread: ends the slice of vcpus that hold their token too long while others wait,
+ *a guest that does not exit would keep it forever otherwise*/
+static void *host_sched_thread(void *data) {
+    struct vm_host *host = (struct vm_host *)data;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = host->slice_us * 500L };
+
+    while (!atomic_load(&host->stop)) {
+        nanosleep(&interval, NULL);
+        if (!host_waiters(host))
+            continue;
+        long now = host_now_ns();
+        for (int i = 0; i < host->nr_vcpus; i++) {
+            struct vm_host_vcpu *slot = &host->vcpus[i];
+            long since = atomic_load(&slot->since);
+            if (since && now - since > host->slice_us * 1000L && !slot->vcpu->kvm_run->immediate_exit)
+                kvm_kick_vcpu(slot->vcpu);
+        }
+    }
+    return NULL;
+}
+
+/*open /dev/kvm once for every vm the host will run, nr_tokens <= 0 takes the online cpu count*/
+int vm_host_init(struct vm_host *host, int max_vms, int max_vcpus, int nr_tokens) {
+    memset(host, 0, sizeof(struct vm_host));
+    host->dev_fd = open(KVM_DEVICE, O_RDWR | O_CLOEXEC);
+    if (host->dev_fd < 0) {
+        perror("open kvm device fault");
+        return -1;
+    }
+    host->nr_tokens = nr_tokens > 0 ? nr_tokens : sysconf(_SC_NPROCESSORS_ONLN);
+    host->free_tokens = host->nr_tokens;
+    host->slice_us = VM_HOST_SLICE_US;
+    host->idle_us = VM_HOST_IDLE_US;
+    host->work = 1000;
+    host->exits_per_hlt = 100;
+    host->counters = 1;
+    host->max_vms = max_vms;
+    host->max_vcpus = max_vcpus;
+    host->vms = calloc(max_vms, sizeof(struct vm_host_vm));
+    host->vcpus = calloc(max_vcpus, sizeof(struct vm_host_vcpu));
+    if (host->vms == NULL || host->vcpus == NULL) {
+        perror("can not allocate vm host tables");
+        return -1;
+    }
+    pthread_mutex_init(&host->lock, NULL);
+    pthread_cond_init(&host->token_cond, NULL);
+    return 0;
+}
+
+/*create one more vm with nr_vcpus vcpus running image, on the shared /dev/kvm fd*/
+int vm_host_add(struct vm_host *host, const char *image, __u64 ram_size, int nr_vcpus) {
+    long begin = host_now_ns();
+
+    if (host->nr_vms == host->max_vms || host->nr_vcpus + nr_vcpus > host->max_vcpus) {
+        fprintf(stderr, "vm host table full\n");
+        return -1;
+    }
+    struct kvm *kvm = kvm_init_dev(host->dev_fd);
+    if (kvm == NULL)
+        return -1;
+    if (kvm_create_vm(kvm, ram_size) < 0 || kvm_load_image(kvm, image) < 0)
+        goto fail;
+    kvm->host = host;
+    kvm->vcpu_number = nr_vcpus;
+    kvm->vcpus = kvm_create_vpcus(kvm, nr_vcpus, host_vcpu_thread);
+    if (kvm->vcpus == NULL)
+        goto fail;
+
+    host->vms[host->nr_vms].kvm = kvm;
+    host->vms[host->nr_vms].first_vcpu = host->nr_vcpus;
+    host->nr_vms++;
+    for (int i = 0; i < nr_vcpus; i++)
+        host->vcpus[host->nr_vcpus++].vcpu = &kvm->vcpus[i];
+    host->setup_ns += host_now_ns() - begin;
+    return 0;
+
+fail:
+    kvm_clean_vm(kvm);
+    kvm_clean(kvm);
+    return -1;
+}
+
+/*run every vcpu of every vm for duration_ms, secs is the measured run time*/
+int vm_host_run(struct vm_host *host, int duration_ms, double *secs) {
+    struct timespec wait = { .tv_sec = duration_ms / 1000, .tv_nsec = (duration_ms % 1000) * 1000000L };
+    long begin = host_now_ns();
+
+    atomic_store(&host->stop, 0);
+    for (int i = 0; i < host->nr_vcpus; i++) {
+        if (kvm_start_vcpu(host->vcpus[i].vcpu) < 0)
+            return -1;
+    }
+    if (pthread_create(&host->sched_thread, NULL, host_sched_thread, host) != 0) {
+        perror("can not create scheduler thread");
+        return -1;
+    }
+
+    nanosleep(&wait, NULL);
+
+    atomic_store(&host->stop, 1);
+    pthread_mutex_lock(&host->lock);
+    pthread_cond_broadcast(&host->token_cond); /*token waiters give up*/
+    pthread_mutex_unlock(&host->lock);
+    pthread_join(host->sched_thread, NULL);
+    for (int i = 0; i < host->nr_vcpus; i++)
+        kvm_kick_vcpu(host->vcpus[i].vcpu);
+    for (int i = 0; i < host->nr_vcpus; i++)
+        pthread_join(host->vcpus[i].vcpu->vcpu_thread, NULL);
+    *secs = (host_now_ns() - begin) / 1e9;
+    return 0;
+}
+
+/*sums over all vcpus, ops are the guest loop iterations read back from guest ram (0 without host->counters)*/
+void vm_host_totals(struct vm_host *host, unsigned long *exits, unsigned long *halts, unsigned long *preempted,
+                    unsigned long *ops) {
+    *exits = *halts = *preempted = *ops = 0;
+    for (int i = 0; i < host->nr_vcpus; i++) {
+        struct vm_host_vcpu *slot = &host->vcpus[i];
+        struct kvm *kvm = slot->vcpu->kvm;
+
+        *exits += slot->exits;
+        *halts += slot->halts;
+        *preempted += slot->preempted;
+        if (host->counters)
+            *ops += *(__u32 *)(kvm->ram_start + IMAGE_START + VM_HOST_COUNTERS + slot->vcpu->vcpu_id * 64);
+    }
+}
+
+void vm_host_print(FILE *out, struct vm_host *host, double secs) {
+    unsigned long exits, halts, preempted, ops;
+
+    vm_host_totals(host, &exits, &halts, &preempted, &ops);
+    fprintf(out, "vm host: %d vms, %d vcpus on %d tokens, setup %.3f ms (%.1f us per vm)\n", host->nr_vms,
+            host->nr_vcpus, host->nr_tokens, host->setup_ns / 1e6, host->nr_vms ? host->setup_ns / 1e3 / host->nr_vms : 0.0);
+    fprintf(out, "vm host: %.0f exits/sec, ", exits / secs);
+    if (host->counters) /*any other guest does not keep them, its ram is not a counter*/
+        fprintf(out, "%.0f guest loop iterations/sec, ", ops / secs);
+    fprintf(out, "%lu halts, %lu preemptions in %.2f s\n", halts, preempted, secs);
+}
+
+void vm_host_destroy(struct vm_host *host) {
+    for (int i = 0; i < host->nr_vms; i++) {
+        struct kvm *kvm = host->vms[i].kvm;
+        kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+        kvm_clean_vm(kvm);
+        kvm_clean(kvm);
+    }
+    free(host->vms);
+    free(host->vcpus);
+    close(host->dev_fd);
+}
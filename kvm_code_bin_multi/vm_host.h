@@ -0,0 +1,70 @@
+/*
+ * Many small vms in one process. All vms share one /dev/kvm fd and sit in a
+ * compact table, every vcpu keeps its own thread but only nr_tokens of them
+ * (the host core count by default) may be inside KVM_RUN at a time. A vcpu
+ * gives its token back when the guest halts and parks for an idle tick, the
+ * scheduler thread kicks a vcpu out of KVM_RUN once it has held its token for
+ * a whole slice while others wait. Tokens are handed out in FIFO order.
+ * author: rkroshan
+ */
+
+#ifndef VM_HOST_H
+#define VM_HOST_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/types.h>
+
+#define VM_HOST_FILE "bench_mixed.bin" /*guest that keeps the counters, what -M runs without -f*/
+#define VM_HOST_COUNTERS 0x8000 /*offset from IMAGE_START of the guest loop counters, 64 bytes per vcpu*/
+#define VM_HOST_SLICE_US 2000 /*longest a vcpu keeps its token while others wait*/
+#define VM_HOST_IDLE_US 100 /*a halted vcpu is parked this long, there is no interrupt to wake it*/
+
+struct kvm;
+struct vcpu;
+
+/*scheduling state of one vcpu, its slot in the host vcpu table*/
+struct vm_host_vcpu {
+    struct vcpu *vcpu;
+    atomic_long since; /*ns when the vcpu took its token, 0 while it has none*/
+    unsigned long exits; /*KVM_EXIT_IO*/
+    unsigned long halts; /*KVM_EXIT_HLT, each one parks the vcpu*/
+    unsigned long preempted; /*kicked out at the end of a slice*/
+};
+
+/*per vm entry of the table*/
+struct vm_host_vm {
+    struct kvm *kvm;
+    int first_vcpu; /*index of its vcpu 0 in the vcpu table*/
+};
+
+struct vm_host {
+    int dev_fd; /*the only /dev/kvm fd of the process*/
+    int nr_tokens; /*vcpus allowed in KVM_RUN at once*/
+    int slice_us, idle_us;
+    __u16 work; /*guest loop iterations between two exits, handed to the guest in %si*/
+    __u16 exits_per_hlt; /*guest exits between two hlt, in %di*/
+    int counters; /*the guests keep the VM_HOST_COUNTERS, 0 leaves the loop iterations out*/
+    struct vm_host_vm *vms;
+    int nr_vms, max_vms;
+    struct vm_host_vcpu *vcpus;
+    int nr_vcpus, max_vcpus;
+    pthread_mutex_t lock; /*guards the tokens and tickets*/
+    pthread_cond_t token_cond;
+    int free_tokens;
+    unsigned long next_ticket, serving; /*FIFO order of token waiters*/
+    atomic_int stop;
+    pthread_t sched_thread;
+    long setup_ns; /*time spent in vm_host_add()*/
+};
+
+int vm_host_init(struct vm_host *host, int max_vms, int max_vcpus, int nr_tokens);
+int vm_host_add(struct vm_host *host, const char *image, __u64 ram_size, int nr_vcpus);
+int vm_host_run(struct vm_host *host, int duration_ms, double *secs);
+void vm_host_totals(struct vm_host *host, unsigned long *exits, unsigned long *halts, unsigned long *preempted,
+                    unsigned long *ops);
+void vm_host_print(FILE *out, struct vm_host *host, double secs);
+void vm_host_destroy(struct vm_host *host);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Pool of ready to run vms cloned from one template.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kvm_code_bin_multi.h"
+#include "vm_pool.h"
+
+static void pool_destroy_vm(struct kvm *kvm) {
+    kvm_clean_vcpus(kvm->vcpus, kvm->vcpu_number);
+    kvm_clean_vm(kvm);
+    kvm_clean(kvm);
+}
+
+/*everything a cold start does except loading the image: vm, cloned ram, memslot, vcpus and their reset.
+ *fresh, when not NULL, gets the state of the new vcpus from before the reset*/
+static struct kvm *pool_build_vm(struct vm_pool *pool, struct snapshot_vcpu *fresh) {
+    struct kvm *kvm = kvm_init();
+
+    if (kvm == NULL)
+        return NULL;
+    if (kvm_create_vm_from(kvm, pool->template.size, &pool->template) < 0) {
+        kvm_clean(kvm);
+        return NULL;
+    }
+    kvm->vcpu_number = pool->nr_vcpus;
+    kvm->vcpus = kvm_create_vpcus(kvm, pool->nr_vcpus, pool->vcpu_fn);
+    if (kvm->vcpus == NULL) {
+        kvm_clean_vm(kvm);
+        kvm_clean(kvm);
+        return NULL;
+    }
+    for (int i = 0; fresh && i < kvm->vcpu_number; i++) {
+        if (snapshot_save_vcpu(&kvm->vcpus[i], &fresh[i]) < 0) {
+            pool_destroy_vm(kvm);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < kvm->vcpu_number; i++)
+        kvm_reset_vcpu(&kvm->vcpus[i]);
+    return kvm;
+}
+
+/*the vm is handed out from here on, time to first exit counts from now*/
+static struct kvm *pool_hand_out(struct kvm *kvm) {
+    clock_gettime(CLOCK_MONOTONIC, &kvm->created);
+    atomic_store(&kvm->first_exit_ns, 0);
+    atomic_store(&kvm->stop, 0);
+    return kvm;
+}
+
+static void *pool_refill_thread(void *data) {
+    struct vm_pool *pool = (struct vm_pool *)data;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        if (pool->nr_ready >= pool->target) {
+            pthread_cond_wait(&pool->refill, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock); /*building takes a while, getters must not wait for it*/
+        struct kvm *kvm = pool_build_vm(pool, NULL);
+        pthread_mutex_lock(&pool->lock);
+        if (kvm == NULL) {
+            fprintf(stderr, "vm pool: can not build vm, refill stopped\n");
+            break;
+        }
+        if (pool->nr_ready < pool->target) {
+            pool->ready[pool->nr_ready++] = kvm;
+            pool->built++;
+        } else { /*recycled vms filled the pool meanwhile*/
+            pthread_mutex_unlock(&pool->lock);
+            pool_destroy_vm(kvm);
+            pthread_mutex_lock(&pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*build the template from image and start filling the pool with target vms*/
+int vm_pool_init(struct vm_pool *pool, const char *image, __u64 ram_size, int nr_vcpus,
+                 void *(*fn)(void *), int target) {
+    struct kvm tmpl;
+    struct kvm *kvm;
+
+    memset(pool, 0, sizeof(struct vm_pool));
+    pool->nr_vcpus = nr_vcpus;
+    pool->vcpu_fn = fn;
+    pool->target = target;
+    pool->ready = calloc(target, sizeof(struct kvm *));
+    pool->fresh = malloc(nr_vcpus * sizeof(struct snapshot_vcpu));
+    if (pool->ready == NULL || pool->fresh == NULL) {
+        perror("can not allocate vm pool");
+        return -1;
+    }
+    if (guest_ram_alloc(&pool->template, ram_size, "memfd") < 0)
+        return -1;
+
+    /*load_binary only needs the ram of the vm it loads into*/
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.ram_start = (__u64)pool->template.addr;
+    tmpl.ram_size = pool->template.size;
+    load_binary(&tmpl, image);
+
+    /*the first vm is built right here, its vcpus say what a recycled vm is put back to*/
+    kvm = pool_build_vm(pool, pool->fresh);
+    if (kvm == NULL)
+        return -1;
+    if (target > 0) {
+        pool->ready[pool->nr_ready++] = kvm;
+        pool->built++;
+    } else {
+        pool_destroy_vm(kvm);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->refill, NULL);
+    if (pthread_create(&pool->refill_thread, NULL, pool_refill_thread, pool) != 0) {
+        perror("can not create vm pool refill thread");
+        return -1;
+    }
+    return 0;
+}
+
+/*a ready vm, built on the spot when the pool is empty*/
+struct kvm *vm_pool_get(struct vm_pool *pool) {
+    struct kvm *kvm = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nr_ready > 0) {
+        kvm = pool->ready[--pool->nr_ready];
+        pool->hits++;
+        pthread_cond_signal(&pool->refill);
+    } else {
+        pool->misses++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (kvm == NULL)
+        kvm = pool_build_vm(pool, NULL);
+    return kvm ? pool_hand_out(kvm) : NULL;
+}
+
+/*give a vm back for reuse, its vcpu threads must have stopped.
+ *the guest written pages are dropped so ram reads the template again, every vcpu gets
+ *the state of a new one back so nothing the last guest left in fpu, msrs or lapic remains*/
+void vm_pool_put(struct vm_pool *pool, struct kvm *kvm) {
+    if (guest_ram_discard(&kvm->ram) < 0) {
+        vm_pool_release(pool, kvm);
+        return;
+    }
+    for (int i = 0; i < kvm->vcpu_number; i++) {
+        snapshot_quiesce_vcpu(&kvm->vcpus[i]); /*an in or out left half done must not land after the reset*/
+        if (snapshot_restore_vcpu(&kvm->vcpus[i], &pool->fresh[i]) < 0) {
+            vm_pool_release(pool, kvm);
+            return;
+        }
+        kvm_reset_vcpu(&kvm->vcpus[i]);
+    }
+    pthread_mutex_lock(&kvm->pause_lock); /*the next threads start as running, not done or parked*/
+    for (int i = 0; i < kvm->vcpu_number; i++)
+        kvm->vcpus[i].done = 0;
+    kvm->nr_parked = 0;
+    pthread_mutex_unlock(&kvm->pause_lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->recycled++;
+    if (pool->nr_ready < pool->target) {
+        pool->ready[pool->nr_ready++] = kvm;
+        kvm = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (kvm)
+        pool_destroy_vm(kvm);
+}
+
+/*throw a vm away instead of recycling it, the refill thread builds a new one*/
+void vm_pool_release(struct vm_pool *pool, struct kvm *kvm) {
+    (void)pool;
+    pool_destroy_vm(kvm);
+}
+
+void vm_pool_destroy(struct vm_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->refill_thread, NULL);
+
+    for (int i = 0; i < pool->nr_ready; i++)
+        pool_destroy_vm(pool->ready[i]);
+    free(pool->ready);
+    free(pool->fresh);
+    guest_ram_free(&pool->template);
+}
@@ -0,0 +1,47 @@
+/*
+ * Pool of ready to run vms cloned from one template. The template is a
+ * memfd with the image loaded, every vm maps it MAP_PRIVATE so guest ram
+ * is shared copy on write. A refill thread keeps the pool topped up and
+ * vms that come back are recycled: their private pages are dropped and
+ * their vcpus get the whole state of a newly created vcpu back (fpu, msrs,
+ * lapic and pending events too) before the reset, the vm fd, memslot and
+ * vcpus are kept.
+ * author: rkroshan
+ */
+
+#ifndef VM_POOL_H
+#define VM_POOL_H
+
+#include <pthread.h>
+#include <linux/kvm.h>
+#include "guest_ram.h"
+
+struct kvm;
+struct snapshot_vcpu;
+
+struct vm_pool {
+    struct guest_ram template; /*memfd backed ram holding the image*/
+    int nr_vcpus; /*vcpus of every vm*/
+    void *(*vcpu_fn)(void *); /*thread function of the vcpus*/
+    struct snapshot_vcpu *fresh; /*nr_vcpus records: state of the vcpus of the first vm right after creation*/
+    int target; /*vms kept ready*/
+    struct kvm **ready; /*ready vms, target entries*/
+    int nr_ready;
+    pthread_mutex_t lock; /*guards ready, nr_ready and stop*/
+    pthread_cond_t refill; /*wakes the refill thread when a vm is taken*/
+    pthread_t refill_thread;
+    int stop;
+    unsigned long built; /*vms built by the refill thread*/
+    unsigned long hits; /*vm_pool_get() served from the pool*/
+    unsigned long misses; /*vm_pool_get() that had to build the vm itself*/
+    unsigned long recycled; /*vms returned with vm_pool_put()*/
+};
+
+int vm_pool_init(struct vm_pool *pool, const char *image, __u64 ram_size, int nr_vcpus,
+                 void *(*fn)(void *), int target);
+struct kvm *vm_pool_get(struct vm_pool *pool);
+void vm_pool_put(struct vm_pool *pool, struct kvm *kvm);
+void vm_pool_release(struct vm_pool *pool, struct kvm *kvm);
+void vm_pool_destroy(struct vm_pool *pool);
+
+#endif
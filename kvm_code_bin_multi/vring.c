@@ -0,0 +1,54 @@
+/*
+ * Paravirtual ring device, host side.
+ * author: rkroshan
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "vring.h"
+
+/*the rings live at gpa of the ram mapped at ram, the guest fills them in*/
+int vring_init(struct vring *vr, void *ram, __u64 ram_size, __u64 gpa) {
+    if (gpa + VRING_USED_OFF + sizeof(struct vring_used) > ram_size) {
+        fprintf(stderr, "vring at 0x%llx does not fit in guest ram\n", (unsigned long long)gpa);
+        return -1;
+    }
+    memset(vr, 0, sizeof(struct vring));
+    vr->ram = ram;
+    vr->ram_size = ram_size;
+    vr->desc = (struct vring_desc *)(vr->ram + gpa);
+    vr->avail = (struct vring_avail *)(vr->ram + gpa + VRING_AVAIL_OFF);
+    vr->used = (struct vring_used *)(vr->ram + gpa + VRING_USED_OFF);
+    return 0;
+}
+
+/*doorbell: hand every buffer the guest made available to fn without copying it, then
+ *publish them all on the used ring with a single idx update. returns the buffers consumed*/
+long vring_kick(struct vring *vr, vring_fn fn, void *ctx) {
+    __u16 avail_idx = __atomic_load_n(&vr->avail->idx, __ATOMIC_ACQUIRE);
+    __u16 used_idx = vr->used->idx;
+    long n = 0;
+
+    vr->kicks++;
+    while (vr->last_avail != avail_idx) {
+        __u16 id = vr->avail->ring[vr->last_avail % VRING_SIZE] % VRING_SIZE;
+        __u64 addr = vr->desc[id].addr;
+        __u32 len = vr->desc[id].len;
+
+        if (addr > vr->ram_size || len > vr->ram_size - addr) { /*never trust the guest*/
+            vr->bad++;
+            len = 0;
+        } else {
+            fn(ctx, vr->ram + addr, len);
+            vr->bytes += len;
+        }
+        vr->used->ring[used_idx % VRING_SIZE].id = id;
+        vr->used->ring[used_idx % VRING_SIZE].len = len;
+        used_idx++;
+        vr->last_avail++;
+        n++;
+    }
+    vr->buffers += n;
+    __atomic_store_n(&vr->used->idx, used_idx, __ATOMIC_RELEASE);
+    return n;
+}
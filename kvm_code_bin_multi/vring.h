@@ -0,0 +1,65 @@
+/*
+ * Paravirtual ring device for bulk guest to host transfers, laid out like a
+ * split virtio queue: a descriptor table, an available ring the guest
+ * produces into and a used ring the host hands buffers back on, all in guest
+ * ram at an agreed address. The guest queues a batch of buffers and kicks
+ * one doorbell port, the host reads them in place through the ram mapping.
+ * author: rkroshan
+ */
+
+#ifndef VRING_H
+#define VRING_H
+
+#include <linux/types.h>
+
+#define VRING_SIZE 256 /*descriptors, a power of two*/
+#define VRING_PORT 0x30 /*doorbell, the value written is ignored*/
+#define VRING_GPA 0x80000 /*guest physical address of the descriptor table*/
+/*offsets from VRING_GPA, guests hard code them*/
+#define VRING_AVAIL_OFF 0x1000
+#define VRING_USED_OFF  0x2000
+
+struct vring_desc {
+    __u64 addr; /*guest physical address of the buffer*/
+    __u32 len;
+    __u16 flags; /*unused, no chaining*/
+    __u16 next;
+};
+
+struct vring_avail {
+    __u16 flags;
+    __u16 idx; /*free running, the guest bumps it after filling ring[idx % VRING_SIZE]*/
+    __u16 ring[VRING_SIZE]; /*descriptor indexes*/
+};
+
+struct vring_used_elem {
+    __u32 id; /*descriptor index*/
+    __u32 len; /*bytes consumed, 0 for a descriptor outside guest ram*/
+};
+
+struct vring_used {
+    __u16 flags;
+    __u16 idx; /*free running, the host bumps it once per kick*/
+    struct vring_used_elem ring[VRING_SIZE];
+};
+
+/*consumer of one buffer, data points straight into guest ram*/
+typedef void (*vring_fn)(void *ctx, const void *data, __u32 len);
+
+struct vring {
+    char *ram; /*host mapping of guest physical address 0*/
+    __u64 ram_size;
+    volatile struct vring_desc *desc;
+    volatile struct vring_avail *avail;
+    volatile struct vring_used *used;
+    __u16 last_avail; /*next available entry to consume*/
+    __u64 kicks; /*doorbell writes*/
+    __u64 buffers; /*descriptors consumed*/
+    __u64 bytes; /*payload bytes consumed*/
+    __u64 bad; /*descriptors pointing outside guest ram*/
+};
+
+int vring_init(struct vring *vr, void *ram, __u64 ram_size, __u64 gpa);
+long vring_kick(struct vring *vr, vring_fn fn, void *ctx);
+
+#endif
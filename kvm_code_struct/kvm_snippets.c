@@ -0,0 +1,175 @@
+/*
+ * Runs the code[] snippet of kvm_code_struct.c (al + bl as an ascii digit and a
+ * newline out to port 0x3f8, then hlt) once per test vector, millions of times,
+ * through the snippet runner: one warm vm, a pool of vcpu threads, a register
+ * reset per snippet. Every result is checked, snippets/sec is the headline.
+ * author: rkroshan
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "snippet_runner.h"
+
+static const __u8 sum_code[] = {
+    0xba, 0xf8, 0x03, /* mov $0x3f8, %dx */
+    0x00, 0xd8,       /* add %bl, %al */
+    0x04, '0',        /* add $'0', %al */
+    0xee,             /* out %al, (%dx) */
+    0xb0, '\n',       /* mov $'\n', %al */
+    0xee,             /* out %al, (%dx) */
+    0xf4,             /* hlt */
+};
+
+static const __u8 loop_code[] = {
+    0xeb, 0xfe,       /* jmp . */ /*never halts, only the time budget ends it*/
+};
+
+static const char *status_names[SNIPPET_STATUSES] = { "hlt", "exit budget", "timeout", "fault", "invalid" };
+
+/*snippet n of the run: the sum of two digits, every loop_every-th one the endless loop*/
+static void make_snippet(__u64 n, int loop_every, struct snippet *snippet, struct kvm_regs *regs) {
+    memset(regs, 0, sizeof(struct kvm_regs));
+    snippet->regs = regs;
+    if (loop_every && n % loop_every == (__u64)loop_every - 1) {
+        snippet->code = loop_code;
+        snippet->len = sizeof(loop_code);
+        return;
+    }
+    snippet->code = sum_code;
+    snippet->len = sizeof(sum_code);
+    regs->rax = n % 10;
+    regs->rbx = n / 10 % 10;
+}
+
+/*0 when the result is what the snippet has to give*/
+static int check_result(const struct snippet *snippet, const struct kvm_regs *regs, const struct snippet_result *res) {
+    if (snippet->code == loop_code)
+        return res->status == SNIPPET_TIMEOUT ? 0 : -1;
+    __u8 digit = '0' + regs->rax + regs->rbx;
+    return res->status == SNIPPET_HLT && res->out_len == 2 && res->out[0] == digit && res->out[1] == '\n' &&
+                   res->regs.rax == '\n' && res->regs.rbx == regs->rbx && res->regs.rdx == 0x3f8 && res->exits == 3
+               ? 0
+               : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n vcpus] [-N snippets] [-b batch] [-x exits] [-B us] [-l every] [-Y]\n"
+            "  -n vcpus    vcpu pool size (default: online cpus)\n"
+            "  -N count    snippets to run (default 1000000)\n"
+            "  -b batch    snippets per snippet_runner_run() call (default 65536)\n"
+            "  -x exits    exit budget per snippet (default 16)\n"
+            "  -B us       cpu time budget per snippet in microseconds (default 10000), 0 for none\n"
+            "  -l every    every n-th snippet is an endless loop the time budget has to end (default none)\n"
+            "  -Y          reset and read registers through KVM_SET_REGS/KVM_SET_SREGS/KVM_GET_REGS instead of\n"
+            "              KVM_CAP_SYNC_REGS\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct snippet_runner_opts opts = {
+        .nr_vcpus = sysconf(_SC_NPROCESSORS_ONLN),
+        .max_exits = 16,
+        .budget_us = 10000,
+    };
+    __u64 count = 1000000;
+    size_t batch = 65536;
+    int loop_every = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:N:b:x:B:l:Yh")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.nr_vcpus = atoi(optarg);
+            break;
+        case 'N':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            opts.max_exits = atoi(optarg);
+            break;
+        case 'B':
+            opts.budget_us = atoi(optarg);
+            break;
+        case 'l':
+            loop_every = atoi(optarg);
+            break;
+        case 'Y':
+            opts.no_sync_regs = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (opts.nr_vcpus > SNIPPET_MAX_VCPUS)
+        opts.nr_vcpus = SNIPPET_MAX_VCPUS;
+    if (batch == 0 || (loop_every && !opts.budget_us))
+        errx(1, "-b takes at least 1 and -l needs a -B time budget");
+
+    struct snippet *snippets = calloc(batch, sizeof(struct snippet));
+    struct kvm_regs *regs = calloc(batch, sizeof(struct kvm_regs));
+    struct snippet_result *results = calloc(batch, sizeof(struct snippet_result));
+    if (snippets == NULL || regs == NULL || results == NULL)
+        err(1, "calloc");
+
+    struct timespec setup_start, start, end;
+    clock_gettime(CLOCK_MONOTONIC, &setup_start);
+    struct snippet_runner *runner = snippet_runner_create(&opts);
+    if (runner == NULL)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    __u64 statuses[SNIPPET_STATUSES] = { 0 };
+    __u64 wrong = 0, exits = 0, gen_ns = 0;
+    for (__u64 done = 0; done < count;) {
+        size_t nr = count - done < batch ? count - done : batch;
+        struct timespec gen_start, gen_end;
+
+        clock_gettime(CLOCK_MONOTONIC, &gen_start);
+        for (size_t i = 0; i < nr; i++)
+            make_snippet(done + i, loop_every, &snippets[i], &regs[i]);
+        clock_gettime(CLOCK_MONOTONIC, &gen_end);
+        gen_ns += (gen_end.tv_sec - gen_start.tv_sec) * 1000000000L + (gen_end.tv_nsec - gen_start.tv_nsec);
+
+        snippet_runner_run(runner, snippets, results, nr);
+        for (size_t i = 0; i < nr; i++) {
+            statuses[results[i].status]++;
+            exits += results[i].exits;
+            if (check_result(&snippets[i], &regs[i], &results[i]) < 0) {
+                if (wrong++ < 5)
+                    fprintf(stderr, "snippet %llu: %s after %u exits (reason %u), %u out bytes, rax 0x%llx\n",
+                            (unsigned long long)(done + i), status_names[results[i].status], results[i].exits,
+                            results[i].exit_reason, results[i].out_len, (unsigned long long)results[i].regs.rax);
+            }
+        }
+        done += nr;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __u64 kvm_runs, reg_ioctls, sregs_resets;
+    snippet_runner_counters(runner, &kvm_runs, &reg_ioctls, &sregs_resets);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double setup_ms = ((start.tv_sec - setup_start.tv_sec) * 1e9 + (start.tv_nsec - setup_start.tv_nsec)) / 1e6;
+    printf("snippets: %llu on %d vcpus in %.3f s, %.0f snippets/sec (%.2f us each, %.3f s of it generating them)\n",
+           (unsigned long long)count, opts.nr_vcpus, secs, count / secs, secs * 1e6 / count, gen_ns / 1e9);
+    printf("setup %.3f ms, registers through %s: %.2f KVM_RUN and %.2f register ioctls per snippet, %llu sregs resets\n",
+           setup_ms, opts.no_sync_regs ? "ioctls" : "KVM_CAP_SYNC_REGS", (double)kvm_runs / count,
+           (double)reg_ioctls / count, (unsigned long long)sregs_resets);
+    printf("status:");
+    for (int i = 0; i < SNIPPET_STATUSES; i++)
+        printf(" %llu %s%s", (unsigned long long)statuses[i], status_names[i], i + 1 < SNIPPET_STATUSES ? "," : "");
+    printf("; %llu exits, %llu wrong results\n", (unsigned long long)exits, (unsigned long long)wrong);
+
+    snippet_runner_destroy(runner);
+    free(snippets);
+    free(regs);
+    free(results);
+    return wrong ? 1 : 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * Snippet runner, see snippet_runner.h.
+ * author: rkroshan
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "snippet_runner.h"
+
+#define SNIPPET_SYNC_REGS (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)
+
+struct snippet_vcpu {
+    _Alignas(64) int id;
+    int fd;
+    struct kvm_run *run;
+    __u8 *page; /*its code page in the memslot*/
+    pthread_t thread;
+    struct snippet_runner *runner;
+    struct kvm_sregs sregs; /*reset state as the kernel reports it back*/
+    int sregs_dirty; /*the last snippet left other sregs, reset them with the next one*/
+    clockid_t clock; /*cpu time of its thread, what the time budget counts*/
+    atomic_ullong seq; /*snippets started*/
+    atomic_int busy; /*in a snippet*/
+    atomic_ullong kicked; /*seq the watchdog kicked out of KVM_RUN*/
+    __u64 kvm_runs; /*KVM_RUN calls*/
+    __u64 reg_ioctls; /*register get/set ioctls*/
+    __u64 sregs_resets; /*snippets that needed their sregs reset*/
+};
+
+struct snippet_runner {
+    struct snippet_runner_opts opts;
+    int kvm_fd;
+    int vm_fd;
+    __u8 *mem; /*one SNIPPET_PAGE per vcpu*/
+    int mmap_size; /*kvm_run mapping*/
+    int sync_regs; /*KVM_CAP_SYNC_REGS covers regs and sregs*/
+    struct snippet_vcpu *vcpus;
+    pthread_t watchdog;
+    /*the batch in flight, handed to the vcpu threads under lock*/
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    __u64 generation; /*batches started*/
+    int running; /*vcpu threads still working on the batch*/
+    int stop;
+    const struct snippet *snippets;
+    struct snippet_result *results;
+    size_t nr;
+    atomic_size_t next; /*first snippet of the batch nobody took yet*/
+};
+
+static void snippet_kick_handler(int sig) {
+    (void)sig; /*only there to make KVM_RUN return EINTR*/
+}
+
+/*one snippet on this vcpu, from reset to hlt or a budget*/
+static void snippet_run_one(struct snippet_vcpu *vcpu, const struct snippet *snippet, struct snippet_result *res) {
+    struct snippet_runner *runner = vcpu->runner;
+    struct kvm_run *run = vcpu->run;
+    struct kvm_regs regs;
+
+    memset(res, 0, sizeof(struct snippet_result));
+    if (snippet->len == 0 || snippet->len > SNIPPET_PAGE) {
+        res->status = SNIPPET_INVALID;
+        return;
+    }
+    memcpy(vcpu->page, snippet->code, snippet->len);
+    if (snippet->regs)
+        regs = *snippet->regs;
+    else
+        memset(&regs, 0, sizeof(regs));
+    regs.rip = 0; /*cs.base is the page*/
+    regs.rflags |= 0x2;
+    if (regs.rsp == 0)
+        regs.rsp = SNIPPET_PAGE;
+
+    if (runner->sync_regs) { /*written back by the kernel on the way into KVM_RUN, no ioctl*/
+        run->s.regs.regs = regs;
+        run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+        if (vcpu->sregs_dirty) {
+            run->s.regs.sregs = vcpu->sregs;
+            run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+            vcpu->sregs_resets++;
+        }
+    } else {
+        if (ioctl(vcpu->fd, KVM_SET_REGS, &regs) == -1)
+            err(1, "KVM_SET_REGS");
+        if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) == -1) /*without the kernel copy it is unknown what changed*/
+            err(1, "KVM_SET_SREGS");
+        vcpu->reg_ioctls += 2;
+        vcpu->sregs_resets++;
+    }
+
+    __u64 seq = atomic_fetch_add_explicit(&vcpu->seq, 1, memory_order_release) + 1;
+    atomic_store_explicit(&vcpu->busy, 1, memory_order_release);
+    for (;;) {
+        int ret = ioctl(vcpu->fd, KVM_RUN, NULL);
+        vcpu->kvm_runs++;
+        if (ret == -1 && errno == EINTR) {
+            run->immediate_exit = 0;
+            if (atomic_load_explicit(&vcpu->kicked, memory_order_acquire) == seq) {
+                res->status = SNIPPET_TIMEOUT;
+                break;
+            }
+            continue; /*a late kick meant for the snippet before*/
+        }
+        if (ret == -1)
+            err(1, "KVM_RUN");
+        res->exits++;
+        res->exit_reason = run->exit_reason;
+        if (run->exit_reason == KVM_EXIT_HLT) {
+            res->status = SNIPPET_HLT;
+            break;
+        }
+        if (run->exit_reason != KVM_EXIT_IO) {
+            res->status = SNIPPET_FAULT;
+            break;
+        }
+        __u8 *data = (__u8 *)run + run->io.data_offset;
+        __u32 len = run->io.size * run->io.count;
+        if (run->io.direction == KVM_EXIT_IO_OUT) {
+            for (__u32 i = 0; i < len; i++) {
+                if (res->out_len + i < SNIPPET_OUT_MAX)
+                    res->out[res->out_len + i] = data[i];
+            }
+            res->out_len += len;
+        } else {
+            memset(data, 0, len); /*no devices, every in reads 0*/
+        }
+        if (runner->opts.max_exits && res->exits >= runner->opts.max_exits) {
+            res->status = SNIPPET_EXITS;
+            break;
+        }
+    }
+    atomic_store_explicit(&vcpu->busy, 0, memory_order_release);
+
+    /*stopped on an io or mmio exit (budget or fault): the kernel completes it on the next KVM_RUN,
+     *which has to happen now and not after the next snippet's register reset*/
+    if (res->status != SNIPPET_HLT && res->status != SNIPPET_TIMEOUT &&
+        (res->exit_reason == KVM_EXIT_IO || res->exit_reason == KVM_EXIT_MMIO)) {
+        if (res->exit_reason == KVM_EXIT_MMIO && !run->mmio.is_write)
+            memset(run->mmio.data, 0, sizeof(run->mmio.data)); /*no devices, every read is 0*/
+        run->immediate_exit = 1;
+        if (ioctl(vcpu->fd, KVM_RUN, NULL) == -1 && errno != EINTR)
+            err(1, "KVM_RUN");
+        run->immediate_exit = 0;
+        vcpu->kvm_runs++;
+    }
+
+    if (runner->sync_regs) { /*the kernel stored them on the way out*/
+        res->regs = run->s.regs.regs;
+        vcpu->sregs_dirty = memcmp(&run->s.regs.sregs, &vcpu->sregs, sizeof(struct kvm_sregs)) != 0;
+    } else {
+        if (ioctl(vcpu->fd, KVM_GET_REGS, &res->regs) == -1)
+            err(1, "KVM_GET_REGS");
+        vcpu->reg_ioctls++;
+    }
+}
+
+/*vcpu thread: waits for a batch and takes SNIPPET_CHUNK snippets of it at a time until none are left*/
+static void *snippet_vcpu_thread(void *data) {
+    struct snippet_vcpu *vcpu = (struct snippet_vcpu *)data;
+    struct snippet_runner *runner = vcpu->runner;
+    __u64 seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&runner->lock);
+        while (runner->generation == seen && !runner->stop)
+            pthread_cond_wait(&runner->start_cond, &runner->lock);
+        if (runner->stop) {
+            pthread_mutex_unlock(&runner->lock);
+            return NULL;
+        }
+        seen = runner->generation;
+        pthread_mutex_unlock(&runner->lock);
+
+        for (;;) {
+            size_t first = atomic_fetch_add_explicit(&runner->next, SNIPPET_CHUNK, memory_order_relaxed);
+            if (first >= runner->nr)
+                break;
+            size_t last = first + SNIPPET_CHUNK < runner->nr ? first + SNIPPET_CHUNK : runner->nr;
+            for (size_t i = first; i < last; i++)
+                snippet_run_one(vcpu, &runner->snippets[i], &runner->results[i]);
+        }
+
+        pthread_mutex_lock(&runner->lock);
+        if (--runner->running == 0)
+            pthread_cond_signal(&runner->done_cond);
+        pthread_mutex_unlock(&runner->lock);
+    }
+}
+
+static __u64 snippet_cpu_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*watchdog thread: kicks vcpus whose snippet used more than opts.budget_us of cpu out of KVM_RUN.
+ *cpu time of the vcpu thread (guest time included) rather than wall time, a descheduled vcpu
+ *of an oversubscribed pool does not time out. a snippet is timed from the first scan that sees
+ *it, so it gets between one and one and a half budgets*/
+static void *snippet_watchdog_thread(void *data) {
+    struct snippet_runner *runner = (struct snippet_runner *)data;
+    __u64 budget_ns = runner->opts.budget_us * 1000ULL;
+    long interval_us = runner->opts.budget_us / 2 > 50 ? runner->opts.budget_us / 2 : 50;
+    struct timespec interval = { .tv_sec = interval_us / 1000000, .tv_nsec = interval_us % 1000000 * 1000L };
+    __u64 seen_seq[SNIPPET_MAX_VCPUS] = { 0 }, seen_ns[SNIPPET_MAX_VCPUS] = { 0 };
+
+    while (!__atomic_load_n(&runner->stop, __ATOMIC_RELAXED)) {
+        nanosleep(&interval, NULL);
+        for (int i = 0; i < runner->opts.nr_vcpus; i++) {
+            struct snippet_vcpu *vcpu = &runner->vcpus[i];
+            __u64 seq = atomic_load_explicit(&vcpu->seq, memory_order_acquire);
+            if (!atomic_load_explicit(&vcpu->busy, memory_order_acquire))
+                continue;
+            if (seq != seen_seq[i]) { /*a snippet we have not seen yet, its budget starts now*/
+                seen_seq[i] = seq;
+                seen_ns[i] = snippet_cpu_ns(vcpu->clock);
+                continue;
+            }
+            if (snippet_cpu_ns(vcpu->clock) - seen_ns[i] < budget_ns ||
+                atomic_load_explicit(&vcpu->kicked, memory_order_relaxed) == seq)
+                continue;
+            atomic_store_explicit(&vcpu->kicked, seq, memory_order_release);
+            vcpu->run->immediate_exit = 1; /*covers the window before the vcpu enters KVM_RUN again*/
+            pthread_kill(vcpu->thread, runner->opts.kick_signal);
+        }
+    }
+    return NULL;
+}
+
+/*real mode with every segment at the code page of the vcpu, remembered as the kernel reports it*/
+static void snippet_vcpu_init(struct snippet_runner *runner, struct snippet_vcpu *vcpu, int id) {
+    __u64 base = SNIPPET_BASE + (__u64)id * SNIPPET_PAGE;
+
+    vcpu->id = id;
+    vcpu->runner = runner;
+    vcpu->page = runner->mem + (size_t)id * SNIPPET_PAGE;
+    vcpu->fd = ioctl(runner->vm_fd, KVM_CREATE_VCPU, (unsigned long)id);
+    if (vcpu->fd == -1)
+        err(1, "KVM_CREATE_VCPU");
+    vcpu->run = mmap(NULL, runner->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->fd, 0);
+    if (vcpu->run == MAP_FAILED)
+        err(1, "mmap vcpu");
+
+    if (ioctl(vcpu->fd, KVM_GET_SREGS, &vcpu->sregs) == -1)
+        err(1, "KVM_GET_SREGS");
+    struct kvm_segment *segs[] = { &vcpu->sregs.cs, &vcpu->sregs.ds, &vcpu->sregs.es,
+                                   &vcpu->sregs.fs, &vcpu->sregs.gs, &vcpu->sregs.ss };
+    for (size_t i = 0; i < sizeof(segs) / sizeof(segs[0]); i++) {
+        segs[i]->base = base;
+        segs[i]->selector = base >> 4;
+    }
+    if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) == -1)
+        err(1, "KVM_SET_SREGS");
+    if (ioctl(vcpu->fd, KVM_GET_SREGS, &vcpu->sregs) == -1)
+        err(1, "KVM_GET_SREGS");
+    if (runner->sync_regs)
+        vcpu->run->kvm_valid_regs = SNIPPET_SYNC_REGS;
+    if (pthread_create(&vcpu->thread, NULL, snippet_vcpu_thread, vcpu) != 0)
+        errx(1, "can not create vcpu thread");
+    if (pthread_getcpuclockid(vcpu->thread, &vcpu->clock) != 0)
+        errx(1, "no cpu clock for the vcpu thread");
+}
+
+/*one vm, one memslot and the vcpu pool with their threads, ready for snippet_runner_run()*/
+struct snippet_runner *snippet_runner_create(const struct snippet_runner_opts *opts) {
+    struct snippet_runner *runner;
+    struct sigaction sa = { .sa_handler = snippet_kick_handler };
+
+    if (opts->nr_vcpus < 1 || opts->nr_vcpus > SNIPPET_MAX_VCPUS) {
+        fprintf(stderr, "snippet runner takes 1 to %d vcpus\n", SNIPPET_MAX_VCPUS);
+        return NULL;
+    }
+    runner = calloc(1, sizeof(struct snippet_runner));
+    if (runner == NULL)
+        err(1, "calloc");
+    runner->opts = *opts;
+    if (runner->opts.kick_signal == 0)
+        runner->opts.kick_signal = SNIPPET_KICK_SIGNAL;
+    pthread_mutex_init(&runner->lock, NULL);
+    pthread_cond_init(&runner->start_cond, NULL);
+    pthread_cond_init(&runner->done_cond, NULL);
+    if (opts->budget_us && sigaction(runner->opts.kick_signal, &sa, NULL) == -1) /*only the watchdog kicks*/
+        err(1, "sigaction");
+
+    runner->kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
+    if (runner->kvm_fd == -1)
+        err(1, "/dev/kvm");
+    runner->vm_fd = ioctl(runner->kvm_fd, KVM_CREATE_VM, (unsigned long)0);
+    if (runner->vm_fd == -1)
+        err(1, "KVM_CREATE_VM");
+    int caps = ioctl(runner->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+    runner->sync_regs = !opts->no_sync_regs && caps > 0 && (caps & SNIPPET_SYNC_REGS) == SNIPPET_SYNC_REGS;
+    runner->mmap_size = ioctl(runner->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, NULL);
+    if (runner->mmap_size == -1)
+        err(1, "KVM_GET_VCPU_MMAP_SIZE");
+
+    size_t mem_size = (size_t)opts->nr_vcpus * SNIPPET_PAGE;
+    runner->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (runner->mem == MAP_FAILED)
+        err(1, "allocating guest memory");
+    struct kvm_userspace_memory_region region = {
+        .slot = 0,
+        .guest_phys_addr = SNIPPET_BASE,
+        .memory_size = mem_size,
+        .userspace_addr = (__u64)runner->mem,
+    };
+    if (ioctl(runner->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+        err(1, "KVM_SET_USER_MEMORY_REGION");
+
+    runner->vcpus = aligned_alloc(64, opts->nr_vcpus * sizeof(struct snippet_vcpu));
+    if (runner->vcpus == NULL)
+        err(1, "aligned_alloc");
+    memset(runner->vcpus, 0, opts->nr_vcpus * sizeof(struct snippet_vcpu));
+    for (int i = 0; i < opts->nr_vcpus; i++)
+        snippet_vcpu_init(runner, &runner->vcpus[i], i);
+    if (opts->budget_us && pthread_create(&runner->watchdog, NULL, snippet_watchdog_thread, runner) != 0)
+        errx(1, "can not create watchdog thread");
+    return runner;
+}
+
+/*run nr snippets spread over the vcpu pool, results[i] belongs to snippets[i]. returns once all ran*/
+void snippet_runner_run(struct snippet_runner *runner, const struct snippet *snippets, struct snippet_result *results,
+                        size_t nr) {
+    pthread_mutex_lock(&runner->lock);
+    runner->snippets = snippets;
+    runner->results = results;
+    runner->nr = nr;
+    atomic_store_explicit(&runner->next, 0, memory_order_relaxed);
+    runner->running = runner->opts.nr_vcpus;
+    runner->generation++;
+    pthread_cond_broadcast(&runner->start_cond);
+    while (runner->running)
+        pthread_cond_wait(&runner->done_cond, &runner->lock);
+    pthread_mutex_unlock(&runner->lock);
+}
+
+/*totals over every vcpu, only between batches*/
+void snippet_runner_counters(const struct snippet_runner *runner, __u64 *kvm_runs, __u64 *reg_ioctls, __u64 *sregs_resets) {
+    *kvm_runs = *reg_ioctls = *sregs_resets = 0;
+    for (int i = 0; i < runner->opts.nr_vcpus; i++) {
+        *kvm_runs += runner->vcpus[i].kvm_runs;
+        *reg_ioctls += runner->vcpus[i].reg_ioctls;
+        *sregs_resets += runner->vcpus[i].sregs_resets;
+    }
+}
+
+void snippet_runner_destroy(struct snippet_runner *runner) {
+    pthread_mutex_lock(&runner->lock);
+    __atomic_store_n(&runner->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&runner->start_cond);
+    pthread_mutex_unlock(&runner->lock);
+    for (int i = 0; i < runner->opts.nr_vcpus; i++) {
+        pthread_join(runner->vcpus[i].thread, NULL);
+        munmap(runner->vcpus[i].run, runner->mmap_size);
+        close(runner->vcpus[i].fd);
+    }
+    if (runner->opts.budget_us)
+        pthread_join(runner->watchdog, NULL);
+    munmap(runner->mem, (size_t)runner->opts.nr_vcpus * SNIPPET_PAGE);
+    close(runner->vm_fd);
+    close(runner->kvm_fd);
+    free(runner->vcpus);
+    free(runner);
+}
@@ -0,0 +1,71 @@
+/*
+ * Snippet runner: runs short real mode machine code snippets (like the code[]
+ * of kvm_code_struct.c) by the million in one warm vm. Every vcpu of the pool
+ * owns one page of the single memslot and a thread of its own; per snippet it
+ * copies the code into its page, resets regs (and sregs only when the last
+ * snippet changed them) through KVM_CAP_SYNC_REGS, runs to HLT and reads the
+ * registers back from kvm_run, so a snippet without io costs one KVM_RUN.
+ * Out bytes are collected, an exit budget and a cpu time budget (a watchdog
+ * thread kicks vcpus out of KVM_RUN) stop snippets that do not halt.
+ * Snippets share the guest physical space: stores outside their own page
+ * reach the pages of the other vcpus.
+ * author: rkroshan
+ */
+
+#ifndef SNIPPET_RUNNER_H
+#define SNIPPET_RUNNER_H
+
+#include <stddef.h>
+#include <linux/types.h>
+#include <linux/kvm.h>
+
+#define SNIPPET_PAGE 0x1000 /*code page of a vcpu, the snippet starts at its first byte*/
+#define SNIPPET_BASE 0x1000 /*guest physical page of vcpu 0, above the real mode ivt*/
+#define SNIPPET_MAX_VCPUS 64
+#define SNIPPET_OUT_MAX 16 /*out bytes kept per snippet, the rest is only counted*/
+#define SNIPPET_CHUNK 64 /*snippets a vcpu thread takes from the batch at a time*/
+#define SNIPPET_KICK_SIGNAL SIGUSR1 /*default of snippet_runner_opts.kick_signal*/
+
+/*how a snippet ended*/
+#define SNIPPET_HLT     0 /*ran to hlt*/
+#define SNIPPET_EXITS   1 /*exit budget used up*/
+#define SNIPPET_TIMEOUT 2 /*time budget used up, kicked out of KVM_RUN*/
+#define SNIPPET_FAULT   3 /*any other exit (mmio, shutdown, internal error), see exit_reason*/
+#define SNIPPET_INVALID 4 /*empty or bigger than SNIPPET_PAGE, never ran*/
+#define SNIPPET_STATUSES 5
+
+struct snippet {
+    const __u8 *code;
+    __u32 len; /*at most SNIPPET_PAGE*/
+    const struct kvm_regs *regs; /*start registers, NULL for zeros. rip is always the start of the
+                                  *page, rflags gets its reserved bit 1 and a zero rsp the page end*/
+};
+
+struct snippet_result {
+    struct kvm_regs regs; /*registers once it stopped*/
+    __u8 out[SNIPPET_OUT_MAX]; /*bytes of its outs, in order*/
+    __u32 out_len; /*out bytes, also those beyond SNIPPET_OUT_MAX*/
+    __u32 exits; /*KVM_RUN round trips*/
+    __u32 exit_reason; /*of the last exit*/
+    __u8 status; /*SNIPPET_**/
+};
+
+struct snippet_runner_opts {
+    int nr_vcpus; /*pool size, 1 to SNIPPET_MAX_VCPUS*/
+    __u32 max_exits; /*exit budget per snippet, 0 for no limit*/
+    __u32 budget_us; /*cpu time budget per snippet, 0 for no limit (a snippet that loops hangs its vcpu)*/
+    int no_sync_regs; /*reset and read registers through the ioctls instead of KVM_CAP_SYNC_REGS*/
+    int kick_signal; /*signal the watchdog kicks vcpus with, 0 for SNIPPET_KICK_SIGNAL*/
+};
+
+struct snippet_runner;
+
+/*with a budget_us it installs a process wide handler for kick_signal (sigaction, left in place by
+ *snippet_runner_destroy()), pick a signal the rest of the program does not use*/
+struct snippet_runner *snippet_runner_create(const struct snippet_runner_opts *opts);
+void snippet_runner_run(struct snippet_runner *runner, const struct snippet *snippets, struct snippet_result *results,
+                        size_t nr);
+void snippet_runner_counters(const struct snippet_runner *runner, __u64 *kvm_runs, __u64 *reg_ioctls, __u64 *sregs_resets);
+void snippet_runner_destroy(struct snippet_runner *runner);
+
+#endif